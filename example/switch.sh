@@ -1,11 +1,9 @@
 #!/bin/bash
 DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
-STATUS=$("$DIR"/../service/als-controller -s)
-if [ "$STATUS" = "0" ]; then
-  "$DIR"/../service/als-controller -e
+STATUS=$("$DIR"/../service/als-controller -t)
+if [ "$STATUS" = "1" ]; then
   notify-send -c "device" -i "$DIR/"'images/active.svg' 'Ambient Light Sensor' 'Enabled'
-elif [ "$STATUS" = "1" ]; then
-  "$DIR"/../service/als-controller -d
+elif [ "$STATUS" = "0" ]; then
   notify-send -c "device" -i "$DIR/"'images/inactive.svg' 'Ambient Light Sensor' 'Disabled'
 else
   echo "Error: $STATUS"
@@ -0,0 +1,59 @@
+TEMPLATE = app
+TARGET = als-benchmark
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG -= qt
+
+# Lives next to als-controller.pro: keep generated files apart
+MAKEFILE = Makefile.benchmark
+OBJECTS_DIR = .obj-benchmark
+
+SOURCES += benchmark.cpp \
+    faketree.cpp \
+    controller.cpp \
+    attribute.cpp \
+    backlight.cpp \
+    ramp.cpp \
+    devices.cpp \
+    server.cpp \
+    metrics.cpp \
+    trace.cpp \
+    sampler.cpp \
+    curve.cpp \
+    filter.cpp \
+    lid.cpp \
+    sensor.cpp \
+    iio.cpp \
+    record.cpp \
+    logger.cpp \
+    alsclient.cpp \
+    comsock.cpp
+
+HEADERS += \
+    faketree.h \
+    comsock.h \
+    controller.h \
+    attribute.h \
+    backlight.h \
+    ramp.h \
+    devices.h \
+    server.h \
+    events.h \
+    metrics.h \
+    trace.h \
+    sampler.h \
+    curve.h \
+    filter.h \
+    lid.h \
+    sensor.h \
+    iio.h \
+    record.h \
+    logger.h \
+    alsclient.h
+
+# Count the system calls made by the controller (see benchmark.cpp)
+QMAKE_LFLAGS += -Wl,--wrap=open,--wrap=close,--wrap=read,--wrap=write,--wrap=pread,--wrap=pwrite \
+    -Wl,--wrap=ftruncate,--wrap=fstat,--wrap=poll,--wrap=timerfd_settime \
+    -Wl,--wrap=socket,--wrap=connect,--wrap=sendmsg
+
+LIBS += -pthread
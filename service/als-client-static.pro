@@ -0,0 +1,19 @@
+TEMPLATE = lib
+TARGET = als-client
+CONFIG += staticlib
+CONFIG -= qt
+
+# Lives next to als-controller.pro: keep generated files apart
+MAKEFILE = Makefile.client-static
+OBJECTS_DIR = .obj-client-static
+
+SOURCES += alsclient.cpp \
+    comsock.cpp \
+    metrics.cpp \
+    trace.cpp
+
+HEADERS += alsclient.h \
+    comsock.h \
+    events.h \
+    metrics.h \
+    trace.h
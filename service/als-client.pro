@@ -0,0 +1,25 @@
+TEMPLATE = lib
+TARGET = als-client
+VERSION = 1.0.0
+CONFIG -= qt
+
+# Lives next to als-controller.pro: keep generated files apart.
+# als-client-static.pro builds the same library as an archive.
+MAKEFILE = Makefile.client
+OBJECTS_DIR = .obj-client
+
+SOURCES += alsclient.cpp \
+    comsock.cpp \
+    metrics.cpp \
+    trace.cpp
+
+HEADERS += alsclient.h \
+    comsock.h \
+    events.h \
+    metrics.h \
+    trace.h
+
+# Only the API of alsclient.h is exported, see the pragmas there
+QMAKE_CXXFLAGS += -fvisibility=hidden
+
+LIBS += -pthread
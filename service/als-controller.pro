@@ -4,11 +4,49 @@ CONFIG -= app_bundle
 CONFIG -= qt
 
 SOURCES += main.cpp \
+    controller.cpp \
+    attribute.cpp \
+    backlight.cpp \
+    ramp.cpp \
+    devices.cpp \
+    server.cpp \
+    metrics.cpp \
+    trace.cpp \
+    sampler.cpp \
+    curve.cpp \
+    filter.cpp \
+    lid.cpp \
+    sensor.cpp \
+    iio.cpp \
+    record.cpp \
+    logger.cpp \
     client.cpp \
+    alsclient.cpp \
     comsock.cpp
 
 HEADERS += \
     comsock.h \
-    client.h
+    controller.h \
+    client.h \
+    alsclient.h \
+    attribute.h \
+    backlight.h \
+    ramp.h \
+    devices.h \
+    server.h \
+    events.h \
+    metrics.h \
+    trace.h \
+    sampler.h \
+    curve.h \
+    filter.h \
+    lid.h \
+    sensor.h \
+    iio.h \
+    record.h \
+    logger.h
+
+# Tracing (trace.h) is compiled in; uncomment to leave it out
+#DEFINES += ALS_NO_TRACE
 
 LIBS += -pthread -lbsd
@@ -0,0 +1,14 @@
+TEMPLATE = app
+TARGET = als-simulator
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG -= qt
+
+# Lives next to als-controller.pro: keep generated files apart
+MAKEFILE = Makefile.simulator
+OBJECTS_DIR = .obj-simulator
+
+SOURCES += simulator.cpp \
+    faketree.cpp
+
+HEADERS += faketree.h
@@ -0,0 +1,52 @@
+TEMPLATE = app
+TARGET = als-tests
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG -= qt
+
+# Lives next to als-controller.pro: keep generated files apart
+MAKEFILE = Makefile.tests
+OBJECTS_DIR = .obj-tests
+
+SOURCES += tests.cpp \
+    faketree.cpp \
+    controller.cpp \
+    attribute.cpp \
+    backlight.cpp \
+    ramp.cpp \
+    devices.cpp \
+    server.cpp \
+    metrics.cpp \
+    trace.cpp \
+    sampler.cpp \
+    curve.cpp \
+    filter.cpp \
+    lid.cpp \
+    sensor.cpp \
+    iio.cpp \
+    record.cpp \
+    logger.cpp \
+    comsock.cpp
+
+HEADERS += \
+    faketree.h \
+    comsock.h \
+    controller.h \
+    attribute.h \
+    backlight.h \
+    ramp.h \
+    devices.h \
+    server.h \
+    events.h \
+    metrics.h \
+    trace.h \
+    sampler.h \
+    curve.h \
+    filter.h \
+    lid.h \
+    sensor.h \
+    iio.h \
+    record.h \
+    logger.h
+
+LIBS += -pthread
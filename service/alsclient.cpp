@@ -0,0 +1,542 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <string>
+#include <map>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "alsclient.h"
+#include "comsock.h"
+#include "events.h"
+#include "metrics.h"
+#include "trace.h"
+
+using namespace std;
+
+// The public event kinds are those of events.h
+typedef char event_kinds_match[ALS_EVENT_KINDS == EVENT_KINDS && ALS_EVENT_LID == EVENT_LID ? 1 : -1];
+
+/** Message sent for each ALS_REQUEST_* */
+static const char REQUEST_TYPES[ALS_REQUESTS] = {
+    MSG_ENABLE, MSG_DISABLE, MSG_STATUS, MSG_TOGGLE, MSG_RELOAD, MSG_STATS, MSG_TRACE
+};
+
+typedef struct {
+    int request;
+    als_reply_cb cb;
+    void *arg;
+} pending_t;
+
+struct als_client {
+    string path;
+    int fd;
+    msgreader_t reader;
+    int timeoutMs;
+    unsigned short lastId;
+    /** requests sent and not answered yet, by id */
+    map<unsigned short, pending_t> pending;
+    bool subscribed;
+    als_event_cb eventCb;
+    void *eventArg;
+};
+
+static long long monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Closes the connection; the requests in flight fail with \a status */
+static void disconnect(als_client_t *c, int status)
+{
+    if(c->fd != -1) {
+        closeConnection(c->fd);
+        c->fd = -1;
+    }
+    resetMessageReader(&c->reader);
+
+    map<unsigned short, pending_t> lost;
+    lost.swap(c->pending);
+    for(map<unsigned short, pending_t>::iterator it = lost.begin(); it != lost.end(); ++it) {
+        if(it->second.cb == NULL)
+            continue;
+        als_reply_t reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.request = it->second.request;
+        reply.status = status;
+        it->second.cb(&reply, it->second.arg);
+    }
+}
+
+/**
+ * Sends a message without payload.
+ * \retval ALS_OK, ALS_ERR_IO if the connection is lost (the message wasn't
+ *         delivered), ALS_ERR_TIMEOUT if the daemon doesn't read it
+ */
+static int sendRequest(als_client_t *c, char type, unsigned short id)
+{
+    message_t msg;
+    msg.type = type;
+    msg.id = id;
+    msg.buffer = NULL;
+    msg.length = 0;
+    char frame[MSG_HEADER_LEN];
+    int length = packMessage(&msg, MSG_FRAMING_BINARY, frame, sizeof(frame));
+
+    int sent = 0;
+    while(sent < length) {
+        ssize_t n = send(c->fd, frame + sent, length - sent, MSG_NOSIGNAL);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Too many requests in flight: wait until the daemon reads some
+            struct pollfd pfd = { c->fd, POLLOUT, 0 };
+            int ret = poll(&pfd, 1, c->timeoutMs);
+            if(ret == -1 && errno == EINTR)
+                continue;
+            if(ret <= 0)
+                return ALS_ERR_TIMEOUT;
+            continue;
+        }
+        if(n == -1)
+            return ALS_ERR_IO;
+        sent += n;
+    }
+    return ALS_OK;
+}
+
+/** Calls the callback waiting for \a msg. \return the callbacks called (0 or 1) */
+static int deliver(als_client_t *c, message_t *msg)
+{
+    if(msg->type == MSG_EVENT && msg->id == 0) {
+        int kind;
+        int32_t value;
+        // Kinds added by a newer daemon are skipped
+        bool valid = unpackEvent(msg, &kind, &value) == 0;
+        releaseMessage(&c->reader, msg);
+        if(!valid || c->eventCb == NULL)
+            return 0;
+        c->eventCb(kind, value, c->eventArg);
+        return 1;
+    }
+
+    map<unsigned short, pending_t>::iterator it = c->pending.find(msg->id);
+    if(it == c->pending.end()) {
+        // The answer to a request that timed out
+        releaseMessage(&c->reader, msg);
+        return 0;
+    }
+    pending_t p = it->second;
+    c->pending.erase(it);
+
+    // The callback may make requests, and even lose the connection and
+    // the reader with it: the payload must not live there
+    string data(msg->buffer != NULL ? msg->buffer : "", msg->length);
+    char type = msg->type;
+    releaseMessage(&c->reader, msg);
+
+    als_reply_t reply;
+    reply.request = p.request;
+    reply.status = ALS_OK;
+    reply.enabled = 0;
+    reply.data = data.data();
+    reply.length = data.size();
+
+    switch(p.request) {
+    case ALS_REQUEST_RELOAD:
+        if(type == MSG_FAILED)
+            reply.status = ALS_ERR_FAILED;
+        else if(type != MSG_RELOADED)
+            reply.status = ALS_ERR_PROTOCOL;
+        break;
+    case ALS_REQUEST_STATS:
+        if(type != MSG_STATS_DATA)
+            reply.status = ALS_ERR_PROTOCOL;
+        break;
+    case ALS_REQUEST_TRACE:
+        if(type != MSG_TRACE_DATA)
+            reply.status = ALS_ERR_PROTOCOL;
+        break;
+    default:
+        if(type == MSG_ENABLED || type == MSG_DISABLED)
+            reply.enabled = type == MSG_ENABLED;
+        else
+            reply.status = ALS_ERR_PROTOCOL;
+    }
+
+    if(p.cb == NULL)
+        return 0;
+    p.cb(&reply, p.arg);
+    return 1;
+}
+
+/**
+ * Delivers the messages received so far.
+ * \return the callbacks called, ALS_ERR_IO if the connection was lost
+ */
+static int readMessages(als_client_t *c)
+{
+    int count = 0, ret = 0;
+    message_t msg;
+    while(c->fd != -1 && (ret = readMessageNB(c->fd, &c->reader, &msg)) == 1)
+        count += deliver(c, &msg);
+    if(c->fd != -1 && ret == -1) {
+        disconnect(c, ALS_ERR_IO);
+        return ALS_ERR_IO;
+    }
+    return count;
+}
+
+als_client_t *alsOpen(const char *socketPath)
+{
+    als_client_t *c = new(nothrow) als_client_t;
+    if(c == NULL)
+        return NULL;
+    c->path = socketPath != NULL ? socketPath : ALS_DEFAULT_SOCKET;
+    c->fd = -1;
+    initMessageReader(&c->reader);
+    // Traces are the longest answers
+    c->reader.maxLength = traceDumpMaxSize() > MSG_MAX_LENGTH ? traceDumpMaxSize() : MSG_MAX_LENGTH;
+    c->timeoutMs = ALS_DEFAULT_TIMEOUT_MS;
+    c->lastId = 0;
+    c->subscribed = false;
+    c->eventCb = NULL;
+    c->eventArg = NULL;
+    return c;
+}
+
+void alsClose(als_client_t *c)
+{
+    if(c == NULL)
+        return;
+    if(c->fd != -1)
+        closeConnection(c->fd);
+    resetMessageReader(&c->reader);
+    delete c;
+}
+
+void alsSetTimeout(als_client_t *c, int timeoutMs)
+{
+    if(c != NULL)
+        c->timeoutMs = timeoutMs < 0 ? -1 : timeoutMs;
+}
+
+int alsConnect(als_client_t *c)
+{
+    if(c == NULL)
+        return ALS_ERR_INVALID;
+    if(c->fd != -1)
+        return ALS_OK;
+
+    int fd = openConnectionMs((char *)c->path.c_str(), CONNECT_FIRST_DELAY_MS, CONNECT_DEADLINE_MS);
+    if(fd == -1)
+        return ALS_ERR_CONNECT;
+    // Answers are read as they come (see alsDispatch()), and the connection
+    // must not leak into the programs started by the caller
+    int flags = fcntl(fd, F_GETFL);
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+            fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        closeConnection(fd);
+        return ALS_ERR_CONNECT;
+    }
+    c->fd = fd;
+
+    if(c->subscribed && sendRequest(c, MSG_SUBSCRIBE, 0) != ALS_OK) {
+        disconnect(c, ALS_ERR_IO);
+        return ALS_ERR_CONNECT;
+    }
+    return ALS_OK;
+}
+
+int alsRequest(als_client_t *c, int request, als_reply_cb cb, void *arg)
+{
+    if(c == NULL || request < 0 || request >= ALS_REQUESTS)
+        return ALS_ERR_INVALID;
+    // Ids are 16 bits, and 0 means "no answer"
+    if(c->pending.size() >= USHRT_MAX - 1)
+        return ALS_ERR_INVALID;
+
+    for(int attempt = 0; ; attempt++) {
+        int ret = alsConnect(c);
+        if(ret != ALS_OK)
+            return ret;
+
+        do {
+            c->lastId++;
+        } while(c->lastId == 0 || c->pending.count(c->lastId) > 0);
+
+        ret = sendRequest(c, REQUEST_TYPES[request], c->lastId);
+        if(ret == ALS_OK) {
+            pending_t p = { request, cb, arg };
+            c->pending[c->lastId] = p;
+            return ALS_OK;
+        }
+        // Most likely the daemon was restarted since the last request:
+        // this one didn't reach it, it can be sent again
+        disconnect(c, ALS_ERR_IO);
+        if(ret != ALS_ERR_IO || attempt > 0)
+            return ret;
+    }
+}
+
+int alsSubscribe(als_client_t *c, als_event_cb cb, void *arg)
+{
+    if(c == NULL)
+        return ALS_ERR_INVALID;
+    c->eventCb = cb;
+    c->eventArg = arg;
+    if(c->subscribed)
+        return ALS_OK;
+
+    // A new connection subscribes by itself
+    bool connected = c->fd != -1;
+    c->subscribed = true;
+    int ret = connected ? sendRequest(c, MSG_SUBSCRIBE, 0) : alsConnect(c);
+    if(ret == ALS_ERR_IO) {
+        disconnect(c, ALS_ERR_IO);
+        ret = alsConnect(c);
+    }
+    if(ret != ALS_OK)
+        c->subscribed = false;
+    return ret;
+}
+
+int alsGetFd(const als_client_t *c)
+{
+    return c != NULL ? c->fd : -1;
+}
+
+int alsDispatch(als_client_t *c, int timeoutMs)
+{
+    if(c == NULL)
+        return ALS_ERR_INVALID;
+    if(c->fd == -1) {
+        // Nothing can arrive, unless we are subscribed
+        if(!c->subscribed)
+            return 0;
+        int ret = alsConnect(c);
+        if(ret != ALS_OK)
+            return ret;
+    }
+
+    // Messages already in the reader don't make the socket readable
+    if(c->reader.inEnd > c->reader.inStart) {
+        int count = readMessages(c);
+        if(count != 0)
+            return count;
+    }
+
+    struct pollfd pfd = { c->fd, POLLIN, 0 };
+    int n = poll(&pfd, 1, timeoutMs);
+    if(n == -1)
+        return errno == EINTR ? 0 : ALS_ERR_IO;
+    if(n == 0)
+        return 0;
+
+    int count = readMessages(c);
+    if(count == ALS_ERR_IO && c->subscribed) {
+        int ret = alsConnect(c);
+        return ret == ALS_OK ? 0 : ret;
+    }
+    return count;
+}
+
+/* -= Blocking calls =- */
+
+typedef struct {
+    bool done;
+    int status;
+    int enabled;
+    string data;
+} result_t;
+
+static void storeResult(const als_reply_t *reply, void *arg)
+{
+    result_t *r = (result_t *)arg;
+    r->done = true;
+    r->status = reply->status;
+    r->enabled = reply->enabled;
+    r->data.assign(reply->data != NULL ? reply->data : "", reply->length);
+}
+
+/** Forgets the request answering to \a r, which won't wait any longer */
+static void forget(als_client_t *c, result_t *r)
+{
+    map<unsigned short, pending_t>::iterator it;
+    for(it = c->pending.begin(); it != c->pending.end(); ++it) {
+        if(it->second.arg == r) {
+            c->pending.erase(it);
+            return;
+        }
+    }
+}
+
+/** Makes \a request and waits for its answer */
+static int call(als_client_t *c, int request, result_t *r)
+{
+    if(c == NULL)
+        return ALS_ERR_INVALID;
+
+    for(int attempt = 0; ; attempt++) {
+        r->done = false;
+        int ret = alsRequest(c, request, storeResult, r);
+        if(ret != ALS_OK)
+            return ret;
+
+        long long deadline = monotonicMs() + c->timeoutMs;
+        while(!r->done) {
+            int left = c->timeoutMs < 0 ? -1 : (int)(deadline - monotonicMs());
+            if(c->timeoutMs >= 0 && left <= 0) {
+                forget(c, r);
+                return ALS_ERR_TIMEOUT;
+            }
+            ret = alsDispatch(c, left);
+            if(ret < 0 && !r->done) {
+                forget(c, r);
+                return ret;
+            }
+        }
+
+        // The connection was lost after the request was sent: run it
+        // again on a new one, unless running it twice makes a difference
+        if(r->status != ALS_ERR_IO || attempt > 0 || request == ALS_REQUEST_TOGGLE)
+            return r->status;
+    }
+}
+
+int alsGetStatus(als_client_t *c, int *enabled)
+{
+    result_t r;
+    int ret = call(c, ALS_REQUEST_STATUS, &r);
+    if(ret == ALS_OK && enabled != NULL)
+        *enabled = r.enabled;
+    return ret;
+}
+
+int alsSetEnabled(als_client_t *c, int enabled)
+{
+    result_t r;
+    return call(c, enabled ? ALS_REQUEST_ENABLE : ALS_REQUEST_DISABLE, &r);
+}
+
+int alsToggle(als_client_t *c, int *enabled)
+{
+    result_t r;
+    int ret = call(c, ALS_REQUEST_TOGGLE, &r);
+    if(ret == ALS_OK && enabled != NULL)
+        *enabled = r.enabled;
+    return ret;
+}
+
+int alsReload(als_client_t *c, char *error, size_t size)
+{
+    result_t r;
+    int ret = call(c, ALS_REQUEST_RELOAD, &r);
+    if(ret == ALS_ERR_FAILED && error != NULL && size > 0)
+        snprintf(error, size, "%s", r.data.c_str());
+    return ret;
+}
+
+int alsGetMetricsText(als_client_t *c, char **text)
+{
+    result_t r;
+    metrics_t metrics;
+    int ret = call(c, ALS_REQUEST_STATS, &r);
+    if(ret != ALS_OK)
+        return ret;
+    if(decodeMetrics(r.data.data(), r.data.size(), &metrics) == -1)
+        return ALS_ERR_PROTOCOL;
+    *text = strdup(renderMetrics(&metrics).c_str());
+    return *text != NULL ? ALS_OK : ALS_ERR_NOMEM;
+}
+
+int alsPrintTrace(als_client_t *c, FILE *out)
+{
+    result_t r;
+    int ret = call(c, ALS_REQUEST_TRACE, &r);
+    if(ret != ALS_OK)
+        return ret;
+    return decodeTrace(r.data.data(), r.data.size(), out) == -1 ? ALS_ERR_PROTOCOL : ALS_OK;
+}
+
+const char *alsStrerror(int status)
+{
+    switch(status) {
+    case ALS_OK: return "Success";
+    case ALS_ERR_CONNECT: return "Cannot connect to als-controller";
+    case ALS_ERR_IO: return "Connection to als-controller lost";
+    case ALS_ERR_TIMEOUT: return "No answer from als-controller";
+    case ALS_ERR_PROTOCOL: return "Unexpected answer from als-controller";
+    case ALS_ERR_FAILED: return "Request failed";
+    case ALS_ERR_INVALID: return "Invalid argument";
+    case ALS_ERR_NOMEM: return "Out of memory";
+    }
+    return "Unknown error";
+}
+
+/* -= C++ interface =- */
+
+int AlsClient::getStatus(bool *enabled)
+{
+    int e;
+    int ret = alsGetStatus(c, &e);
+    if(ret == ALS_OK)
+        *enabled = e;
+    return ret;
+}
+
+int AlsClient::toggle(bool *enabled)
+{
+    int e;
+    int ret = alsToggle(c, &e);
+    if(ret == ALS_OK)
+        *enabled = e;
+    return ret;
+}
+
+int AlsClient::reload(string *error)
+{
+    result_t r;
+    int ret = call(c, ALS_REQUEST_RELOAD, &r);
+    if(ret == ALS_ERR_FAILED && error != NULL)
+        *error = r.data;
+    return ret;
+}
+
+int AlsClient::getMetrics(metrics_t *m)
+{
+    result_t r;
+    int ret = call(c, ALS_REQUEST_STATS, &r);
+    if(ret != ALS_OK)
+        return ret;
+    return decodeMetrics(r.data.data(), r.data.size(), m) == -1 ? ALS_ERR_PROTOCOL : ALS_OK;
+}
+
+int AlsClient::getTrace(string *data)
+{
+    result_t r;
+    int ret = call(c, ALS_REQUEST_TRACE, &r);
+    if(ret == ALS_OK)
+        data->swap(r.data);
+    return ret;
+}
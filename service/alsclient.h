@@ -0,0 +1,194 @@
+#ifndef ALSCLIENT_H
+#define ALSCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Client library of als-controller (libals-client), usable from C and C++.
+ *
+ * An als_client_t keeps one connection to the daemon open for all its
+ * requests, and opens it again when the daemon was restarted: a request
+ * that couldn't be delivered is sent again on the new connection, and so
+ * is a subscription. The connection is opened at the first request.
+ *
+ * Requests can be made in two ways:
+ *  - blocking: alsGetStatus(), alsSetEnabled(), ... wait for the answer,
+ *    at most the timeout set with alsSetTimeout();
+ *  - asynchronous: alsRequest() sends the request and returns, and the
+ *    callback gets the answer from alsDispatch(). Any number of requests
+ *    can be in flight, the daemon answers them in order. alsGetFd() is
+ *    the descriptor to poll() in the caller's event loop.
+ * Events of a subscription (alsSubscribe()) are delivered by alsDispatch()
+ * and by the blocking calls.
+ *
+ * Every function returns ALS_OK or one of the ALS_ERR_* codes below, and
+ * never exits or prints anything. An als_client_t must not be used by
+ * more than one thread at a time, nor closed from its callbacks.
+ */
+
+#define ALS_OK            0
+/** the daemon isn't running (or the socket can't be reached) */
+#define ALS_ERR_CONNECT  -1
+/** the connection was lost and the request may not have been executed */
+#define ALS_ERR_IO       -2
+/** no answer within the timeout */
+#define ALS_ERR_TIMEOUT  -3
+/** the daemon answered something unexpected */
+#define ALS_ERR_PROTOCOL -4
+/** the daemon couldn't execute the request (see the message of alsReload()) */
+#define ALS_ERR_FAILED   -5
+#define ALS_ERR_INVALID  -6
+#define ALS_ERR_NOMEM    -7
+
+#define ALS_DEFAULT_SOCKET "/var/run/als-controller.socket"
+/** Default timeout of the blocking calls (ms) */
+#define ALS_DEFAULT_TIMEOUT_MS 5000
+
+/** Requests of alsRequest() */
+enum {
+    ALS_REQUEST_ENABLE,
+    ALS_REQUEST_DISABLE,
+    ALS_REQUEST_STATUS,
+    ALS_REQUEST_TOGGLE,
+    ALS_REQUEST_RELOAD,
+    /** metrics, encoded as described in metrics.h */
+    ALS_REQUEST_STATS,
+    /** recent events, encoded as described in trace.h */
+    ALS_REQUEST_TRACE,
+    ALS_REQUESTS
+};
+
+/** Events of a subscription, the same as the EVENT_* of events.h */
+enum {
+    ALS_EVENT_ENABLED,
+    ALS_EVENT_LUX,
+    ALS_EVENT_LID,
+    ALS_EVENT_SCREEN,
+    ALS_EVENT_KEYBOARD,
+    ALS_EVENT_KINDS
+};
+
+/** Answer to a request made with alsRequest() */
+typedef struct {
+    /** ALS_REQUEST_* */
+    int request;
+    /** ALS_OK or ALS_ERR_* */
+    int status;
+    /** state of the daemon after the request (enable, disable, status and toggle) */
+    int enabled;
+    /** payload of stats and trace, error message of a failed reload; only
+        valid during the callback */
+    const char *data;
+    size_t length;
+} als_reply_t;
+
+typedef void (*als_reply_cb)(const als_reply_t *reply, void *arg);
+typedef void (*als_event_cb)(int kind, int32_t value, void *arg);
+
+typedef struct als_client als_client_t;
+
+/* libals-client is built with -fvisibility=hidden: only what is declared
+ * between these pragmas is exported. */
+#pragma GCC visibility push(default)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Creates a client of the daemon listening on \a socketPath (NULL for
+ * ALS_DEFAULT_SOCKET, '@' for an abstract name). Doesn't connect yet.
+ * \return the client, NULL if out of memory
+ */
+als_client_t *alsOpen(const char *socketPath);
+/** Closes the connection and frees \a c. Pending callbacks are not called. */
+void alsClose(als_client_t *c);
+/** Timeout of the blocking calls, -1 for none */
+void alsSetTimeout(als_client_t *c, int timeoutMs);
+/** Connects now, if not connected yet */
+int alsConnect(als_client_t *c);
+
+int alsGetStatus(als_client_t *c, int *enabled);
+int alsSetEnabled(als_client_t *c, int enabled);
+int alsToggle(als_client_t *c, int *enabled);
+/** On ALS_ERR_FAILED, \a error (if not NULL) gets the reason, truncated to \a size */
+int alsReload(als_client_t *c, char *error, size_t size);
+/** Gets the metrics in the Prometheus text format, in \a text (to free()) */
+int alsGetMetricsText(als_client_t *c, char **text);
+/** Prints the recent events of the daemon to \a out */
+int alsPrintTrace(als_client_t *c, FILE *out);
+
+/**
+ * Sends \a request (ALS_REQUEST_*) and returns without waiting: \a cb is
+ * called by alsDispatch() with the answer, or with an error if the
+ * connection is lost first. \a cb may be NULL.
+ */
+int alsRequest(als_client_t *c, int request, als_reply_cb cb, void *arg);
+/**
+ * Asks the daemon for its events: \a cb gets the current state first,
+ * then every change. Stays in effect across reconnections.
+ */
+int alsSubscribe(als_client_t *c, als_event_cb cb, void *arg);
+/** The descriptor to poll for POLLIN before alsDispatch(), -1 if not connected */
+int alsGetFd(const als_client_t *c);
+/**
+ * Waits up to \a timeoutMs (0 not at all, -1 forever) for answers and
+ * events, and calls their callbacks. A subscribed client whose connection
+ * was lost connects again here.
+ * \return the number of callbacks called, or ALS_ERR_*
+ */
+int alsDispatch(als_client_t *c, int timeoutMs);
+
+/** Describes an ALS_ERR_* code */
+const char *alsStrerror(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#pragma GCC visibility pop
+
+#ifdef __cplusplus
+#include <string>
+#include "metrics.h"
+
+#pragma GCC visibility push(default)
+
+/** C++ interface to the same client; see the functions above */
+class AlsClient
+{
+public:
+    explicit AlsClient(const std::string &socketPath = ALS_DEFAULT_SOCKET) {
+        c = alsOpen(socketPath.c_str());
+    }
+    ~AlsClient() { alsClose(c); }
+
+    void setTimeout(int timeoutMs) { alsSetTimeout(c, timeoutMs); }
+    int connect() { return alsConnect(c); }
+
+    int getStatus(bool *enabled);
+    int setEnabled(bool enabled) { return alsSetEnabled(c, enabled); }
+    int toggle(bool *enabled);
+    int reload(std::string *error);
+    int getMetrics(metrics_t *m);
+    /** Gets the recent events, encoded as described in trace.h */
+    int getTrace(std::string *data);
+
+    int request(int request, als_reply_cb cb, void *arg) { return alsRequest(c, request, cb, arg); }
+    int subscribe(als_event_cb cb, void *arg) { return alsSubscribe(c, cb, arg); }
+    int getFd() const { return alsGetFd(c); }
+    int dispatch(int timeoutMs) { return alsDispatch(c, timeoutMs); }
+
+private:
+    AlsClient(const AlsClient &);
+    AlsClient &operator=(const AlsClient &);
+
+    als_client_t *c;
+};
+
+#pragma GCC visibility pop
+#endif // __cplusplus
+
+#endif // ALSCLIENT_H
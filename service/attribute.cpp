@@ -0,0 +1,129 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include "attribute.h"
+
+using namespace std;
+
+static bool isStale(int err) {
+    return err == ESTALE || err == ENODEV;
+}
+
+Attribute::Attribute()
+{
+    fd = -1;
+    flags = O_RDONLY;
+    regular = false;
+}
+
+Attribute::~Attribute()
+{
+    close();
+}
+
+int Attribute::open(string path, int flags)
+{
+    close();
+    this->path = path;
+    this->flags = flags;
+    fd = ::open(path.c_str(), flags | O_CLOEXEC);
+    if(fd == -1)
+        return -1;
+
+    struct stat st;
+    regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    return 0;
+}
+
+void Attribute::close()
+{
+    if(fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+int Attribute::reopen()
+{
+    if(path.empty()) {
+        errno = EBADF;
+        return -1;
+    }
+    return open(path, flags);
+}
+
+ssize_t Attribute::read(char *buf, size_t len)
+{
+    if(len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(fd < 0 && reopen() == -1)
+        return -1;
+
+    ssize_t count = pread(fd, buf, len - 1, 0);
+    if(count == -1 && isStale(errno)) {
+        if(reopen() == -1)
+            return -1;
+        count = pread(fd, buf, len - 1, 0);
+    }
+    if(count == -1)
+        return -1;
+
+    buf[count] = '\0';
+    return count;
+}
+
+int Attribute::readInt(int *value)
+{
+    char str[32];
+    if(read(str, sizeof(str)) == -1)
+        return -1;
+    *value = atoi(str);
+    return 0;
+}
+
+ssize_t Attribute::write(const char *data, size_t len)
+{
+    if(fd < 0 && reopen() == -1)
+        return -1;
+
+    // Readers of a fake tree may see an empty file for a moment, but
+    // never a mix of the old and the new value.
+    if(regular && ftruncate(fd, 0) == -1)
+        return -1;
+
+    ssize_t count = pwrite(fd, data, len, 0);
+    if(count == -1 && isStale(errno)) {
+        if(reopen() == -1)
+            return -1;
+        count = pwrite(fd, data, len, 0);
+    }
+    return count;
+}
+
+int Attribute::writeInt(int value)
+{
+    char str[16];
+    int len = snprintf(str, sizeof(str), "%d", value);
+    return write(str, len) == -1 ? -1 : 0;
+}
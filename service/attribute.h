@@ -0,0 +1,52 @@
+#ifndef ATTRIBUTE_H
+#define ATTRIBUTE_H
+
+#include <string>
+#include <sys/types.h>
+using namespace std;
+
+/**
+ * A sysfs/procfs attribute kept open for the whole lifetime of the daemon.
+ * Reads and writes always start at offset 0 (pread/pwrite), so the same
+ * descriptor can be reused forever without seeking. The file is reopened
+ * only when the kernel tells us the old descriptor is gone (ESTALE/ENODEV),
+ * e.g. after the driver has been reloaded.
+ *
+ * All the methods returning int return -1 on error and set errno.
+ */
+class Attribute
+{
+public:
+    Attribute();
+    ~Attribute();
+
+    /** Opens \a path with \a flags (O_RDONLY, O_WRONLY or O_RDWR). */
+    int open(string path, int flags);
+    void close();
+
+    bool isOpen() const { return fd >= 0; }
+    int getFd() const { return fd; }
+    string getPath() const { return path; }
+
+    /** Reads up to len-1 bytes and NUL-terminates the buffer. */
+    ssize_t read(char *buf, size_t len);
+    /** Reads the attribute and parses it as a decimal integer. */
+    int readInt(int *value);
+    ssize_t write(const char *data, size_t len);
+    int writeInt(int value);
+
+private:
+    Attribute(const Attribute &);
+    Attribute &operator=(const Attribute &);
+
+    int fd;
+    int flags;
+    /** true when backed by a regular file (a fake tree), which pwrite()
+     *  doesn't truncate the way sysfs does */
+    bool regular;
+    string path;
+
+    int reopen();
+};
+
+#endif // ATTRIBUTE_H
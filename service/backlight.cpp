@@ -0,0 +1,100 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <string.h>
+#include <fcntl.h>
+#include "backlight.h"
+#include "logger.h"
+
+using namespace std;
+
+BacklightWriter::BacklightWriter(string name, int traceId)
+{
+    this->name = name;
+    this->traceId = traceId;
+    lastWritten = -1;
+    lastVerified = 0;
+    listener = NULL;
+    memset(&stats, 0, sizeof(stats));
+    memset(&writeTime, 0, sizeof(writeTime));
+}
+
+int BacklightWriter::open(string path)
+{
+    lastWritten = -1;
+    return attr.open(path, O_RDWR);
+}
+
+int BacklightWriter::set(int value)
+{
+    int64_t start = metricsClockNs();
+    int current = lastWritten;
+    // Frames of a transition follow each other too closely for anyone to
+    // step in: only look at the device again once in a while
+    if(lastWritten == -1 || start - lastVerified >= BACKLIGHT_VERIFY_MS * 1000000LL) {
+        if(attr.readInt(&current) == -1) {
+            __sync_fetch_and_add(&stats.errors, 1);
+            trace(TRACE_WRITE, traceId, value, -1);
+            return -1;
+        }
+        lastVerified = start;
+
+        if(lastWritten != -1 && current != lastWritten) {
+            __sync_fetch_and_add(&stats.externalChanges, 1);
+            logMessage(LOG_INFO, "%s brightness changed externally (%d -> %d)",
+                       name.c_str(), lastWritten, current);
+        }
+    }
+
+    if(current == value) {
+        lastWritten = value;
+        __sync_fetch_and_add(&stats.skipped, 1);
+        trace(TRACE_WRITE, traceId, value, 0);
+        return 0;
+    }
+
+    if(attr.writeInt(value) == -1) {
+        __sync_fetch_and_add(&stats.errors, 1);
+        trace(TRACE_WRITE, traceId, value, -1);
+        return -1;
+    }
+
+    lastWritten = value;
+    __sync_fetch_and_add(&stats.written, 1);
+    histogramRecord(&writeTime, metricsClockNs() - start);
+    trace(TRACE_WRITE, traceId, value, 1);
+    if(listener != NULL)
+        listener(*this, value);
+    return 1;
+}
+
+int BacklightWriter::get(int *value)
+{
+    if(attr.readInt(value) == -1) {
+        __sync_fetch_and_add(&stats.errors, 1);
+        return -1;
+    }
+    return 0;
+}
+
+backlight_stats_t BacklightWriter::getStats() const
+{
+    backlight_stats_t s;
+    s.written = __atomic_load_n(&stats.written, __ATOMIC_RELAXED);
+    s.skipped = __atomic_load_n(&stats.skipped, __ATOMIC_RELAXED);
+    s.externalChanges = __atomic_load_n(&stats.externalChanges, __ATOMIC_RELAXED);
+    s.errors = __atomic_load_n(&stats.errors, __ATOMIC_RELAXED);
+    return s;
+}
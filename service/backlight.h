@@ -0,0 +1,83 @@
+#ifndef BACKLIGHT_H
+#define BACKLIGHT_H
+
+#include <string>
+#include "attribute.h"
+#include "metrics.h"
+#include "trace.h"
+using namespace std;
+
+/** Counters collected by a BacklightWriter */
+typedef struct {
+    /** values actually written to the device */
+    unsigned long written;
+    /** requests dropped because the device already had the target value (as
+        far as we know, see BACKLIGHT_VERIFY_MS) */
+    unsigned long skipped;
+    /** times the device value differed from the last one we wrote */
+    unsigned long externalChanges;
+    /** failed reads or writes */
+    unsigned long errors;
+} backlight_stats_t;
+
+/** Longest time the value on the device is assumed to be ours (ms) */
+#define BACKLIGHT_VERIFY_MS 1000
+
+class BacklightWriter;
+
+/** Called after every value actually written to the device */
+typedef void (*backlight_listener_t)(BacklightWriter &writer, int value);
+
+/**
+ * Writes brightness values to a backlight "brightness" attribute through
+ * a cached descriptor. A value equal to the last one written is not
+ * written again. The device is read back before the first write and then
+ * at most every BACKLIGHT_VERIFY_MS, not at every frame of a transition:
+ * if it differs from what we wrote last time, someone else (the user,
+ * another daemon) has changed it in the meantime.
+ *
+ * The counters are updated by the control thread and may be read from any
+ * thread.
+ */
+class BacklightWriter
+{
+public:
+    /** \a traceId identifies the device in TRACE_WRITE events */
+    BacklightWriter(string name, int traceId);
+
+    int open(string path);
+    bool isOpen() const { return attr.isOpen(); }
+    string getName() const { return name; }
+    string getPath() const { return attr.getPath(); }
+
+    /**
+     * Sets the raw brightness value.
+     * \retval 1 if the value has been written
+     * \retval 0 if the write has been skipped
+     * \retval -1 on error (sets errno)
+     */
+    int set(int value);
+    /** Reads the value currently set on the device */
+    int get(int *value);
+
+    void setListener(backlight_listener_t listener) { this->listener = listener; }
+
+    /** Last value written by us, -1 if none */
+    int getLastWritten() const { return lastWritten; }
+    backlight_stats_t getStats() const;
+    /** Duration of the set() calls that wrote a value */
+    const histogram_t &getWriteTime() const { return writeTime; }
+
+private:
+    string name;
+    int traceId;
+    Attribute attr;
+    int lastWritten;
+    /** When the device was last read back, metricsClockNs() */
+    int64_t lastVerified;
+    backlight_stats_t stats;
+    histogram_t writeTime;
+    backlight_listener_t listener;
+};
+
+#endif // BACKLIGHT_H
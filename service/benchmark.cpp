@@ -0,0 +1,628 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/*
+ * als-benchmark: runs the real control loop against a fake sysfs tree and
+ * reports how long each stage takes, how long a client request takes and
+ * how long a change of ambient light takes to reach the screen.
+ *
+ * Output is one "<metric> <value>" pair per line, in a fixed order, so
+ * that the output of two builds can be compared with diff.
+ *
+ * System calls are counted by wrapping the libc entry points used by the
+ * controller at link time (see als-benchmark.pro); only the calls made by
+ * the thread being measured are counted.
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include "controller.h"
+#include "faketree.h"
+#include "comsock.h"
+#include "server.h"
+#include "trace.h"
+#include "record.h"
+#include "logger.h"
+#include "alsclient.h"
+
+using namespace std;
+
+const int DEFAULT_ITERATIONS = 2000;
+const int DEFAULT_STEPS = 200;
+/** Pause between two steps, so that each one starts from a quiet loop */
+const int STEP_PAUSE_MS = 20;
+/** A step that takes longer than this is counted as lost */
+const int STEP_TIMEOUT_MS = 5000;
+/** A day of samples, one per second */
+const int RECORDING_SAMPLES = 24 * 3600;
+
+/* -= System call counting =- */
+
+static volatile unsigned long g_syscalls = 0;
+static __thread bool t_counting = false;
+
+static inline void countSyscall() {
+    if(t_counting)
+        __sync_fetch_and_add(&g_syscalls, 1);
+}
+
+extern "C" {
+int __real_open(const char *path, int flags, ...);
+int __real_close(int fd);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t __real_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int __real_ftruncate(int fd, off_t length);
+int __real_fstat(int fd, struct stat *st);
+int __real_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int __real_timerfd_settime(int fd, int flags, const struct itimerspec *n, struct itimerspec *o);
+int __real_socket(int domain, int type, int protocol);
+int __real_connect(int fd, const struct sockaddr *addr, socklen_t len);
+ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
+
+int __wrap_open(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if(flags & O_CREAT) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+    countSyscall();
+    return __real_open(path, flags, mode);
+}
+int __wrap_close(int fd) { countSyscall(); return __real_close(fd); }
+ssize_t __wrap_read(int fd, void *buf, size_t count) { countSyscall(); return __real_read(fd, buf, count); }
+ssize_t __wrap_write(int fd, const void *buf, size_t count) { countSyscall(); return __real_write(fd, buf, count); }
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset) { countSyscall(); return __real_pread(fd, buf, count, offset); }
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t count, off_t offset) { countSyscall(); return __real_pwrite(fd, buf, count, offset); }
+int __wrap_ftruncate(int fd, off_t length) { countSyscall(); return __real_ftruncate(fd, length); }
+int __wrap_fstat(int fd, struct stat *st) { countSyscall(); return __real_fstat(fd, st); }
+int __wrap_poll(struct pollfd *fds, nfds_t nfds, int timeout) { countSyscall(); return __real_poll(fds, nfds, timeout); }
+int __wrap_timerfd_settime(int fd, int flags, const struct itimerspec *n, struct itimerspec *o) {
+    countSyscall();
+    return __real_timerfd_settime(fd, flags, n, o);
+}
+int __wrap_socket(int domain, int type, int protocol) { countSyscall(); return __real_socket(domain, type, protocol); }
+int __wrap_connect(int fd, const struct sockaddr *addr, socklen_t len) { countSyscall(); return __real_connect(fd, addr, len); }
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags) { countSyscall(); return __real_sendmsg(fd, msg, flags); }
+}
+
+/* -= Measurements =- */
+
+static long long clockNs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long monotonicNs() {
+    return clockNs(CLOCK_MONOTONIC);
+}
+
+static void report(const char *name, const char *metric, double value) {
+    if(value == (long long)value)
+        printf("%s.%s %lld\n", name, metric, (long long)value);
+    else
+        printf("%s.%s %.2f\n", name, metric, value);
+}
+
+static void reportPercentiles(const char *name, const char *unit, vector<long long> samples) {
+    if(samples.empty())
+        return;
+    sort(samples.begin(), samples.end());
+    string p50 = string("p50_") + unit, p99 = string("p99_") + unit, max = string("max_") + unit;
+    report(name, p50.c_str(), samples[samples.size() / 2]);
+    report(name, p99.c_str(), samples[(samples.size() * 99) / 100]);
+    report(name, max.c_str(), samples.back());
+}
+
+typedef void (*stage_fn_t)(int i);
+
+static void stageSensor(int) { getAmbientLightPercent(); }
+static void stageLid(int) { getLidStatus(); }
+static void stageDecision(int i) {
+    int screen, kbd;
+    decideBacklight((i * 7) % 0x321, &screen, &kbd);
+}
+static void stageScreen(int i) { setScreenBacklight(i % 2 ? BRIGHTNESS_ONE * 40 / 100 : BRIGHTNESS_ONE); }
+static void stageKeyboard(int i) { setKeyboardBacklight(i % 2 ? BRIGHTNESS_ONE : 0); }
+static void stageIteration(int) { controlIteration(); }
+static void stageTrace(int i) { trace(TRACE_SENSOR, i); }
+/** Always the same text: coalesced, it reaches syslog once */
+static void stageLog(int) { logMessage(LOG_WARNING, "Benchmark message, light %d", 0x320); }
+
+static LightFilter g_benchFilter;
+/** Noise around a level, with a step every 64 samples */
+static void stageFilter(int i) { g_benchFilter.update((i & 64 ? 0x320 : 0x32) + (i * 37) % 11, i * 250LL); }
+
+/** Light changed between two full iterations, outside of the measure */
+static void prepareIteration(int i) { setFakeLight(g_root, i % 2 ? 0x32 : 0x320); }
+
+/**
+ * Runs \a fn \a n times in the calling thread and reports latency,
+ * system calls and CPU time per call.
+ */
+static void benchStage(const char *name, stage_fn_t fn, stage_fn_t prepare, int n) {
+    vector<long long> samples;
+    samples.reserve(n);
+    long long cpu = 0;
+    unsigned long syscalls = 0;
+
+    for(int i = 0; i < n; i++) {
+        if(prepare != NULL)
+            prepare(i);
+
+        unsigned long s0 = g_syscalls;
+        long long c0 = clockNs(CLOCK_THREAD_CPUTIME_ID);
+        long long t0 = monotonicNs();
+        t_counting = true;
+        fn(i);
+        t_counting = false;
+        long long t1 = monotonicNs();
+        cpu += clockNs(CLOCK_THREAD_CPUTIME_ID) - c0;
+        syscalls += g_syscalls - s0;
+        samples.push_back(t1 - t0);
+    }
+
+    reportPercentiles(name, "ns", samples);
+    report(name, "syscalls_per_call", (double)syscalls / n);
+    report(name, "cpu_ns_per_call", (double)cpu / n);
+}
+
+/* -= Recording and replay =- */
+
+/** Daylight from 6 to 18, a cloud every ten minutes, and some noise */
+static int dayLight(int second) {
+    double hour = second / 3600.0;
+    double sun = hour > 6 && hour < 18 ? 0x320 * sin(M_PI * (hour - 6) / 12) : 0;
+    if(second / 60 % 10 == 0)
+        sun /= 2;
+    return (int)sun + (second * 37) % 11;
+}
+
+/**
+ * Records a synthetic day the way the control loop does, then replays it.
+ * record.max_ns is the worst stall of the loop, when a chunk is written.
+ */
+static void benchRecording() {
+    string path = g_root + "/recording";
+    Recorder recorder;
+    if(recorder.open(path, 0) == -1)
+        err(EXIT_FAILURE, "%s", path.c_str());
+    LightFilter filter;
+    filter.init(g_filterConfig);
+
+    vector<long long> samples;
+    samples.reserve(RECORDING_SAMPLES);
+    unsigned long syscalls = 0;
+    for(int i = 0; i < RECORDING_SAMPLES; i++) {
+        long long now = i * 1000LL;
+        int raw = dayLight(i), screen, kbd;
+        int filtered = filter.update(raw, now);
+        decideBacklight(filtered, &screen, &kbd);
+
+        unsigned long s0 = g_syscalls;
+        long long t0 = monotonicNs();
+        t_counting = true;
+        recorder.sample(now, raw, filtered, screen, kbd);
+        t_counting = false;
+        samples.push_back(monotonicNs() - t0);
+        syscalls += g_syscalls - s0;
+    }
+    recorder.flush();
+    reportPercentiles("record", "ns", samples);
+    report("record", "syscalls_per_call", (double)syscalls / RECORDING_SAMPLES);
+
+    string data;
+    FILE *f = fopen(path.c_str(), "rb");
+    char buf[65536];
+    size_t n;
+    while(f != NULL && (n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.append(buf, n);
+    if(f != NULL)
+        fclose(f);
+    report("record", "bytes_per_sample", (double)data.size() / RECORDING_SAMPLES);
+
+    string source, error;
+    curve_table_t *curve = loadBrightnessCurve(&source, &error);
+    if(curve == NULL)
+        errx(EXIT_FAILURE, "%s", error.c_str());
+    replay_stats_t stats;
+    long long t0 = monotonicNs();
+    int ret = replayRecording(data.data(), data.size(), g_filterConfig, curve, NULL, &stats);
+    long long elapsed = monotonicNs() - t0;
+    freeCurve(curve);
+    if(ret == -1 || stats.samples != (uint64_t)RECORDING_SAMPLES)
+        errx(EXIT_FAILURE, "The recording cannot be replayed");
+    report("replay_day", "ms", elapsed / 1000000.0);
+    report("replay_day", "differences", stats.differences);
+}
+
+/* -= Round trip of a client request =- */
+
+/** One server per socket flavour; they run until the benchmark exits */
+static IPCServer g_pathServer, g_abstractServer;
+static string g_clientSocket;
+
+static void *serverThread(void *server) {
+    ((IPCServer *)server)->run();
+    return NULL;
+}
+
+/** What "als-controller -s" does: connect, ask the status, read the answer */
+static void stageRoundtrip(int) {
+    int fd = openConnectionMs((char *)g_clientSocket.c_str(), CONNECT_FIRST_DELAY_MS, CONNECT_DEADLINE_MS);
+    if(fd == -1)
+        err(EXIT_FAILURE, "connect %s", g_clientSocket.c_str());
+
+    message_t msg;
+    msg.type = MSG_STATUS;
+    msg.id = 1;
+    msg.buffer = NULL;
+    msg.length = 0;
+    if(sendFrame(fd, &msg, MSG_FRAMING_BINARY) == -1 || receiveFrame(fd, &msg, MSG_FRAMING_BINARY) == -1)
+        err(EXIT_FAILURE, "status request");
+    freeMessage(&msg, 0);
+    closeConnection(fd);
+}
+
+/** The same status request, through a client library connection kept open */
+static AlsClient *g_libraryClient;
+static void stageClientStatus(int) {
+    bool enabled;
+    int ret = g_libraryClient->getStatus(&enabled);
+    if(ret != ALS_OK)
+        errx(EXIT_FAILURE, "status request: %s", alsStrerror(ret));
+}
+
+static void benchRoundtrip(const char *name, IPCServer &server, string socket, int n) {
+    pthread_t thread;
+    if(server.open(socket, handleRequest) == -1)
+        err(EXIT_FAILURE, "%s", socket.c_str());
+    if(pthread_create(&thread, NULL, serverThread, &server) != 0)
+        errx(EXIT_FAILURE, "Cannot create the server thread");
+
+    g_clientSocket = socket;
+    benchStage(name, stageRoundtrip, NULL, n);
+}
+
+/* -= Step response of the running control loop =- */
+
+static pthread_t g_controlThread;
+
+static void *controlThread(void *) {
+    t_counting = true;
+    controlLoop();
+    return NULL;
+}
+
+/** Waits until the brightness file \a path holds \a expected */
+static bool waitBrightness(int inotifyFd, string path, int expected, long long deadline) {
+    char buf[4096];
+    while(1) {
+        char value[32];
+        int fd = open(path.c_str(), O_RDONLY);
+        ssize_t n = fd == -1 ? -1 : read(fd, value, sizeof(value) - 1);
+        if(fd != -1)
+            close(fd);
+        if(n > 0) {
+            value[n] = '\0';
+            if(atoi(value) == expected)
+                return true;
+        }
+
+        long long left = (deadline - monotonicNs()) / 1000000;
+        if(left <= 0)
+            return false;
+        struct pollfd pfd = { inotifyFd, POLLIN, 0 };
+        if(poll(&pfd, 1, (int)left) > 0)
+            while(read(inotifyFd, buf, sizeof(buf)) > 0);
+    }
+}
+
+static void benchSteps(int steps) {
+    string brightness = g_root + FAKE_SCREEN_DIR + "brightness";
+    int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotifyFd == -1 || inotify_add_watch(inotifyFd, brightness.c_str(), IN_MODIFY) == -1)
+        err(EXIT_FAILURE, "inotify %s", brightness.c_str());
+
+    clockid_t controlClock;
+    setActive(true);
+    if(pthread_create(&g_controlThread, NULL, controlThread, NULL) != 0)
+        errx(EXIT_FAILURE, "Cannot create the control thread");
+    pthread_getcpuclockid(g_controlThread, &controlClock);
+
+    // Let the loop settle on the initial value
+    usleep(100000);
+
+    vector<long long> samples;
+    int lost = 0;
+    unsigned long s0 = g_syscalls;
+    long long c0 = clockNs(controlClock);
+
+    for(int i = 0; i < steps; i++) {
+        int als = i % 2 ? 0x320 : 0x32;
+        int screen, kbd;
+        decideBacklight(als, &screen, &kbd);
+        int expected = (long long)FAKE_SCREEN_MAX * screen / BRIGHTNESS_ONE;
+        // With transitions enabled the first frame is what we measure
+        if(g_screenRampConfig.durationMs > 0)
+            expected = -1;
+
+        long long t0 = monotonicNs();
+        setFakeLight(g_root, als);
+        bool ok;
+        if(expected == -1) {
+            struct pollfd pfd = { inotifyFd, POLLIN, 0 };
+            ok = poll(&pfd, 1, STEP_TIMEOUT_MS) > 0;
+            char buf[4096];
+            while(read(inotifyFd, buf, sizeof(buf)) > 0);
+        } else {
+            ok = waitBrightness(inotifyFd, brightness, expected, t0 + STEP_TIMEOUT_MS * 1000000LL);
+        }
+        if(ok)
+            samples.push_back((monotonicNs() - t0) / 1000);
+        else
+            lost++;
+
+        usleep((g_screenRampConfig.durationMs + STEP_PAUSE_MS) * 1000);
+        char buf[4096];
+        while(read(inotifyFd, buf, sizeof(buf)) > 0);
+    }
+
+    long long cpu = clockNs(controlClock) - c0;
+    unsigned long syscalls = g_syscalls - s0;
+
+    reportPercentiles("step", "us", samples);
+    report("step", "lost", lost);
+    report("step", "syscalls_per_step", (double)syscalls / steps);
+    report("step", "cpu_ns_per_step", (double)cpu / steps);
+
+    close(inotifyFd);
+}
+
+/**
+ * Lid close to keyboard light off, and lid open to keyboard light back on,
+ * with the events sent through the fake input device. Runs after
+ * benchSteps(), with the control loop already going.
+ */
+static void benchLid(int steps) {
+    string brightness = g_root + FAKE_KBD_DIR + "brightness";
+    int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotifyFd == -1 || inotify_add_watch(inotifyFd, brightness.c_str(), IN_MODIFY) == -1)
+        err(EXIT_FAILURE, "inotify %s", brightness.c_str());
+
+    // The built-in curve turns the keyboard fully on when it's this dark
+    setFakeLight(g_root, 0x32);
+    if(!waitBrightness(inotifyFd, brightness, FAKE_KBD_MAX, monotonicNs() + STEP_TIMEOUT_MS * 1000000LL))
+        errx(EXIT_FAILURE, "The keyboard light didn't turn on");
+
+    vector<long long> closing, opening;
+    int lost = 0;
+    for(int i = 0; i < steps; i++) {
+        long long t0 = monotonicNs();
+        setFakeLid(g_root, false);
+        if(waitBrightness(inotifyFd, brightness, 0, t0 + STEP_TIMEOUT_MS * 1000000LL))
+            closing.push_back((monotonicNs() - t0) / 1000);
+        else
+            lost++;
+        usleep(STEP_PAUSE_MS * 1000);
+
+        t0 = monotonicNs();
+        setFakeLid(g_root, true);
+        if(waitBrightness(inotifyFd, brightness, FAKE_KBD_MAX, t0 + STEP_TIMEOUT_MS * 1000000LL))
+            opening.push_back((monotonicNs() - t0) / 1000);
+        else
+            lost++;
+        usleep((g_kbdRampConfig.durationMs + STEP_PAUSE_MS) * 1000);
+    }
+
+    reportPercentiles("lid_close", "us", closing);
+    reportPercentiles("lid_open", "us", opening);
+    report("lid", "lost", lost);
+    close(inotifyFd);
+}
+
+/* -= Command to effect =- */
+
+/** Sends a request over \a fd and waits for the answer */
+static void sendRequest(int fd, char type) {
+    message_t msg;
+    msg.type = type;
+    msg.id = 1;
+    msg.buffer = NULL;
+    msg.length = 0;
+    if(sendFrame(fd, &msg, MSG_FRAMING_BINARY) == -1 || receiveFrame(fd, &msg, MSG_FRAMING_BINARY) == -1)
+        err(EXIT_FAILURE, "request %c", type);
+    freeMessage(&msg, 0);
+}
+
+/**
+ * Time from a client request to its effect on the screen: an enable that
+ * makes the loop apply a curve reloaded while disabled, and a reload while
+ * enabled. Neither involves the sensor, so both measure how fast the
+ * control loop notices. Runs last, with the control loop going.
+ */
+static void benchCommands(int steps) {
+    string brightness = g_root + FAKE_SCREEN_DIR + "brightness";
+    string curve = g_root + CURVE_PATH;
+    int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotifyFd == -1 || inotify_add_watch(inotifyFd, brightness.c_str(), IN_MODIFY) == -1)
+        err(EXIT_FAILURE, "inotify %s", brightness.c_str());
+    if(mkdir((g_root + "/etc").c_str(), 0755) == -1 && errno != EEXIST)
+        err(EXIT_FAILURE, "mkdir %s/etc", g_root.c_str());
+
+    string socket = g_root + SOCKET_PATH;
+    int fd = openConnectionMs((char *)socket.c_str(), CONNECT_FIRST_DELAY_MS, CONNECT_DEADLINE_MS);
+    if(fd == -1)
+        err(EXIT_FAILURE, "connect %s", socket.c_str());
+
+    // Flat curves: the screen goes to 30% or 70% whatever the light
+    const int dim = FAKE_SCREEN_MAX * 30 / 100, bright = FAKE_SCREEN_MAX * 70 / 100;
+    vector<long long> enabling, reloading;
+    int lost = 0;
+    for(int i = 0; i < steps; i++) {
+        sendRequest(fd, MSG_DISABLE);
+        writeFakeFile(curve, "0 30 0\n");
+        sendRequest(fd, MSG_RELOAD);
+
+        long long t0 = monotonicNs();
+        sendRequest(fd, MSG_ENABLE);
+        if(waitBrightness(inotifyFd, brightness, dim, t0 + STEP_TIMEOUT_MS * 1000000LL))
+            enabling.push_back((monotonicNs() - t0) / 1000);
+        else
+            lost++;
+
+        writeFakeFile(curve, "0 70 0\n");
+        t0 = monotonicNs();
+        sendRequest(fd, MSG_RELOAD);
+        if(waitBrightness(inotifyFd, brightness, bright, t0 + STEP_TIMEOUT_MS * 1000000LL))
+            reloading.push_back((monotonicNs() - t0) / 1000);
+        else
+            lost++;
+        usleep((g_screenRampConfig.durationMs + STEP_PAUSE_MS) * 1000);
+    }
+
+    reportPercentiles("enable_effect", "us", enabling);
+    reportPercentiles("reload_effect", "us", reloading);
+    report("commands", "lost", lost);
+    closeConnection(fd);
+    close(inotifyFd);
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *) {
+    return remove(path);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-r ROOT] [-i ITERATIONS] [-s STEPS] [-t] [-f] [-I]\n"
+            "  -t  keep brightness transitions enabled\n"
+            "  -f  keep the light filter enabled\n"
+            "  -I  use an IIO sensor (buffered) instead of the ACPI one\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = DEFAULT_ITERATIONS;
+    int steps = DEFAULT_STEPS;
+    bool transitions = false;
+    bool filter = false;
+    bool iio = false;
+    string root;
+
+    int opt;
+    while((opt = getopt(argc, argv, "r:i:s:tfIh")) != -1) {
+        switch(opt) {
+        case 'r': root = optarg; break;
+        case 'i': iterations = atoi(optarg); break;
+        case 's': steps = atoi(optarg); break;
+        case 't': transitions = true; break;
+        case 'f': filter = true; break;
+        case 'I': iio = true; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    bool temporary = root.empty();
+    if(temporary) {
+        char tmpl[] = "/tmp/als-benchmark.XXXXXX";
+        if(mkdtemp(tmpl) == NULL)
+            err(EXIT_FAILURE, "mkdtemp");
+        root = tmpl;
+    }
+    g_root = root;
+    createFakeTree(g_root, iio);
+    g_sensorType = iio ? "iio" : "acpi";
+
+    openlog("als-benchmark", LOG_PID, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+    if(loggerStart() == -1)
+        err(EXIT_FAILURE, "loggerStart");
+
+    if(!transitions) {
+        g_screenRampConfig.durationMs = 0;
+        g_kbdRampConfig.durationMs = 0;
+    }
+    if(!filter) {
+        // Steps must reach the screen in one iteration
+        filter_config_t passThrough = { 1, 100, 0, 0, 0, 1 };
+        g_filterConfig = passThrough;
+    }
+    initControl();
+    enableALS(true);
+
+    benchStage("sensor_read", stageSensor, NULL, iterations);
+    benchStage("lid_check", stageLid, NULL, iterations);
+    benchStage("decision", stageDecision, NULL, iterations);
+    benchStage("screen_write", stageScreen, NULL, iterations);
+    benchStage("keyboard_write", stageKeyboard, NULL, iterations);
+    benchStage("iteration", stageIteration, prepareIteration, iterations);
+    benchStage("trace_event", stageTrace, NULL, iterations);
+    benchStage("filter", stageFilter, NULL, iterations);
+    benchStage("log_message", stageLog, NULL, iterations);
+    loggerFlush(1000);
+    report("log_message", "dropped", loggerGetStats().dropped);
+    benchRecording();
+
+    benchRoundtrip("ipc_roundtrip", g_pathServer, g_root + SOCKET_PATH, iterations);
+    benchRoundtrip("ipc_roundtrip_abstract", g_abstractServer,
+                   ABSTRACT_SOCKET_NAME + ":benchmark:" + g_root, iterations);
+    g_libraryClient = new AlsClient(g_root + SOCKET_PATH);
+    benchStage("client_status", stageClientStatus, NULL, iterations);
+    delete g_libraryClient;
+
+    // From now on the control loop owns the sensor
+    enableALS(false);
+    benchSteps(steps);
+    benchLid(steps);
+    benchCommands(steps);
+
+    // What SIGTERM does, with a transition in progress if they're enabled
+    setFakeLight(g_root, 0x320);
+    usleep(STEP_PAUSE_MS * 1000);
+    long long t0 = monotonicNs();
+    requestShutdown();
+    pthread_join(g_controlThread, NULL);
+    shutdownControl();
+    report("shutdown", "us", (monotonicNs() - t0) / 1000);
+
+    if(temporary)
+        nftw(root.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+
+    // The server threads never return
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
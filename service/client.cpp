@@ -14,10 +14,15 @@
    limitations under the License. */
 
 #include <string>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
+#include <err.h>
 #include "client.h"
-#include "comsock.h"
+#include "alsclient.h"
+#include "events.h"
+#include "metrics.h"
+#include "trace.h"
 
 using namespace std;
 
@@ -25,104 +30,158 @@ Client::Client(int argc, char *argv[], string socketPath)
 {
     this->socketPath = socketPath;
 
-    enable = false;
-    disable = false;
-    status = false;
-
-    if(argc >= 2) {
-        string arg1(argv[1]);
-        if(arg1 == "-e") {
-            enable = true;
-        } else if(arg1 == "-d") {
-            disable = true;
-        } else if(arg1 == "-s") {
-            status = true;
+    watch = false;
+
+    for(int i = 1; i < argc; i++) {
+        string arg(argv[i]);
+        if(arg == "-e") {
+            requests.push_back(ALS_REQUEST_ENABLE);
+        } else if(arg == "-d") {
+            requests.push_back(ALS_REQUEST_DISABLE);
+        } else if(arg == "-s") {
+            requests.push_back(ALS_REQUEST_STATUS);
+        } else if(arg == "-t" || arg == "--toggle") {
+            requests.push_back(ALS_REQUEST_TOGGLE);
+        } else if(arg == "-m" || arg == "--metrics") {
+            requests.push_back(ALS_REQUEST_STATS);
+        } else if(arg == "-R" || arg == "--reload") {
+            requests.push_back(ALS_REQUEST_RELOAD);
+        } else if(arg == "-T" || arg == "--trace") {
+            requests.push_back(ALS_REQUEST_TRACE);
+        } else if(arg == "--trace-file" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if(arg == "-w" || arg == "--watch") {
+            watch = true;
         }
     }
 }
 
 void Client::Run()
 {
-    if(enable) {
-        int g_serverFd = connectOrExit();
-
-        int sent;
-        message_t msg;
-
-        msg.type = MSG_ENABLE;
-        msg.buffer = NULL;
-        msg.length = 0;
-
-        sent = sendMessage(g_serverFd, &msg);
-        if(sent == -1) {
-          perror("Error");
-          closeConnection(g_serverFd);
-          exit(EXIT_FAILURE);
-        }
+    if(!traceFile.empty())
+        decodeTraceFile();
+    if(requests.empty() && !watch)
+        return;
+
+    AlsClient client(socketPath);
+    int ret = client.connect();
+    if(ret != ALS_OK)
+        errx(EXIT_FAILURE, "No connection to the server: %s.", alsStrerror(ret));
+
+    if(!requests.empty())
+        sendRequests(client);
+    if(watch)
+        watchEvents(client);
+}
 
-        closeConnection(g_serverFd);
+typedef struct {
+    bool done;
+    int status;
+    int enabled;
+    string data;
+} reply_t;
 
-    } else if(disable) {
-        int g_serverFd = connectOrExit();
+static void storeReply(const als_reply_t *reply, void *arg)
+{
+    reply_t *r = (reply_t *)arg;
+    r->done = true;
+    r->status = reply->status;
+    r->enabled = reply->enabled;
+    r->data.assign(reply->data != NULL ? reply->data : "", reply->length);
+}
 
-        int sent;
-        message_t msg;
+/**
+ * Sends all the requests before reading any reply, and prints the replies
+ * in the order of the requests: -s and -t print the state, -m the metrics
+ * in the Prometheus text format, -T the recent events. A failed -R is
+ * reported once all the other replies are printed.
+ */
+void Client::sendRequests(AlsClient &client)
+{
+    vector<reply_t> replies(requests.size());
 
-        msg.type = MSG_DISABLE;
-        msg.buffer = NULL;
-        msg.length = 0;
+    for(size_t i = 0; i < requests.size(); i++) {
+        replies[i].done = false;
+        int ret = client.request(requests[i], storeReply, &replies[i]);
+        if(ret != ALS_OK)
+            errx(EXIT_FAILURE, "Error: %s.", alsStrerror(ret));
+    }
 
-        sent = sendMessage(g_serverFd, &msg);
-        if(sent == -1) {
-          perror("Error");
-          closeConnection(g_serverFd);
-          exit(EXIT_FAILURE);
+    for(size_t i = 0; i < requests.size(); i++) {
+        while(!replies[i].done) {
+            int ret = client.dispatch(ALS_DEFAULT_TIMEOUT_MS);
+            if(ret == 0 && !replies[i].done)
+                ret = ALS_ERR_TIMEOUT;
+            if(ret < 0 && !replies[i].done)
+                errx(EXIT_FAILURE, "Error: %s.", alsStrerror(ret));
         }
+    }
 
-        closeConnection(g_serverFd);
-
-    } else if(status) {
-        int g_serverFd = connectOrExit();
-
-        int sent;
-        message_t msg;
-
-        msg.type = MSG_STATUS;
-        msg.buffer = NULL;
-        msg.length = 0;
-
-        sent = sendMessage(g_serverFd, &msg);
-        if(sent == -1) {
-          perror("Error");
-          closeConnection(g_serverFd);
-          exit(EXIT_FAILURE);
+    bool failed = false;
+    for(size_t i = 0; i < requests.size(); i++) {
+        const reply_t &r = replies[i];
+        if(requests[i] == ALS_REQUEST_RELOAD && r.status == ALS_ERR_FAILED) {
+            fprintf(stderr, "Error reloading: %s\n", r.data.c_str());
+            failed = true;
+        } else if(r.status != ALS_OK) {
+            errx(EXIT_FAILURE, "Error: %s.", alsStrerror(r.status));
+        } else if(requests[i] == ALS_REQUEST_STATUS || requests[i] == ALS_REQUEST_TOGGLE) {
+            printf("%d\n", r.enabled);
+        } else if(requests[i] == ALS_REQUEST_STATS) {
+            metrics_t metrics;
+            if(decodeMetrics(r.data.data(), r.data.size(), &metrics) == -1) {
+                perror("Error decoding metrics");
+                exit(EXIT_FAILURE);
+            }
+            fputs(renderMetrics(&metrics).c_str(), stdout);
+        } else if(requests[i] == ALS_REQUEST_TRACE) {
+            if(decodeTrace(r.data.data(), r.data.size(), stdout) == -1) {
+                perror("Error decoding trace");
+                exit(EXIT_FAILURE);
+            }
         }
+    }
+    if(failed)
+        exit(EXIT_FAILURE);
+}
 
-        if(receiveMessage(g_serverFd, &msg) == -1) {
-            perror("Error");
-            closeConnection(g_serverFd);
-            exit(EXIT_FAILURE);
-        }
+/** Prints a trace written by the daemon on SIGUSR1 */
+void Client::decodeTraceFile()
+{
+    FILE *f = fopen(traceFile.c_str(), "rb");
+    if(f == NULL) {
+        perror(traceFile.c_str());
+        exit(EXIT_FAILURE);
+    }
 
-        if(msg.type == MSG_ENABLED)
-            printf("1\n");
-        else if(msg.type == MSG_DISABLED)
-            printf("0\n");
-        else {
-            perror("Error");
-            closeConnection(g_serverFd);
-            exit(EXIT_FAILURE);
-        }
+    string data;
+    char buf[4096];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.append(buf, n);
+    fclose(f);
 
-        closeConnection(g_serverFd);
+    if(decodeTrace(data.data(), data.size(), stdout) == -1) {
+        perror("Error decoding trace");
+        exit(EXIT_FAILURE);
     }
 }
 
-int Client::connectOrExit() {
-    int g_serverFd = openConnection((char*)this->socketPath.c_str(), NTRIAL, NSEC);
-    if(g_serverFd == -1) {
-      perror("No connection to the server.");
-      exit(EXIT_FAILURE);
-    }
-    return g_serverFd;
+static void printEvent(int kind, int32_t value, void *)
+{
+    if(kind == EVENT_LID)
+        printf("lid %s\n", value == 1 ? "open" : value == 0 ? "closed" : "unknown");
+    else
+        printf("%s %d\n", eventName(kind), value);
+    fflush(stdout);
+}
+
+/** Prints the events until the daemon goes away; a restart is followed */
+void Client::watchEvents(AlsClient &client)
+{
+    int ret = client.subscribe(printEvent, NULL);
+    while(ret >= 0)
+        ret = client.dispatch(-1);
+    if(ret != ALS_ERR_CONNECT)
+        errx(EXIT_FAILURE, "Error: %s.", alsStrerror(ret));
 }
@@ -2,8 +2,11 @@
 #define CLIENT_H
 
 #include <string>
+#include <vector>
+#include "alsclient.h"
 using namespace std;
 
+/** The command line client: runs the requests given as options through an AlsClient */
 class Client
 {
 public:
@@ -11,11 +14,15 @@ public:
     void Run();
 
 private:
-    bool enable;
-    bool disable;
-    bool status;
+    /** Requests (ALS_REQUEST_*) given on the command line, sent in order over one connection */
+    vector<int> requests;
+    bool watch;
+    /** Trace dump to decode (--trace-file) */
+    string traceFile;
     string socketPath;
-    int connectOrExit();
+    void sendRequests(AlsClient &client);
+    void watchEvents(AlsClient &client);
+    void decodeTraceFile();
 };
 
 #endif // CLIENT_H
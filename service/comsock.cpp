@@ -24,9 +24,24 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <time.h>
 #include "comsock.h"
 
 static ssize_t readAllChars(int fd, void *buf, size_t count);
+static int makeAddress(const char *path, struct sockaddr_un *addr, socklen_t *len);
+
+/** lunghezza massima del buffer di un messaggio ricevuto */
+static unsigned int maxMessageLength = MSG_MAX_LENGTH;
+
+void setMaxMessageLength(unsigned int length) {
+  maxMessageLength = length;
+}
+
+unsigned int getMaxMessageLength() {
+  return maxMessageLength;
+}
 
 /**
   In caso di errore, uno dei seguenti valori viene associato a errno:
@@ -39,12 +54,15 @@ static ssize_t readAllChars(int fd, void *buf, size_t count);
 int createServerChannel(char* path) {
   int fd, tmp_errno = 0;
   
-  if(strlen(path) > UNIX_PATH_MAX) {
-    errno = E2BIG;
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+
+  if(makeAddress(path, &addr, &addrlen) == -1) {
     return -1;
   }
   
-  if(strcmp(path, "") == 0 || access(path, F_OK) == 0) {
+  /* i nomi astratti non esistono nel file system: se il nome e' occupato fallisce la bind() */
+  if(strcmp(path, "") == 0 || (!isAbstractSocket(path) && access(path, F_OK) == 0)) {
     errno = EEXIST;
     return -1;
   }
@@ -53,12 +71,9 @@ int createServerChannel(char* path) {
   if(fd == -1) {
     return -1;
   } else {
-    struct sockaddr_un addr;
     int bind_val;
     
-    strncpy(addr.sun_path, path, UNIX_PATH_MAX);
-    addr.sun_family = AF_UNIX;
-    bind_val = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    bind_val = bind(fd, (struct sockaddr *)&addr, addrlen);
     if(bind_val == 0) {
     
       if(listen(fd, SOMAXCONN) == 0) {
@@ -82,11 +97,11 @@ int createServerChannel(char* path) {
 /**
   In caso di errore, uno dei seguenti valori viene associato a errno:
   - uno dei valori assegnati da close()
-  - uno dei valori assegnati da remove()
+  - uno dei valori assegnati da remove() (solo per le socket nel file system)
  */
 int closeServerChannel(char* path, int s) {
   if(close(s) == 0) {
-    if(remove(path) == 0) {
+    if(isAbstractSocket(path) || remove(path) == 0) {
       return 0;
     } else {
       return -1;
@@ -109,39 +124,81 @@ int acceptConnection(int s) {
   }
 }
 
+int receiveMessage(int sc, message_t * msg) {
+  return receiveFrame(sc, msg, MSG_FRAMING_ASCII);
+}
+
+int sendMessage(int sc, message_t *msg) {
+  return sendFrame(sc, msg, MSG_FRAMING_ASCII);
+}
+
+/** Decodifica la lunghezza contenuta in un'intestazione completa.
+    Restituisce -1 (errno = EBADMSG) se l'intestazione non e' valida. */
+static int parseHeader(const char *header, int framing, char *type, unsigned short *id,
+                       unsigned int *length) {
+  if(framing == MSG_FRAMING_BINARY) {
+    const unsigned char *h = (const unsigned char *)header;
+    if(h[0] != MSG_BIN_MAGIC) {
+      errno = EBADMSG;
+      return -1;
+    }
+    *type = (char)h[1];
+    *id = (unsigned short)(h[2] | (h[3] << 8));
+    *length = (unsigned int)h[4] | ((unsigned int)h[5] << 8) |
+              ((unsigned int)h[6] << 16) | ((unsigned int)h[7] << 24);
+    return 0;
+  } else {
+    char cbuflen[11];
+    char *end;
+    memcpy(cbuflen, header + 1, 10);
+    cbuflen[10] = '\0';
+    errno = 0;
+    *length = (unsigned int) strtoul(cbuflen, &end, 10);
+    if(errno != 0 || end != cbuflen + 10) {
+      errno = EBADMSG;
+      return -1;
+    }
+    *type = header[0];
+    *id = 0;
+    return 0;
+  }
+}
+
+static int headerLength(int framing) {
+  return framing == MSG_FRAMING_BINARY ? MSG_BIN_HEADER_LEN : MSG_HEADER_LEN;
+}
+
 /**
   In caso di errore, uno dei seguenti valori viene associato a errno:
   - @b ENOTCONN: il peer ha chiuso la connessione
+  - @b EBADMSG: l'intestazione non e' valida
+  - @b EMSGSIZE: il messaggio supera la lunghezza massima
   - @b ENOMEM: problema con la memoria
   - uno dei valori assegnati da read()
-  - uno dei valori assegnati da strtoul()
  */
-int receiveMessage(int sc, message_t * msg) {
+int receiveFrame(int sc, message_t *msg, int framing) {
+  char header[MSG_HEADER_LEN];
   char type;
-  char cbuflen[11]; /* buffer per leggere msg->length */
+  unsigned short id;
   char *buffer = NULL; /* msg->buffer */
-  int buflen; /* msg->length */
-  int r_type = 0, r_cbuflen = 0, r_buffer = 0;
+  unsigned int buflen; /* msg->length */
+  int hlen = headerLength(framing);
+  int r_header = 0, r_buffer = 0;
 
-  r_type = readAllChars(sc, &type, 1);
-  if(r_type <= 0) {
-    errno = (r_type == 0 ? ENOTCONN : errno);
+  r_header = readAllChars(sc, header, hlen);
+  if(r_header <= 0) {
+    errno = (r_header == 0 ? ENOTCONN : errno);
     return -1;
   }
-  
-  cbuflen[10] = '\0';
-  r_cbuflen = readAllChars(sc, cbuflen, 10);
-  if(r_cbuflen <= 0) {
-    errno = (r_cbuflen == 0 ? ENOTCONN : errno);
+
+  if(parseHeader(header, framing, &type, &id, &buflen) == -1) return -1;
+
+  if(buflen > maxMessageLength) {
+    errno = EMSGSIZE;
     return -1;
   }
-  
-  errno = 0;
-  buflen = (int) strtoul(cbuflen, NULL, 10);
-  if(errno != 0) return -1;
-  
+
   if(buflen > 0) {
-    /* FIXME Potenzialmente pericoloso! Potremmo allocare una quantità di memoria esagerata */
     buffer = (char*)malloc(sizeof(char) * buflen);
     if(buffer == NULL) return -1;
     r_buffer = readAllChars(sc, buffer, buflen);
@@ -151,70 +208,87 @@ int receiveMessage(int sc, message_t * msg) {
       return -1;
     }
   }
-  
+
   if(msg == NULL) { /* se msg=null, riceve e scarta */
     if(buffer != NULL) {
       free(buffer);
     }
   } else {
     msg->type = type;
+    msg->id = id;
     msg->length = buflen;
     msg->buffer = buffer;
   }
-  
-  return r_type + r_cbuflen + r_buffer;
+
+  return r_header + r_buffer;
 }
 
 /**
   In caso di errore, uno dei seguenti valori viene associato a errno:
-  - @b ENOTCONN: il peer ha chiuso la connessione
   - @b EINVAL: @a msg è NULL
   - @b EINVAL: il buffer del messaggio è NULL, ma la lunghezza specificata è > 0
-  - @b ENOMEM: problema con la memoria
-  - uno dei valori assegnati da send()
-  - uno dei valori assegnati da snprintf()
+  - @b EINVAL: @a framing non e' valido
  */
-int sendMessage(int sc, message_t *msg) {
-  char *out;
-  int out_size;
-  int written;
-  
-  if(msg != NULL) {
-  
-    out_size = 1 + 10 + msg->length + 1;
-    out = (char*)calloc(out_size, sizeof(char));
-    if(out == NULL) return -1;
-    
-    out[0] = msg->type;
-    if(snprintf(out+1, 10+1, "%010d", msg->length) < 0) {
-      free(out);
-      return -1;
-    }
-    
-    if(msg->length > 0) {
-      if(msg->buffer != NULL) {
-        strncat(out, msg->buffer, msg->length);
-      } else {
-        free(out);
-        errno = EINVAL;
-        return -1;
-      }
-    }
-
-    /* Invece di write() usiamo send(). Questo ci permette di
-       specificare, tramite i flag, di non generare SIGPIPE
-       (terminerebbe il processo in caso di connessione interrotta...) */
-    written = send(sc, out, out_size-1, MSG_NOSIGNAL);
-    free(out);
-    if(written == -1 && errno == EPIPE) {
-      errno = ENOTCONN;
-    }
-    return written;
-  
-  } else {
+int packHeader(message_t *msg, int framing, char *header) {
+  if(msg == NULL || (msg->length > 0 && msg->buffer == NULL)) {
     errno = EINVAL;
     return -1;
   }
+
+  if(framing == MSG_FRAMING_BINARY) {
+    header[0] = (char)MSG_BIN_MAGIC;
+    header[1] = msg->type;
+    header[2] = (char)(msg->id & 0xFF);
+    header[3] = (char)((msg->id >> 8) & 0xFF);
+    header[4] = (char)(msg->length & 0xFF);
+    header[5] = (char)((msg->length >> 8) & 0xFF);
+    header[6] = (char)((msg->length >> 16) & 0xFF);
+    header[7] = (char)((msg->length >> 24) & 0xFF);
+    return MSG_BIN_HEADER_LEN;
+  } else if(framing == MSG_FRAMING_ASCII) {
+    char tmp[MSG_HEADER_LEN + 1];
+    tmp[0] = msg->type;
+    snprintf(tmp + 1, 10 + 1, "%010u", msg->length);
+    memcpy(header, tmp, MSG_HEADER_LEN);
+    return MSG_HEADER_LEN;
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+/**
+  In caso di errore, uno dei seguenti valori viene associato a errno:
+  - @b ENOTCONN: il peer ha chiuso la connessione
+  - @b EINVAL: @a msg è NULL
+  - @b EINVAL: il buffer del messaggio è NULL, ma la lunghezza specificata è > 0
+  - uno dei valori assegnati da sendmsg()
+ */
+int sendFrame(int sc, message_t *msg, int framing) {
+  char header[MSG_HEADER_LEN];
+  struct iovec iov[2];
+  struct msghdr mh;
+  int hlen, written;
+
+  hlen = packHeader(msg, framing, header);
+  if(hlen == -1) return -1;
+
+  iov[0].iov_base = header;
+  iov[0].iov_len = hlen;
+  iov[1].iov_base = msg->buffer;
+  iov[1].iov_len = msg->length;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = msg->length > 0 ? 2 : 1;
+
+  /* Invece di writev() usiamo sendmsg(). Questo ci permette di
+     specificare, tramite i flag, di non generare SIGPIPE
+     (terminerebbe il processo in caso di connessione interrotta...) */
+  written = sendmsg(sc, &mh, MSG_NOSIGNAL);
+  if(written == -1 && errno == EPIPE) {
+    errno = ENOTCONN;
+  }
+  return written;
 }
 
 /**
@@ -237,8 +311,10 @@ int openConnection(char* path, int ntrial, int k) {
     return -1;
   }
   
-  if(strlen(path) > UNIX_PATH_MAX) {
-    errno = E2BIG;
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+
+  if(makeAddress(path, &addr, &addrlen) == -1) {
     return -1;
   }
   
@@ -247,13 +323,9 @@ int openConnection(char* path, int ntrial, int k) {
     return -1;
   } else {
   
-    struct sockaddr_un addr;
     int i, connect_errno = 0;
     
-    strncpy(addr.sun_path, path, UNIX_PATH_MAX);
-    addr.sun_family = AF_UNIX;
-    
-    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    if(connect(fd, (struct sockaddr *)&addr, addrlen) == 0) {
     
       /* ok, ha funzionato al primo tentativo */
       return fd;
@@ -263,7 +335,7 @@ int openConnection(char* path, int ntrial, int k) {
       /* in caso di errore, ritenta */
       for(i = 0; i < ntrial; i++) {
         sleep(k);
-        if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        if(connect(fd, (struct sockaddr *)&addr, addrlen) == 0) {
           return fd;
         } else {
           connect_errno = errno;
@@ -280,6 +352,94 @@ int openConnection(char* path, int ntrial, int k) {
   }
 }
 
+static long long monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+  In caso di errore, uno dei seguenti valori viene associato a errno:
+  - @b E2BIG: @a path eccede UNIX_PATH_MAX
+  - @b EINVAL: @a firstDelayMs o @a deadlineMs sono fuori dal range ammesso
+  - uno dei valori assegnati da connect() all'ultimo tentativo
+ */
+int openConnectionMs(char* path, int firstDelayMs, int deadlineMs) {
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+  long long deadline;
+  int fd, delay = firstDelayMs;
+
+  if(firstDelayMs <= 0 || deadlineMs < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if(makeAddress(path, &addr, &addrlen) == -1) {
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd == -1) {
+    return -1;
+  }
+
+  deadline = monotonicMs() + deadlineMs;
+  while(1) {
+    int connect_errno;
+    long long left;
+    struct timespec ts;
+
+    if(connect(fd, (struct sockaddr *)&addr, addrlen) == 0) {
+      return fd;
+    }
+    connect_errno = errno;
+
+    left = deadline - monotonicMs();
+    if(left <= 0) {
+      closeConnection(fd);
+      errno = connect_errno;
+      return -1;
+    }
+
+    /* il server potrebbe non avere ancora creato la socket: ritenta presto,
+       poi sempre piu' di rado */
+    if(delay > left) delay = (int)left;
+    ts.tv_sec = delay / 1000;
+    ts.tv_nsec = (long)(delay % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+    delay *= 2;
+    if(delay > CONNECT_MAX_DELAY_MS) delay = CONNECT_MAX_DELAY_MS;
+  }
+}
+
+int isAbstractSocket(const char *path) {
+  return path[0] == ABSTRACT_SOCKET_PREFIX;
+}
+
+/** Prepara l'indirizzo di path. Per i nomi astratti sun_path inizia con '\0'
+    e la lunghezza dell'indirizzo comprende solo i byte del nome. */
+static int makeAddress(const char *path, struct sockaddr_un *addr, socklen_t *len) {
+  size_t n = strlen(path);
+
+  if(n > UNIX_PATH_MAX) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if(isAbstractSocket(path)) {
+    addr->sun_path[0] = '\0';
+    memcpy(addr->sun_path + 1, path + 1, n - 1);
+    *len = offsetof(struct sockaddr_un, sun_path) + n;
+  } else {
+    memcpy(addr->sun_path, path, n);
+    *len = sizeof(*addr);
+  }
+  return 0;
+}
+
 /**
   In caso di errore, uno dei seguenti valori viene associato a errno:
   - uno dei valori assegnati da close()
@@ -312,6 +472,209 @@ ssize_t readAllChars(int fd, void *buf, size_t count) {
   return totpart;
 }
 
+void initMessageReader(msgreader_t *r) {
+  r->framing = MSG_FRAMING_UNKNOWN;
+  r->inStart = 0;
+  r->inEnd = 0;
+  r->headerDone = 0;
+  r->type = 0;
+  r->id = 0;
+  r->length = 0;
+  r->buffer = NULL;
+  r->bufferRead = 0;
+  r->maxLength = maxMessageLength;
+  r->pool = NULL;
+  r->poolSize = 0;
+  r->poolLent = 0;
+  r->stats = NULL;
+}
+
+void resetMessageReader(msgreader_t *r) {
+  unsigned int maxLength = r->maxLength;
+  msgstats_t *stats = r->stats;
+
+  if(r->buffer != NULL && r->buffer != r->pool) {
+    free(r->buffer);
+  }
+  if(r->pool != NULL) {
+    free(r->pool);
+  }
+  initMessageReader(r);
+  r->maxLength = maxLength;
+  r->stats = stats;
+}
+
+/** Restituisce un buffer di length byte per il messaggio corrente: il buffer
+    riutilizzabile del lettore se e' libero e abbastanza grande, altrimenti
+    uno allocato apposta. Restituisce NULL se manca la memoria. */
+static char *takeBuffer(msgreader_t *r, unsigned int length) {
+  if(!r->poolLent && length <= MSG_POOL_BUFSIZE) {
+    if(r->poolSize < length) {
+      /* il buffer cresce per potenze di 2 fino a MSG_POOL_BUFSIZE */
+      unsigned int size = 64;
+      char *pool;
+      while(size < length) size *= 2;
+      if(size > MSG_POOL_BUFSIZE) size = MSG_POOL_BUFSIZE;
+      pool = (char*)realloc(r->pool, size);
+      if(pool == NULL) return NULL;
+      r->pool = pool;
+      r->poolSize = size;
+      if(r->stats != NULL) __sync_fetch_and_add(&r->stats->poolMisses, 1);
+    } else if(r->stats != NULL) {
+      __sync_fetch_and_add(&r->stats->poolHits, 1);
+    }
+    r->poolLent = 1;
+    return r->pool;
+  }
+
+  if(r->stats != NULL) __sync_fetch_and_add(&r->stats->poolMisses, 1);
+  return (char*)malloc(sizeof(char) * length);
+}
+
+void releaseMessage(msgreader_t *r, message_t *msg) {
+  if(msg->buffer != NULL) {
+    if(msg->buffer == r->pool) {
+      r->poolLent = 0;
+    } else {
+      free(msg->buffer);
+    }
+    msg->buffer = NULL;
+  }
+}
+
+/** Legge altri byte nel buffer interno del lettore.
+    Restituisce i byte letti, 0 se non ce ne sono, -1 in caso di errore */
+static int fillReader(int sc, msgreader_t *r) {
+  ssize_t n;
+
+  /* sposta all'inizio i byte non ancora consumati */
+  if(r->inStart > 0) {
+    memmove(r->in, r->in + r->inStart, r->inEnd - r->inStart);
+    r->inEnd -= r->inStart;
+    r->inStart = 0;
+  }
+
+  do {
+    n = read(sc, r->in + r->inEnd, MSG_READER_BUFSIZE - r->inEnd);
+  } while(n == -1 && errno == EINTR);
+
+  if(n == 0) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  if(n == -1) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+  r->inEnd += n;
+  return n;
+}
+
+/**
+  In caso di errore, uno dei seguenti valori viene associato a errno:
+  - @b ENOTCONN: il peer ha chiuso la connessione
+  - @b EBADMSG: l'intestazione non e' valida
+  - @b EMSGSIZE: il messaggio supera r->maxLength
+  - @b ENOMEM: problema con la memoria
+  - uno dei valori assegnati da read()
+ */
+int readMessageNB(int sc, msgreader_t *r, message_t *msg) {
+  int n;
+
+  while(!r->headerDone) {
+    unsigned int avail = r->inEnd - r->inStart;
+
+    if(r->framing == MSG_FRAMING_UNKNOWN && avail > 0) {
+      r->framing = ((unsigned char)r->in[r->inStart] == MSG_BIN_MAGIC) ?
+                   MSG_FRAMING_BINARY : MSG_FRAMING_ASCII;
+    }
+
+    if(r->framing != MSG_FRAMING_UNKNOWN && avail >= (unsigned int)headerLength(r->framing)) {
+      if(parseHeader(r->in + r->inStart, r->framing, &r->type, &r->id, &r->length) == -1) return -1;
+      if(r->length > r->maxLength) {
+        if(r->stats != NULL) __sync_fetch_and_add(&r->stats->oversize, 1);
+        errno = EMSGSIZE;
+        return -1;
+      }
+      r->inStart += headerLength(r->framing);
+      r->headerDone = 1;
+      if(r->length > 0) {
+        r->buffer = takeBuffer(r, r->length);
+        if(r->buffer == NULL) return -1;
+      }
+      break;
+    }
+
+    n = fillReader(sc, r);
+    if(n <= 0) return n;
+  }
+
+  while(r->bufferRead < r->length) {
+    unsigned int avail = r->inEnd - r->inStart;
+    unsigned int missing = r->length - r->bufferRead;
+
+    if(avail > 0) {
+      unsigned int chunk = avail < missing ? avail : missing;
+      memcpy(r->buffer + r->bufferRead, r->in + r->inStart, chunk);
+      r->inStart += chunk;
+      r->bufferRead += chunk;
+    } else if(missing >= MSG_READER_BUFSIZE) {
+      /* messaggi grandi: leggiamo direttamente nel buffer del messaggio */
+      ssize_t nr;
+      do {
+        nr = read(sc, r->buffer + r->bufferRead, missing);
+      } while(nr == -1 && errno == EINTR);
+      if(nr == 0) {
+        errno = ENOTCONN;
+        return -1;
+      }
+      if(nr == -1) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+      }
+      r->bufferRead += nr;
+    } else {
+      n = fillReader(sc, r);
+      if(n <= 0) return n;
+    }
+  }
+
+  msg->type = r->type;
+  msg->id = r->id;
+  msg->length = r->length;
+  msg->buffer = r->buffer;
+
+  /* il buffer passa a msg fino a releaseMessage(); i byte gia' letti restano nel lettore */
+  r->headerDone = 0;
+  r->length = 0;
+  r->buffer = NULL;
+  r->bufferRead = 0;
+  return 1;
+}
+
+/**
+  In caso di errore, uno dei seguenti valori viene associato a errno:
+  - @b EINVAL: @a msg è NULL
+  - @b EINVAL: il buffer del messaggio è NULL, ma la lunghezza specificata è > 0
+  - @b EINVAL: @a framing non e' valido
+ */
+int packMessage(message_t *msg, int framing, char *out, int size) {
+  char header[MSG_HEADER_LEN];
+  int hlen, total;
+
+  hlen = packHeader(msg, framing, header);
+  if(hlen == -1) return -1;
+
+  total = hlen + msg->length;
+  if(total > size) {
+    return total;
+  }
+
+  memcpy(out, header, hlen);
+  if(msg->length > 0) {
+    memcpy(out + hlen, msg->buffer, msg->length);
+  }
+  return total;
+}
+
 void freeMessage(message_t *msg, int onHeap) {
   if(msg->buffer != NULL) {
     free(msg->buffer);
@@ -20,6 +20,8 @@
 /** <H3>Messaggio</H3>
  * La struttura \c message_t rappresenta un messaggio 
  * - \c type rappresenta il tipo del messaggio
+ * - \c id identifica una richiesta; la risposta riporta lo stesso valore
+ *   (solo nel formato binario, 0 se non usato)
  * - \c length rappresenta la lunghezza in byte del campo \c buffer
  * - \c buffer del messaggio 
  *
@@ -28,12 +30,104 @@
 typedef struct {
   /** tipo del messaggio */
     char type;           
+  /** identificativo della richiesta (0 se non usato) */
+    unsigned short id;
   /** lunghezza messaggio in byte */
     unsigned int length; 
   /** buffer messaggio */
     char *buffer;        
 } message_t; 
 
+/** <H3>Formati dei messaggi (framing)</H3>
+ * - \c MSG_FRAMING_ASCII (storico): tipo (1 byte) + lunghezza (10 cifre decimali) + buffer
+ * - \c MSG_FRAMING_BINARY (versione 1): intestazione fissa di MSG_BIN_HEADER_LEN byte
+ *   - byte 0: MSG_BIN_MAGIC
+ *   - byte 1: tipo
+ *   - byte 2-3: identificativo della richiesta, little-endian
+ *   - byte 4-7: lunghezza del buffer, little-endian
+ *   seguita dal buffer
+ *
+ * Il server riconosce il formato dal primo byte ricevuto su ogni connessione
+ * (MSG_BIN_MAGIC non e' un tipo valido) e risponde nello stesso formato,
+ * quindi i vecchi client continuano a funzionare.
+ *
+ * Su una connessione si possono inviare piu' richieste senza attendere le
+ * risposte: il server le esegue e risponde nell'ordine di arrivo, riportando
+ * l'identificativo di ciascuna.
+ *
+ * <HR>
+ */
+#define MSG_FRAMING_UNKNOWN 0
+#define MSG_FRAMING_ASCII   1
+#define MSG_FRAMING_BINARY  2
+
+/** lunghezza dell'intestazione di un messaggio ASCII */
+#define MSG_HEADER_LEN     11
+/** lunghezza dell'intestazione di un messaggio binario */
+#define MSG_BIN_HEADER_LEN 8
+/** primo byte di un messaggio binario; identifica anche la versione del formato */
+#define MSG_BIN_MAGIC      0xB1
+/** dimensione del buffer di lettura di un msgreader_t */
+#define MSG_READER_BUFSIZE 512
+/** lunghezza massima predefinita del buffer di un messaggio ricevuto (vedi setMaxMessageLength()) */
+#define MSG_MAX_LENGTH     65536
+/** dimensione massima del buffer riutilizzato da un msgreader_t; i messaggi
+    piu' lunghi vengono allocati e liberati ogni volta */
+#define MSG_POOL_BUFSIZE   4096
+
+/** <H3>Statistiche di ricezione</H3>
+ * Contatori aggiornati da readMessageNB() con operazioni atomiche; piu'
+ * lettori possono condividere la stessa struttura, e altri thread leggerla
+ * con __atomic_load_n().
+ * - \c oversize messaggi rifiutati perche' piu' lunghi del massimo consentito
+ * - \c poolHits messaggi ricevuti nel buffer riutilizzabile del lettore
+ * - \c poolMisses messaggi per cui e' stato necessario allocare memoria
+ *
+ * <HR>
+ */
+typedef struct {
+    unsigned long oversize;
+    unsigned long poolHits;
+    unsigned long poolMisses;
+} msgstats_t;
+
+/** <H3>Lettore di messaggi</H3>
+ * La struttura \c msgreader_t conserva lo stato dei messaggi letti
+ * da una socket non bloccante (vedi readMessageNB()). Ogni read() riempie
+ * un buffer interno, da cui possono essere estratti piu' messaggi.
+ *
+ * <HR>
+ */
+typedef struct {
+  /** formato usato dal peer (MSG_FRAMING_UNKNOWN finche' non arriva il primo byte) */
+    int framing;
+  /** byte letti dalla socket e non ancora consumati: in[inStart..inEnd) */
+    char in[MSG_READER_BUFSIZE];
+    unsigned int inStart;
+    unsigned int inEnd;
+  /** 1 se l'intestazione del messaggio corrente e' stata letta */
+    int headerDone;
+  /** tipo del messaggio corrente */
+    char type;
+  /** identificativo del messaggio corrente */
+    unsigned short id;
+  /** lunghezza del messaggio corrente */
+    unsigned int length;
+  /** buffer del messaggio corrente (allocato quando l'intestazione e' completa) */
+    char *buffer;
+  /** byte del buffer letti finora */
+    unsigned int bufferRead;
+  /** lunghezza massima accettata per il buffer di un messaggio */
+    unsigned int maxLength;
+  /** buffer riutilizzabile (al massimo MSG_POOL_BUFSIZE byte), allocato al primo uso */
+    char *pool;
+    unsigned int poolSize;
+  /** 1 se il buffer riutilizzabile e' in uso da un messaggio non ancora rilasciato */
+    int poolLent;
+  /** contatori da aggiornare, o NULL */
+    msgstats_t *stats;
+} msgreader_t;
+
 /** lunghezza buffer indirizzo AF_UNIX */
 #define UNIX_PATH_MAX    108
 
@@ -47,21 +141,56 @@ typedef struct {
 /** numero di secondi fra due connessioni consecutive */
 #define NSEC 1
 
+/** attesa prima del primo nuovo tentativo di openConnectionMs() (ms); raddoppia a ogni tentativo */
+#define CONNECT_FIRST_DELAY_MS 1
+/** attesa massima fra due tentativi di openConnectionMs() (ms) */
+#define CONNECT_MAX_DELAY_MS   64
+/** tempo massimo predefinito per connettersi al server (ms) */
+#define CONNECT_DEADLINE_MS    500
+
+/** un path che inizia con questo carattere indica una socket nello spazio dei nomi
+    astratto di Linux: non esiste nel file system, sparisce con l'ultimo descrittore
+    e chiunque puo' connettersi */
+#define ABSTRACT_SOCKET_PREFIX '@'
+
 /** tipi dei messaggi scambiati fra server e client */
-/** richiesta di registrazione nuovo utente passwd */
+/** richiesta di attivazione. Se ha un identificativo, il server
+    risponde con un MSG_ENABLED quando la richiesta e' stata eseguita. */
 #define MSG_ENABLE        'A'
-/** richiesta di cancellazione utente */
+/** richiesta di disattivazione. Se ha un identificativo, il server
+    risponde con un MSG_DISABLED quando la richiesta e' stata eseguita. */
 #define MSG_DISABLE       'B'
 /** richiesta dello stato corrente (attivato/disattivato).
     Risponde con un MSG_ENABLED o un MSG_DISABLED. */
 #define MSG_STATUS       'C'
 #define MSG_ENABLED      'D'
 #define MSG_DISABLED     'E'
+/** richiesta di ricevere gli eventi del demone. La connessione resta
+    aperta e il server invia un MSG_EVENT per ogni cambiamento (vedi events.h). */
+#define MSG_SUBSCRIBE    'F'
+#define MSG_EVENT        'G'
+/** inverte lo stato corrente in un'unica operazione.
+    Risponde con il nuovo stato (MSG_ENABLED o MSG_DISABLED). */
+#define MSG_TOGGLE       'H'
+/** richiesta delle statistiche del demone. Risponde con un MSG_STATS_DATA,
+    il cui buffer e' codificato come descritto in metrics.h */
+#define MSG_STATS        'I'
+#define MSG_STATS_DATA   'J'
+/** richiesta degli ultimi eventi registrati dal demone. Risponde con un
+    MSG_TRACE_DATA, il cui buffer e' codificato come descritto in trace.h */
+#define MSG_TRACE        'K'
+#define MSG_TRACE_DATA   'L'
+/** richiesta di rileggere la configurazione (la curva di luminosita').
+    Risponde con un MSG_RELOADED se e' andata a buon fine, altrimenti con
+    un MSG_FAILED il cui buffer contiene la descrizione dell'errore */
+#define MSG_RELOAD       'M'
+#define MSG_RELOADED     'N'
+#define MSG_FAILED       'O'
 
 
 /* -= FUNZIONI =- */
 /** Crea una socket AF_UNIX
- *  \param  path pathname della socket
+ *  \param  path pathname della socket (o nome astratto, vedi ABSTRACT_SOCKET_PREFIX)
  *
  *  \retval s    il file descriptor della socket  (s>0)
  *  \retval -1   in altri casi di errore (setta errno)
@@ -128,6 +257,22 @@ int sendMessage(int sc, message_t *msg);
  */
 int openConnection(char* path, int ntrial, int k);
 
+/** come openConnection(), ma i tentativi si susseguono con un'attesa che parte da
+ *  firstDelayMs e raddoppia fino a CONNECT_MAX_DELAY_MS, finche' non sono trascorsi deadlineMs.
+ *   \param  path  nome del socket su cui il server accetta le connessioni
+ *   \param  firstDelayMs attesa prima del secondo tentativo (ms, > 0)
+ *   \param  deadlineMs tempo massimo complessivo (ms); con 0 si fa un solo tentativo
+ *
+ *   \return fd il file descriptor della connessione
+ *            se la connessione ha successo
+ *   \retval -1 in caso di errore (setta errno)
+ *               errno = E2BIG se il nome eccede UNIX_PATH_MAX
+ */
+int openConnectionMs(char* path, int firstDelayMs, int deadlineMs);
+
+/** \retval 1 se path indica una socket nello spazio dei nomi astratto, 0 altrimenti */
+int isAbstractSocket(const char *path);
+
 /** Chiude una connessione
  *   \param s file descriptor della socket relativa alla connessione
  *
@@ -136,6 +281,94 @@ int openConnection(char* path, int ntrial, int k);
  */
 int closeConnection(int s);
 
+/** Inizializza un lettore di messaggi (maxLength = getMaxMessageLength(), stats = NULL)
+ *   \param r  lettore da inizializzare
+ */
+void initMessageReader(msgreader_t *r);
+
+/** Libera un eventuale messaggio parzialmente letto e il buffer riutilizzabile, e riporta
+ *  il lettore allo stato iniziale (maxLength e stats restano invariati)
+ *   \param r  lettore da reinizializzare
+ */
+void resetMessageReader(msgreader_t *r);
+
+/** legge da una socket non bloccante i byte disponibili e, se completano un messaggio, lo restituisce in msg.
+ *  Il messaggio puo' arrivare in piu' pezzi: lo stato della lettura e' conservato in r fra una chiamata e l'altra.
+ *  La lunghezza dichiarata nell'intestazione e' controllata prima di allocare
+ *  qualsiasi cosa; i messaggi brevi sono ricevuti nel buffer riutilizzabile del lettore.
+ *   \param  sc  file descriptor della socket (O_NONBLOCK)
+ *   \param  r   stato della lettura
+ *   \param  msg indirizzo della struttura che conterra' il messaggio letto
+ *               (il campo buffer appartiene al lettore e va restituito con releaseMessage())
+ *
+ *   \retval  1  se un messaggio e' stato letto completamente
+ *   \retval  0  se non ci sono altri byte disponibili (il messaggio non e' ancora completo)
+ *   \retval -1  in caso di errore (setta errno)
+ *                 errno = ENOTCONN se il peer ha chiuso la connessione
+ *                 errno = EMSGSIZE se il messaggio supera r->maxLength
+ *                   (la connessione va chiusa: il resto del messaggio non e' stato letto)
+ */
+int readMessageNB(int sc, msgreader_t *r, message_t *msg);
+
+/** restituisce al lettore il buffer di un messaggio letto con readMessageNB()
+ *   \param  r   lettore da cui e' stato letto il messaggio
+ *   \param  msg messaggio da rilasciare (il campo buffer viene azzerato)
+ */
+void releaseMessage(msgreader_t *r, message_t *msg);
+
+/** imposta la lunghezza massima del buffer dei messaggi accettati da receiveFrame()
+ *  e dai lettori inizializzati da qui in avanti
+ *   \param  length  lunghezza massima in byte
+ */
+void setMaxMessageLength(unsigned int length);
+
+/** \retval  la lunghezza massima impostata con setMaxMessageLength() */
+unsigned int getMaxMessageLength();
+
+/** impacchetta un messaggio, senza inviarlo
+ *   \param  msg  messaggio da impacchettare
+ *   \param  framing formato da usare (MSG_FRAMING_ASCII o MSG_FRAMING_BINARY)
+ *   \param  out  buffer di destinazione
+ *   \param  size dimensione di out
+ *
+ *   \retval  n   il numero di byte del messaggio impacchettato (se n > size, out non e' stato scritto)
+ *   \retval -1   in caso di errore (setta errno)
+ */
+int packMessage(message_t *msg, int framing, char *out, int size);
+
+/** prepara l'intestazione di un messaggio
+ *   \param  msg  messaggio
+ *   \param  framing formato da usare (MSG_FRAMING_ASCII o MSG_FRAMING_BINARY)
+ *   \param  header buffer di almeno MSG_HEADER_LEN byte
+ *
+ *   \retval  n   la lunghezza dell'intestazione
+ *   \retval -1   in caso di errore (setta errno)
+ */
+int packHeader(message_t *msg, int framing, char *header);
+
+/** come sendMessage(), ma nel formato indicato. Intestazione e buffer sono inviati
+ *  con un'unica sendmsg(), senza copiarli in un buffer intermedio.
+ *   \param  sc file descriptor della socket
+ *   \param  msg indirizzo della struttura che contiene il messaggio da scrivere
+ *   \param  framing MSG_FRAMING_ASCII o MSG_FRAMING_BINARY
+ *
+ *   \retval  n    il numero di byte inviati (se scrittura OK)
+ *   \retval -1   in caso di errore (setta errno)
+ */
+int sendFrame(int sc, message_t *msg, int framing);
+
+/** come receiveMessage(), ma nel formato indicato
+ *   \param  sc  file descriptor della socket
+ *   \param  msg indirizzo della struttura che conterra' il messaggio letto
+ *   \param  framing MSG_FRAMING_ASCII o MSG_FRAMING_BINARY
+ *
+ *   \retval lung  numero di byte letti, se OK
+ *   \retval  -1   in caso di errore (setta errno)
+ *                 errno = ENOTCONN se il peer ha chiuso la connessione
+ *                 errno = EMSGSIZE se il messaggio supera getMaxMessageLength()
+ */
+int receiveFrame(int sc, message_t *msg, int framing);
+
 /** Esegue la free di un messaggio e del suo campo buffer
  *   \param msg   puntatore al messaggio da liberare
  *   \param onHeap  1 se il messaggio è nello heap (verrà deallocato), 0 altrimenti.
@@ -0,0 +1,909 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <errno.h>
+#include "comsock.h"
+#include "controller.h"
+#include "attribute.h"
+#include "backlight.h"
+#include "ramp.h"
+#include "devices.h"
+#include "server.h"
+#include "metrics.h"
+#include "trace.h"
+#include "sampler.h"
+#include "sensor.h"
+#include "iio.h"
+#include "record.h"
+#include "logger.h"
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+using namespace std;
+
+void logServerExit(int __status, int __pri, const char *fmt);
+void logBacklightStats(const BacklightWriter &writer);
+void logRampStats(const char *name, const BrightnessRamp &ramp);
+void logServerStats();
+void logStats();
+void *IPCHandler(void *);
+void shutdownDaemon(pthread_t ipcThread);
+void applyDevices();
+void publishBacklight(BacklightWriter &writer, int value);
+
+volatile bool active = false;
+/** Set by requestShutdown(): controlLoop() returns */
+volatile bool g_stopping = false;
+
+IPCServer g_server;
+
+const string SOCKET_PATH = "/var/run/als-controller.socket";
+/** Used instead of SOCKET_PATH with --abstract */
+const string ABSTRACT_SOCKET_NAME = "@als-controller";
+const string PIDFILE_PATH = "/var/run/als-controller.pid";
+/** Written on SIGUSR1, see trace.h */
+const string TRACE_DUMP_PATH = "/var/run/als-controller.trace";
+/** Brightness curve, see curve.h. The built-in one is used if missing. */
+const string CURVE_PATH = "/etc/als-controller.curve";
+const string LID_STATE_PATH = "/proc/acpi/button/lid/LID/state";
+/** Searched for the input device reporting the lid switch (see LidMonitor) */
+const string INPUT_CLASS_PATH = "/sys/class/input";
+const string INPUT_DEV_PATH = "/dev/input";
+const string BACKLIGHT_CLASS_PATH = "/sys/class/backlight";
+const string LEDS_CLASS_PATH = "/sys/class/leds";
+
+/** Screen backlights in order of preference, by name or by type */
+const char *BACKLIGHT_PRIORITY[] = { "acpi_video0", "intel_backlight", "firmware", "platform", "raw" };
+/** --backlights, BACKLIGHT_PRIORITY by default */
+vector<string> g_backlightPriority(BACKLIGHT_PRIORITY,
+                                   BACKLIGHT_PRIORITY + sizeof(BACKLIGHT_PRIORITY) / sizeof(BACKLIGHT_PRIORITY[0]));
+
+/** Interval between two samples once the driver has been seen notifying,
+ *  in case a notification gets lost (ms) */
+const int NOTIFY_WATCHDOG_MS = 30000;
+/** Without a lid switch device, procfs is read at least this often (ms) */
+const int LID_POLL_MS = 3000;
+/** Pause after poll() failed, before the loop tries again. Kept short: the
+ *  signals and the requests wait for it (ms) */
+const int POLL_ERROR_PAUSE_MS = 1000;
+/** Longest request accepted on the control socket. No request carries
+ *  a payload yet, this only leaves room for future ones. */
+const unsigned int MAX_REQUEST_LENGTH = 1024;
+/** Time left to the IPC thread to answer the requests already received
+ *  when terminating (ms) */
+const int SHUTDOWN_TIMEOUT_MS = 1000;
+
+/* Attributes touched by the control loop, opened once by openAttributes() */
+LightSensor *g_sensor = NULL;
+Attribute g_lidState;
+DeviceRegistry g_devices;
+LidMonitor g_lid;
+
+BacklightWriter g_screenWriter("Screen", TRACE_DEV_SCREEN);
+BacklightWriter g_kbdWriter("Keyboard", TRACE_DEV_KEYBOARD);
+
+/** A full-scale screen transition lasts g_screenRampConfig.durationMs, a
+ *  smaller one proportionally less. The keyboard only has 4 levels, so it
+ *  takes at most 3 frames. */
+ramp_config_t g_screenRampConfig = { 800, 60, 1, EASE_IN_OUT };
+ramp_config_t g_kbdRampConfig = { 600, 5, 1, EASE_LINEAR };
+
+BrightnessRamp g_screenRamp(g_screenWriter);
+BrightnessRamp g_kbdRamp(g_kbdWriter);
+
+/** Sampling interval when the driver doesn't notify changes: 250 ms after a
+ *  change, doubling up to 8 s while the light is stable (see AdaptiveSampler) */
+sampler_config_t g_samplerConfig = { 250, 8000, 2, 10 };
+AdaptiveSampler g_sampler;
+
+/** Median of 3, 25% moving average, 10% band, reversals at most every 5 s
+ *  (see LightFilter) */
+filter_config_t g_filterConfig = { 3, 25, 10, 2, 5000, 250 };
+LightFilter g_filter;
+
+/** --curve, rooted(CURVE_PATH) if empty */
+string g_curvePath = "";
+/** Only touched by the control thread, see adoptPendingCurve() */
+curve_table_t *g_curve = NULL;
+/** Compiled by reloadCurve(), not yet in use */
+curve_table_t *g_pendingCurve = NULL;
+
+/** --record, nothing is recorded if empty */
+string g_recordPath = "";
+Recorder g_recorder;
+
+/* Counters reported by MSG_STATS (see collectMetrics()) */
+uint64_t g_iterations = 0;
+histogram_t g_sensorReadTime;
+histogram_t g_lidReadTime;
+/** Only touched by the IPC thread */
+uint64_t g_requests[REQUEST_KINDS];
+
+/** --sensor: acpi, iio or auto */
+string g_sensorType = "auto";
+/** true once the sensor has woken us at least once */
+bool g_sensorNotifies = false;
+string g_root = "";
+string g_socketPath = SOCKET_PATH;
+char* C_SOCKET_PATH = (char*)g_socketPath.c_str();
+
+pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+/** eventfd that wakes up the control loop when the state or the curve
+ *  change, see wakeControl() */
+int g_wakeFd = -1;
+
+/** signalfd receiving the signals of the daemon, polled by the control
+ *  loop; -1 when the control loop runs outside of the daemon */
+int g_signalFd = -1;
+
+/**
+ * SIGINT, SIGTERM: terminate (see shutdownDaemon())
+ * SIGHUP: reload the brightness curve
+ * SIGUSR1: log the statistics and write the trace to TRACE_DUMP_PATH
+ */
+void handleSignals() {
+    struct signalfd_siginfo info;
+    while(read(g_signalFd, &info, sizeof(info)) == sizeof(info)) {
+        int signum = info.ssi_signo;
+        if(signum == SIGINT || signum == SIGTERM) {
+            requestShutdown();
+        } else if(signum == SIGHUP) {
+            string error;
+            if(reloadCurve(&error) == -1)
+                logMessage(LOG_ERR, "Invalid brightness curve, keeping the current one: %s", error.c_str());
+        } else if(signum == SIGUSR1) {
+            logStats();
+            string path = rooted(TRACE_DUMP_PATH);
+            if(traceDumpToFile(path) == -1)
+                logMessage(LOG_ERR, "Error writing the trace to %s", path.c_str());
+            else
+                logMessage(LOG_INFO, "Trace written to %s", path.c_str());
+        }
+    }
+}
+
+void logServerExit(int __status, int __pri, const char *fmt) {
+    // Other threads may still be using the server: just remove the socket
+    if(g_server.isOpen() && !isAbstractSocket(C_SOCKET_PATH))
+        unlink(C_SOCKET_PATH);
+    if(g_sensor != NULL)
+        g_sensor->enable(false);
+    g_recorder.flush();
+    logMessage(__pri, "%s", fmt);
+    logStats();
+    if(__status != EXIT_SUCCESS)
+        logMessage(LOG_INFO, "Terminated.");
+    loggerFlush(SHUTDOWN_TIMEOUT_MS);
+    closelog();
+    exit(__status);
+}
+
+string rooted(const string &path) {
+    return g_root + path;
+}
+
+void logBacklightStats(const BacklightWriter &writer) {
+    backlight_stats_t stats = writer.getStats();
+    logMessage(LOG_INFO, "%s: %lu writes issued, %lu skipped, %lu external changes, %lu errors",
+               writer.getName().c_str(), stats.written, stats.skipped,
+               stats.externalChanges, stats.errors);
+}
+
+void logRampStats(const char *name, const BrightnessRamp &ramp) {
+    ramp_stats_t stats = ramp.getStats();
+    logMessage(LOG_INFO, "%s ramp: %lu transitions (%lu taken over), %lu frames, %lu missed, "
+               "%d frames planned last, %d max",
+               name, stats.transitions, stats.preempted, stats.frames, stats.missedFrames,
+               stats.lastPlannedFrames, stats.maxPlannedFrames);
+}
+
+void logStats() {
+    logBacklightStats(g_screenWriter);
+    logBacklightStats(g_kbdWriter);
+    logRampStats("Screen", g_screenRamp);
+    logRampStats("Keyboard", g_kbdRamp);
+    logServerStats();
+}
+
+void logServerStats() {
+    msgstats_t stats = g_server.getMessageStats();
+    logMessage(LOG_INFO, "IPC: %lu oversize requests rejected, %lu receive buffer hits, %lu misses, "
+               "%lu events coalesced",
+               stats.oversize, stats.poolHits, stats.poolMisses, g_server.getCoalescedEvents());
+
+    filter_stats_t filter = g_filter.getStats();
+    logMessage(LOG_INFO, "Filter: %lu samples, %lu changes applied, %lu suppressed by hysteresis, "
+               "%lu by dwell time",
+               filter.samples, filter.applied, filter.suppressedHysteresis, filter.suppressedDwell);
+
+    sampler_stats_t sampler = g_sampler.getStats();
+    logMessage(LOG_INFO, "Sampler: %lu wakeups (%.0f per hour), %lu samples, %lu light changes, "
+               "interval %d ms",
+               sampler.wakeups, sampler.wakeupsPerHour, sampler.samples, sampler.changes,
+               sampler.intervalMs);
+
+    logger_stats_t logger = loggerGetStats();
+    logMessage(LOG_INFO, "Logger: %lu messages, %lu coalesced, %lu suppressed by the rate limit, "
+               "%lu dropped",
+               logger.queued, logger.coalesced, logger.suppressed, logger.dropped);
+}
+
+void enableALS(bool enable) {
+    if(g_sensor->enable(enable) == -1) {
+        string msg = "Error enabling " + g_sensor->getPath();
+        logServerExit(EXIT_FAILURE, LOG_CRIT, msg.c_str());
+    }
+
+    if (enable)
+        logMessage(LOG_INFO, "ALS enabled");
+    else
+        logMessage(LOG_INFO, "ALS disabled");
+}
+
+void setScreenBacklight(int level) {
+    if(!g_devices.hasScreen())
+        return;
+    int maxScreenBacklight = g_devices.getScreen().maxBrightness;
+
+    if(g_screenRamp.setTarget((long long)maxScreenBacklight * level / BRIGHTNESS_ONE) == -1) {
+        logMessage(LOG_ERR, "Failed to set screen backlight.");
+    }
+}
+
+void setKeyboardBacklight(int level, bool immediate) {
+    if(!g_devices.hasKeyboard())
+        return;
+
+    // Split 0-100% into max+1 equal bands: with 3 levels
+    // 0-25% is off, 26-50% is 1, 51-75% is 2 and 76-100% is 3.
+    int max = g_devices.getKeyboard().maxBrightness;
+    int value = (level * (max + 1) + BRIGHTNESS_ONE - 1) / BRIGHTNESS_ONE - 1;
+    if(value < 0) value = 0;
+    if(value > max) value = max;
+
+    if(g_kbdRamp.setTarget(value, immediate) == -1) {
+        logMessage(LOG_ERR, "Failed to set keyboard backlight.");
+    }
+}
+
+int getLidStatus() {
+    // Once the input device has reported the lid, procfs is not needed
+    if(g_lid.getFd() != -1 && g_lid.getState() != -2) {
+        trace(TRACE_LID, g_lid.getState());
+        return g_lid.getState();
+    }
+
+    char str[100];
+    int64_t start = metricsClockNs();
+    if(g_lidState.read(str, sizeof(str)) == -1) {
+        logMessage(LOG_ERR, "Error reading %s", rooted(LID_STATE_PATH).c_str());
+        return -1;
+    }
+    histogramRecord(&g_lidReadTime, metricsClockNs() - start);
+
+    int lid;
+    if(strstr(str, "open") != NULL) {
+        lid = 1;
+    } else if(strstr(str, "closed") != NULL) {
+        lid = 0;
+    } else {
+        lid = -2;
+    }
+    trace(TRACE_LID, lid);
+    return lid;
+}
+
+/**
+ * @brief openAttributes
+ * Opens the sensor and every attribute used by the control loop. Only the
+ * sensor is mandatory: the others are retried on the next access and
+ * logged on failure.
+ */
+void openAttributes() {
+    string error;
+    g_sensor = openLightSensor(g_sensorType, g_root, &error);
+    if(g_sensor == NULL) {
+        logServerExit(EXIT_FAILURE, LOG_CRIT, ("No light sensor: " + error).c_str());
+    }
+    IioSensor *iio = dynamic_cast<IioSensor *>(g_sensor);
+    logMessage(LOG_INFO, "Light sensor: %s (%s%s)", g_sensor->getPath().c_str(), g_sensor->getType(),
+               iio != NULL ? (iio->isBuffered() ? ", buffered" : ", polled") : "");
+
+    if(g_lidState.open(rooted(LID_STATE_PATH), O_RDONLY) == -1)
+        logMessage(LOG_WARNING, "Error opening %s", rooted(LID_STATE_PATH).c_str());
+    if(g_lid.init(rooted(INPUT_CLASS_PATH), rooted(INPUT_DEV_PATH)) == 0)
+        logMessage(LOG_INFO, "Lid switch: %s", g_lid.getPath().c_str());
+    else
+        logMessage(LOG_INFO, "No lid switch input device, reading %s", rooted(LID_STATE_PATH).c_str());
+
+    // Nobody sends uevents for a fake tree
+    if(g_devices.init(rooted(BACKLIGHT_CLASS_PATH), rooted(LEDS_CLASS_PATH), g_backlightPriority, g_root.empty()) == -1)
+        logMessage(LOG_WARNING, "Cannot watch backlight devices, hot-plugged devices won't be seen");
+    applyDevices();
+
+    // Without a timer the ramps just jump to the target
+    if(g_screenRamp.init(g_screenRampConfig) == -1 || g_kbdRamp.init(g_kbdRampConfig) == -1)
+        logMessage(LOG_WARNING, "Cannot create brightness timers, transitions disabled");
+}
+
+/**
+ * @brief applyDevices
+ * Points the backlight writers to the devices currently selected by g_devices.
+ */
+void applyDevices() {
+    g_screenRamp.cancel();
+    g_kbdRamp.cancel();
+
+    if(g_devices.hasScreen()) {
+        const backlight_device_t &screen = g_devices.getScreen();
+        if(g_screenWriter.open(screen.path + "brightness") == -1)
+            logMessage(LOG_WARNING, "Error opening %sbrightness", screen.path.c_str());
+        else
+            logMessage(LOG_INFO, "Screen backlight: %s (max %d)", screen.name.c_str(), screen.maxBrightness);
+        g_screenRamp.setFullScale(screen.maxBrightness);
+    } else {
+        logMessage(LOG_WARNING, "No screen backlight found in %s", rooted(BACKLIGHT_CLASS_PATH).c_str());
+    }
+
+    if(g_devices.hasKeyboard()) {
+        const backlight_device_t &kbd = g_devices.getKeyboard();
+        if(g_kbdWriter.open(kbd.path + "brightness") == -1)
+            logMessage(LOG_WARNING, "Error opening %sbrightness", kbd.path.c_str());
+        else
+            logMessage(LOG_INFO, "Keyboard backlight: %s (max %d)", kbd.name.c_str(), kbd.maxBrightness);
+        g_kbdRamp.setFullScale(kbd.maxBrightness);
+    }
+}
+
+/**
+ * @brief monotonicMs
+ * @return milliseconds from an arbitrary point, not affected by clock changes
+ */
+long long monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void wakeControl() {
+    uint64_t one = 1;
+    if(g_wakeFd != -1 && write(g_wakeFd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        logMessage(LOG_ERR, "Error waking up the control loop.");
+}
+
+/**
+ * @brief waitAmbientLightChange
+ * Brightness transitions in progress are driven from here in the meantime.
+ * While \a sensing is false, only wakeControl() and the devices end the wait.
+ */
+void waitAmbientLightChange(bool sensing) {
+    BrightnessRamp *ramps[] = { &g_screenRamp, &g_kbdRamp };
+    const int nramps = sizeof(ramps) / sizeof(ramps[0]);
+
+    long long deadline = -1;
+    if(sensing) {
+        int interval = g_sensorNotifies ? NOTIFY_WATCHDOG_MS : g_sampler.getIntervalMs();
+        // Nothing tells us when the lid closes, however quiet the sensor is
+        if(g_lid.getFd() == -1 && interval > LID_POLL_MS)
+            interval = LID_POLL_MS;
+        // The driver won't notify again while the filter output catches up
+        int settle = g_filter.nextSampleMs(monotonicMs());
+        if(settle >= 0 && settle < interval)
+            interval = settle;
+        deadline = monotonicMs() + interval;
+        g_sampler.applySlack();
+    }
+
+    while(1) {
+        struct pollfd fds[SENSOR_MAX_FDS + 4 + nramps];
+        // The sensor comes first, see onPoll() below
+        int nsensor = sensing ? g_sensor->getPollFds(fds) : 0;
+        nfds_t nfds = nsensor;
+
+        fds[nfds].fd = g_wakeFd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+        if(g_signalFd != -1) {
+            fds[nfds].fd = g_signalFd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+        if(g_devices.getFd() != -1) {
+            fds[nfds].fd = g_devices.getFd();
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+        if(g_lid.getFd() != -1) {
+            fds[nfds].fd = g_lid.getFd();
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+        nfds_t firstRamp = nfds;
+        for(int i = 0; i < nramps; i++) {
+            if(ramps[i]->isRunning()) {
+                fds[nfds].fd = ramps[i]->getFd();
+                fds[nfds].events = POLLIN;
+                nfds++;
+            }
+        }
+
+        long long timeout = deadline == -1 ? -1 : deadline - monotonicMs();
+        if(deadline != -1 && timeout < 0)
+            timeout = 0;
+
+        int ret = poll(fds, nfds, (int)timeout);
+        if(ret == -1 && errno != EINTR) {
+            logMessage(LOG_ERR, "Error polling %s", g_sensor->getPath().c_str());
+            struct timespec pause = { POLL_ERROR_PAUSE_MS / 1000,
+                                      (POLL_ERROR_PAUSE_MS % 1000) * 1000000L };
+            nanosleep(&pause, NULL);
+            return;
+        }
+        if(ret == -1)
+            continue;
+        if(ret == 0) {
+            g_sampler.onWakeup(false);
+            return;
+        }
+
+        bool changed = sensing && g_sensor->onPoll(fds, nsensor), resample = false;
+        for(nfds_t i = nsensor; i < nfds; i++) {
+            if(fds[i].revents == 0)
+                continue;
+            if(fds[i].fd == g_wakeFd) {
+                uint64_t count;
+                if(read(g_wakeFd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                    logMessage(LOG_ERR, "Error reading the control eventfd.");
+                resample = true;
+                continue;
+            }
+            if(fds[i].fd == g_signalFd) {
+                handleSignals();
+                resample = true;
+                continue;
+            }
+            if(fds[i].fd == g_devices.getFd()) {
+                if(g_devices.onEvent()) {
+                    // A new device needs to be brought to the current level
+                    applyDevices();
+                    resample = true;
+                }
+                continue;
+            }
+            if(fds[i].fd == g_lid.getFd()) {
+                // Closing turns the keyboard off, opening samples the light right away
+                if(g_lid.onEvent())
+                    resample = true;
+                continue;
+            }
+            if(i >= firstRamp) {
+                for(int r = 0; r < nramps; r++) {
+                    if(ramps[r]->getFd() == fds[i].fd)
+                        ramps[r]->onTimer();
+                }
+            }
+        }
+
+        // Ramp frames and device events count too: every poll() return is a wakeup
+        if(sensing)
+            g_sampler.onWakeup(changed);
+        if(changed)
+            g_sensorNotifies = true;
+        if(changed || resample)
+            return;
+    }
+}
+
+void initControl() {
+    g_screenWriter.setListener(publishBacklight);
+    g_kbdWriter.setListener(publishBacklight);
+    g_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(g_wakeFd == -1)
+        logServerExit(EXIT_FAILURE, LOG_CRIT, "Cannot create the control eventfd.");
+    openAttributes();
+    g_sampler.init(g_samplerConfig);
+    g_filter.init(g_filterConfig);
+
+    string error;
+    if(reloadCurve(&error) == -1) {
+        logMessage(LOG_ERR, "Invalid brightness curve, using the built-in one: %s", error.c_str());
+        g_pendingCurve = compileCurve(defaultCurve());
+    }
+    adoptPendingCurve();
+    if(g_curve == NULL)
+        logServerExit(EXIT_FAILURE, LOG_CRIT, "Cannot build the brightness curve.");
+
+    if(!g_recordPath.empty()) {
+        if(g_recorder.open(g_recordPath, monotonicMs()) == -1)
+            logMessage(LOG_ERR, "Cannot record to %s: %s", g_recordPath.c_str(), strerror(errno));
+        else
+            logMessage(LOG_INFO, "Recording to %s", g_recordPath.c_str());
+    }
+    g_server.publish(EVENT_ENABLED, active ? 1 : 0);
+}
+
+void publishBacklight(BacklightWriter &writer, int value) {
+    g_server.publish(&writer == &g_screenWriter ? EVENT_SCREEN : EVENT_KEYBOARD, value);
+}
+
+void setActive(bool enable) {
+    trace(TRACE_ENABLE, enable ? 1 : 0);
+    g_server.publish(EVENT_ENABLED, enable ? 1 : 0);
+    // The control loop switches the sensor, between two reads of it
+    pthread_mutex_lock(&mtx);
+    active = enable;
+    pthread_mutex_unlock(&mtx);
+    wakeControl();
+}
+
+/** Only the IPC thread changes the state, one request at a time, so
+ *  nothing can slip in between the read and setActive(). */
+bool toggleActive() {
+    pthread_mutex_lock(&mtx);
+    bool enable = !active;
+    pthread_mutex_unlock(&mtx);
+
+    setActive(enable);
+    return enable;
+}
+
+curve_table_t *loadBrightnessCurve(string *source, string *error) {
+    string path = g_curvePath.empty() ? rooted(CURVE_PATH) : g_curvePath;
+    curve_config_t config;
+    if(loadCurve(path, &config, error) == -1) {
+        // Only the default file is optional
+        if(errno != ENOENT || !g_curvePath.empty())
+            return NULL;
+        config = defaultCurve();
+        path = "built-in";
+    }
+
+    curve_table_t *table = compileCurve(config);
+    if(table == NULL) {
+        *error = "out of memory";
+        return NULL;
+    }
+    char points[32];
+    snprintf(points, sizeof(points), ", %zu points", config.points.size());
+    *source = path + points;
+    return table;
+}
+
+int reloadCurve(string *error) {
+    string source;
+    curve_table_t *table = loadBrightnessCurve(&source, error);
+    if(table == NULL)
+        return -1;
+    freeCurve(__atomic_exchange_n(&g_pendingCurve, table, __ATOMIC_ACQ_REL));
+    logMessage(LOG_INFO, "Brightness curve: %s", source.c_str());
+    wakeControl();
+    return 0;
+}
+
+void adoptPendingCurve() {
+    if(__atomic_load_n(&g_pendingCurve, __ATOMIC_RELAXED) == NULL)
+        return;
+    curve_table_t *table = __atomic_exchange_n(&g_pendingCurve, (curve_table_t *)NULL, __ATOMIC_ACQ_REL);
+    if(table != NULL) {
+        freeCurve(g_curve);
+        g_curve = table;
+    }
+}
+
+void decideBacklight(int als, int *screen, int *kbd) {
+    const curve_entry_t *e = curveLookup(g_curve, als);
+    *screen = e->screen;
+    *kbd = e->keyboard;
+}
+
+void controlIteration() {
+    __sync_fetch_and_add(&g_iterations, 1);
+    long long now = monotonicMs();
+    int lid = getLidStatus();
+    g_recorder.lid(now, lid);
+    g_server.publish(EVENT_LID, lid);
+    if(lid == 0) {
+        setKeyboardBacklight(0, true);
+        return;
+    }
+
+    int als = readAmbientLight();
+    g_server.publish(EVENT_LUX, als);
+
+    int screen, kbd;
+    adoptPendingCurve();
+    g_sampler.onSample(ambientLightToPercent(als));
+    int filtered = g_filter.update(als, now);
+    decideBacklight(filtered, &screen, &kbd);
+    trace(TRACE_DECISION, ambientLightToPercent(filtered), screen, kbd);
+    g_recorder.sample(now, als, filtered, screen, kbd);
+    setScreenBacklight(screen);
+    setKeyboardBacklight(kbd);
+}
+
+void requestShutdown() {
+    g_stopping = true;
+    wakeControl();
+}
+
+void shutdownControl() {
+    // No half-done transition is left behind
+    g_screenRamp.finish();
+    g_kbdRamp.finish();
+    if(g_sensor != NULL && g_sensor->enable(false) == -1)
+        logMessage(LOG_ERR, "Error disabling %s", g_sensor->getPath().c_str());
+    g_recorder.flush();
+}
+
+void controlLoop() {
+    bool wasActive = false;
+    while(!g_stopping) {
+        pthread_mutex_lock(&mtx);
+        bool on = active;
+        pthread_mutex_unlock(&mtx);
+
+        if(on != wasActive)
+            enableALS(on);
+        if(on) {
+            controlIteration();
+        } else if(wasActive) {
+            // Disabled: the brightness stays where it is right now
+            g_screenRamp.cancel();
+            g_kbdRamp.cancel();
+        }
+        wasActive = on;
+        if(!g_stopping)
+            waitAmbientLightChange(on);
+    }
+}
+
+int getAmbientLightPercent() {
+    return ambientLightToPercent(readAmbientLight());
+}
+
+int readAmbientLight() {
+    int als;
+    int64_t start = metricsClockNs();
+    if(g_sensor->read(&als) == -1) {
+        logServerExit(EXIT_FAILURE, LOG_CRIT, ("Error reading " + g_sensor->getPath()).c_str());
+    }
+    histogramRecord(&g_sensorReadTime, metricsClockNs() - start);
+
+    trace(TRACE_SENSOR, als);
+    return als;
+}
+
+int ambientLightToPercent(int als) {
+    return curveLookup(g_curve, als)->light;
+}
+
+void startDaemon()
+{
+    logMessage(LOG_NOTICE, "Started.");
+    traceThread("control");
+
+    /* Signals are blocked in all threads (the mask is inherited) and
+     * received by the control loop through a signalfd, between two
+     * iterations: a signal never interrupts a write. */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    if(pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        logServerExit(EXIT_FAILURE, LOG_CRIT, "Sigmask error.");
+    }
+    g_signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(g_signalFd == -1) {
+        logServerExit(EXIT_FAILURE, LOG_CRIT, "Cannot create the signalfd.");
+    }
+    // After the sigmask, which the logger thread inherits
+    if(loggerStart() == -1)
+        logMessage(LOG_WARNING, "Cannot start the logger thread, logging synchronously: %s", strerror(errno));
+
+    initControl();
+
+    pthread_t thread_id;
+    int err = pthread_create(&thread_id, NULL, IPCHandler, NULL);
+    if(err != 0) {
+        logMessage(LOG_CRIT, "Cannot create thread");
+        loggerFlush(SHUTDOWN_TIMEOUT_MS);
+        exit(EXIT_FAILURE);
+    }
+
+    controlLoop();
+    shutdownDaemon(thread_id);
+}
+
+/**
+ * @brief shutdownDaemon
+ * Lets the IPC thread answer the requests already received (at most
+ * SHUTDOWN_TIMEOUT_MS), then completes the transitions in progress and
+ * disables the sensor. Called by the control thread once controlLoop() has
+ * returned, so nothing else is writing. main() removes the pidfile and
+ * exits afterwards.
+ */
+void shutdownDaemon(pthread_t ipcThread) {
+    int64_t start = metricsClockNs();
+
+    g_server.stop(SHUTDOWN_TIMEOUT_MS);
+    // run() returns by itself at the deadline: the margin is for a stuck handler
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SHUTDOWN_TIMEOUT_MS / 1000 + 1;
+    if(pthread_timedjoin_np(ipcThread, NULL, &deadline) == 0)
+        g_server.close();
+    else
+        logMessage(LOG_WARNING, "The IPC thread didn't stop in time.");
+    int64_t ipcNs = metricsClockNs() - start;
+
+    shutdownControl();
+
+    logMessage(LOG_NOTICE, "Terminated in %.1f ms (%.1f ms answering clients).",
+               (metricsClockNs() - start) / 1e6, ipcNs / 1e6);
+    logStats();
+    loggerFlush(SHUTDOWN_TIMEOUT_MS);
+    closelog();
+}
+
+void *IPCHandler(void *)
+{
+    traceThread("ipc");
+    g_server.setMaxMessageLength(MAX_REQUEST_LENGTH);
+    if(g_server.open(g_socketPath, handleRequest) == -1) {
+      logServerExit(EXIT_FAILURE, LOG_CRIT, "Error creating socket");
+    }
+
+    g_server.run();
+    if(!g_stopping)
+        logServerExit(EXIT_FAILURE, LOG_CRIT, "IPC server stopped.");
+    return NULL;
+}
+
+static void collectBacklight(const BacklightWriter &writer, backlight_metrics_t *m)
+{
+    backlight_stats_t stats = writer.getStats();
+    m->issued = stats.written;
+    m->skipped = stats.skipped;
+    m->errors = stats.errors;
+    histogramRead(&writer.getWriteTime(), &m->writeTime);
+}
+
+void collectMetrics(const IPCServer &server, metrics_t *m)
+{
+    memset(m, 0, sizeof(*m));
+    m->iterations = __atomic_load_n(&g_iterations, __ATOMIC_RELAXED);
+    histogramRead(&g_sensorReadTime, &m->sensorRead);
+    histogramRead(&g_lidReadTime, &m->lidRead);
+    collectBacklight(g_screenWriter, &m->screen);
+    collectBacklight(g_kbdWriter, &m->keyboard);
+    memcpy(m->requests, g_requests, sizeof(m->requests));
+    histogramRead(&server.getAcceptToReply(), &m->acceptToReply);
+    m->connections = server.getConnectionCount();
+    m->rssBytes = residentBytes();
+
+    sampler_stats_t sampler = g_sampler.getStats();
+    m->wakeups = sampler.wakeups;
+    m->wakeupsPerHour = (uint64_t)sampler.wakeupsPerHour;
+    m->sampleIntervalMs = sampler.intervalMs;
+    m->lightChanges = sampler.changes;
+    m->reactionTime = sampler.reactionTime;
+
+    filter_stats_t filter = g_filter.getStats();
+    m->filterApplied = filter.applied;
+    m->filterSuppressedHysteresis = filter.suppressedHysteresis;
+    m->filterSuppressedDwell = filter.suppressedDwell;
+}
+
+void handleRequest(IPCServer &server, int client, message_t *msg)
+{
+    bool reply = false;
+
+    g_requests[requestKind(msg->type)]++;
+    trace(TRACE_REQUEST, msg->type, msg->id, client);
+
+    if(msg->type == MSG_ENABLE) {
+        setActive(true);
+        // Old clients don't expect an answer and don't send an id
+        reply = msg->id != 0;
+    } else if(msg->type == MSG_DISABLE) {
+        setActive(false);
+        reply = msg->id != 0;
+    } else if(msg->type == MSG_STATUS) {
+        reply = true;
+    } else if(msg->type == MSG_TOGGLE) {
+        toggleActive();
+        reply = true;
+    } else if(msg->type == MSG_SUBSCRIBE) {
+        if(server.subscribe(client) == -1) {
+            logMessage(LOG_ERR, "Error sending events to client.");
+        }
+    } else if(msg->type == MSG_TRACE) {
+        string data = traceDump();
+
+        message_t answer;
+        answer.type = MSG_TRACE_DATA;
+        answer.id = msg->id;
+        answer.buffer = (char *)data.data();
+        answer.length = data.size();
+
+        if(server.send(client, &answer) == -1) {
+            logMessage(LOG_ERR, "Error sending reply to client.");
+        }
+    } else if(msg->type == MSG_RELOAD) {
+        string error;
+        message_t answer;
+        answer.id = msg->id;
+        if(reloadCurve(&error) == 0) {
+            answer.type = MSG_RELOADED;
+            answer.buffer = NULL;
+            answer.length = 0;
+        } else {
+            logMessage(LOG_ERR, "Cannot reload the brightness curve: %s", error.c_str());
+            answer.type = MSG_FAILED;
+            answer.buffer = (char *)error.data();
+            answer.length = error.size();
+        }
+
+        if(server.send(client, &answer) == -1) {
+            logMessage(LOG_ERR, "Error sending reply to client.");
+        }
+    } else if(msg->type == MSG_STATS) {
+        metrics_t metrics;
+        collectMetrics(server, &metrics);
+        string data = encodeMetrics(&metrics);
+
+        message_t answer;
+        answer.type = MSG_STATS_DATA;
+        answer.id = msg->id;
+        answer.buffer = (char *)data.data();
+        answer.length = data.size();
+
+        if(server.send(client, &answer) == -1) {
+            logMessage(LOG_ERR, "Error sending reply to client.");
+        }
+    }
+
+    if(reply) {
+        bool status = false;
+        pthread_mutex_lock(&mtx);
+        status = active;
+        pthread_mutex_unlock(&mtx);
+
+        message_t answer;
+
+        answer.type = status ? MSG_ENABLED : MSG_DISABLED;
+        answer.id = msg->id;
+        answer.buffer = NULL;
+        answer.length = 0;
+
+        if(server.send(client, &answer) == -1) {
+            logMessage(LOG_ERR, "Error sending reply to client.");
+        }
+    }
+}
@@ -0,0 +1,114 @@
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include <string>
+#include <vector>
+#include "ramp.h"
+#include "server.h"
+#include "sampler.h"
+#include "curve.h"
+#include "filter.h"
+#include "lid.h"
+using namespace std;
+
+extern const string SOCKET_PATH;
+extern const string ABSTRACT_SOCKET_NAME;
+extern const string PIDFILE_PATH;
+extern const string TRACE_DUMP_PATH;
+extern const string CURVE_PATH;
+extern const int LID_POLL_MS;
+
+/** Prefix prepended to every sysfs, procfs and /var/run path (--root) */
+extern string g_root;
+extern string g_socketPath;
+extern char* C_SOCKET_PATH;
+/** Sensor backend: "acpi", "iio" or "auto" (see openLightSensor()) */
+extern string g_sensorType;
+/** Brightness curve given with --curve; empty for rooted(CURVE_PATH) */
+extern string g_curvePath;
+/** Recording written by the control loop (--record); empty for none */
+extern string g_recordPath;
+/** Screen backlights in order of preference, each one a device name or a
+ *  type (--backlights) */
+extern vector<string> g_backlightPriority;
+
+extern ramp_config_t g_screenRampConfig;
+extern ramp_config_t g_kbdRampConfig;
+extern sampler_config_t g_samplerConfig;
+extern filter_config_t g_filterConfig;
+
+/** @return \a path inside the tree selected with --root */
+string rooted(const string &path);
+
+/** Runs the daemon: control loop, IPC and signal handling. Returns once
+ *  terminated by SIGTERM or SIGINT. */
+void startDaemon();
+/** Makes controlLoop() return at once. Any thread. */
+void requestShutdown();
+/**
+ * Jumps the transitions in progress to their end, disables the sensor and
+ * flushes the recording. Control thread, once controlLoop() has returned.
+ */
+void shutdownControl();
+
+/** Opens the sysfs attributes and the devices used by the control loop. */
+void initControl();
+/** Enables or disables the control loop, which switches the sensor on or
+ *  off at its next iteration. Any thread. */
+void setActive(bool enable);
+/** Inverts the state set by setActive() and returns the new one. */
+bool toggleActive();
+/** Answers a request received on the control socket (see request_handler_t). */
+void handleRequest(IPCServer &server, int client, message_t *msg);
+/** Fills \a m with the counters of the daemon and of \a server. */
+void collectMetrics(const IPCServer &server, metrics_t *m);
+/** Samples the sensor and the lid and applies the resulting brightness. */
+void controlIteration();
+/** Calls controlIteration() every time the light changes, while active,
+ *  until requestShutdown(). */
+void controlLoop();
+/**
+ * Blocks until the sensor reports a change or the sampling interval
+ * expires (only if \a sensing), or until wakeControl() is called.
+ */
+void waitAmbientLightChange(bool sensing);
+/** Makes the control loop look at the state and the curve again. Any thread. */
+void wakeControl();
+
+/**
+ * Reads and compiles the brightness curve selected with --curve, or the
+ * default one. \a source describes where it comes from.
+ * \return the table (see freeCurve()), NULL if the curve is invalid (\a error says why)
+ */
+curve_table_t *loadBrightnessCurve(string *source, string *error);
+/**
+ * Reads and compiles the brightness curve. The control loop switches to it
+ * at its next iteration. Can be called from any thread.
+ * \retval 0 if ok, -1 if the curve is invalid (the old one stays, \a error says why)
+ */
+int reloadCurve(string *error);
+/** Switches to the curve compiled by reloadCurve(), if any. Control thread only. */
+void adoptPendingCurve();
+/**
+ * Maps a raw illuminance value to the screen and keyboard brightness
+ * (BRIGHTNESS_ONE = 100%) through the brightness curve.
+ */
+void decideBacklight(int als, int *screen, int *kbd);
+
+/** Switches the sensor on or off. Control thread only. */
+void enableALS(bool enable);
+int getAmbientLightPercent();
+/** Raw illuminance value reported by the sensor */
+int readAmbientLight();
+/** Illuminance as a percentage of the range of the brightness curve */
+int ambientLightToPercent(int als);
+/**
+ * @brief getLidStatus
+ * @return 1 if opened, 0 if closed, -1 on error, -2 if unknown
+ */
+int getLidStatus();
+/** \a level: BRIGHTNESS_ONE = 100% */
+void setScreenBacklight(int level);
+void setKeyboardBacklight(int level, bool immediate = false);
+
+#endif // CONTROLLER_H
@@ -0,0 +1,199 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include "curve.h"
+
+using namespace std;
+
+curve_config_t defaultCurve()
+{
+    // The five levels reported by the Zenbook sensor, with the screen and
+    // keyboard brightness the controller has always used for them
+    static const curve_point_t points[] = {
+        { 0x32,  40, 100 },
+        { 0xC8,  60, 0 },
+        { 0x190, 75, 0 },
+        { 0x258, 90, 0 },
+        { 0x320, 100, 0 }
+    };
+
+    curve_config_t config;
+    config.points.assign(points, points + sizeof(points) / sizeof(points[0]));
+    config.perception = CURVE_LINEAR;
+    config.gamma = 2.2;
+    return config;
+}
+
+static int curveError(string *error, int line, const string &what)
+{
+    if(error != NULL) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "line %d: ", line);
+        *error = prefix + what;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/** Parses a whole integer, decimal or hexadecimal */
+static bool parseInt(const string &s, int *value)
+{
+    char *end;
+    errno = 0;
+    long v = strtol(s.c_str(), &end, 0);
+    if(s.empty() || *end != '\0' || errno != 0 || v < -CURVE_MAX_RAW || v > CURVE_MAX_RAW)
+        return false;
+    *value = (int)v;
+    return true;
+}
+
+int parseCurve(const string &text, curve_config_t *config, string *error)
+{
+    curve_config_t c;
+    c.perception = CURVE_LINEAR;
+    c.gamma = 2.2;
+
+    istringstream in(text);
+    string line;
+    for(int n = 1; getline(in, line); n++) {
+        size_t hash = line.find('#');
+        if(hash != string::npos)
+            line.erase(hash);
+
+        istringstream words(line);
+        vector<string> w;
+        string word;
+        while(words >> word)
+            w.push_back(word);
+        if(w.empty())
+            continue;
+
+        if(w[0] == "perception") {
+            if(w.size() == 2 && w[1] == "linear") {
+                c.perception = CURVE_LINEAR;
+            } else if(w.size() == 2 && w[1] == "cie") {
+                c.perception = CURVE_CIE;
+            } else if(w.size() == 3 && w[1] == "gamma") {
+                char *end;
+                c.perception = CURVE_GAMMA;
+                c.gamma = strtod(w[2].c_str(), &end);
+                if(*end != '\0' || !(c.gamma >= 0.1 && c.gamma <= 10))
+                    return curveError(error, n, "gamma must be between 0.1 and 10");
+            } else {
+                return curveError(error, n, "expected perception linear, cie or gamma <exponent>");
+            }
+            continue;
+        }
+
+        curve_point_t p;
+        if(w.size() != 3 || !parseInt(w[0], &p.raw) || !parseInt(w[1], &p.screen) ||
+                !parseInt(w[2], &p.keyboard))
+            return curveError(error, n, "expected <raw> <screen %> <keyboard %>");
+        if(p.raw < 0)
+            return curveError(error, n, "raw value out of range");
+        if(p.screen < 0 || p.screen > 100 || p.keyboard < 0 || p.keyboard > 100)
+            return curveError(error, n, "brightness must be between 0 and 100");
+        if(!c.points.empty() && p.raw <= c.points.back().raw)
+            return curveError(error, n, "raw values must be increasing");
+        c.points.push_back(p);
+    }
+
+    if(c.points.empty()) {
+        if(error != NULL)
+            *error = "no points";
+        errno = EINVAL;
+        return -1;
+    }
+
+    *config = c;
+    return 0;
+}
+
+int loadCurve(const string &path, curve_config_t *config, string *error)
+{
+    ifstream f(path.c_str());
+    if(!f) {
+        int tmp_errno = errno;
+        if(error != NULL)
+            *error = "cannot open " + path;
+        errno = tmp_errno != 0 ? tmp_errno : ENOENT;
+        return -1;
+    }
+
+    stringstream text;
+    text << f.rdbuf();
+    return parseCurve(text.str(), config, error);
+}
+
+/** Maps a screen percentage of the curve to a linear fraction of the maximum */
+static double perceived(const curve_config_t &config, double percent)
+{
+    switch(config.perception) {
+    case CURVE_CIE:
+        // Inverse of L* = 116 (Y)^(1/3) - 16, linear near black
+        if(percent > 8)
+            return pow((percent + 16) / 116, 3);
+        return percent / 903.3;
+    case CURVE_GAMMA:
+        return pow(percent / 100, config.gamma);
+    default:
+        return percent / 100;
+    }
+}
+
+curve_table_t *compileCurve(const curve_config_t &config)
+{
+    const vector<curve_point_t> &p = config.points;
+    int size = p.back().raw + 1;
+    curve_table_t *table = (curve_table_t *)malloc(sizeof(curve_table_t) + (size - 1) * sizeof(curve_entry_t));
+    if(table == NULL)
+        return NULL;
+    table->size = size;
+
+    size_t seg = 0;
+    for(int raw = 0; raw < size; raw++) {
+        while(seg + 1 < p.size() && raw > p[seg + 1].raw)
+            seg++;
+
+        double screen, keyboard;
+        if(raw <= p[0].raw || p.size() == 1) {
+            screen = p[0].screen;
+            keyboard = p[0].keyboard;
+        } else {
+            const curve_point_t &a = p[seg], &b = p[seg + 1];
+            double t = (double)(raw - a.raw) / (b.raw - a.raw);
+            screen = a.screen + t * (b.screen - a.screen);
+            keyboard = a.keyboard + t * (b.keyboard - a.keyboard);
+        }
+
+        curve_entry_t *e = &table->entries[raw];
+        e->screen = (uint16_t)lround(perceived(config, screen) * BRIGHTNESS_ONE);
+        e->keyboard = (uint16_t)lround(keyboard * BRIGHTNESS_ONE / 100);
+        e->light = (uint8_t)((long)raw * 100 / (size - 1 > 0 ? size - 1 : 1));
+    }
+    return table;
+}
+
+void freeCurve(curve_table_t *table)
+{
+    free(table);
+}
@@ -0,0 +1,86 @@
+#ifndef CURVE_H
+#define CURVE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+using namespace std;
+
+/*
+ * Brightness curve: maps the raw value of the sensor to the brightness of
+ * the screen and of the keyboard.
+ *
+ * The curve is given as a list of points, linearly interpolated in
+ * between, and compiled once into a table with an entry for every raw
+ * value, so that the control loop only does an array lookup.
+ *
+ * Brightness is expressed in fixed point: BRIGHTNESS_ONE is 100%.
+ */
+
+/** Full brightness, i.e. 1 = 0.01% */
+#define BRIGHTNESS_ONE 10000
+/** Largest raw value with an entry of its own; higher values use the last one */
+#define CURVE_MAX_RAW 65535
+
+/** How the screen percentages of the points are read */
+enum {
+    /** as a fraction of the maximum brightness */
+    CURVE_LINEAR,
+    /** as CIE 1976 lightness (L*), i.e. as perceived by the eye */
+    CURVE_CIE,
+    /** as (brightness)^(1/gamma) */
+    CURVE_GAMMA
+};
+
+typedef struct {
+    int raw;
+    /** percent, see the perception of the curve */
+    int screen;
+    /** percent, always linear */
+    int keyboard;
+} curve_point_t;
+
+typedef struct {
+    /** sorted by raw value, at least one */
+    vector<curve_point_t> points;
+    int perception;
+    double gamma;
+} curve_config_t;
+
+typedef struct {
+    /** 0 - BRIGHTNESS_ONE */
+    uint16_t screen;
+    uint16_t keyboard;
+    /** raw value as a percentage of the last point of the curve */
+    uint8_t light;
+} curve_entry_t;
+
+typedef struct {
+    /** entries, one for each raw value from 0 to size - 1 */
+    int size;
+    curve_entry_t entries[1];
+} curve_table_t;
+
+/** The curve used when there is no configuration file */
+curve_config_t defaultCurve();
+/**
+ * Parses a curve. Every line is empty, a comment starting with '#',
+ * "perception linear|cie|gamma <exponent>" or a point
+ * "<raw> <screen %> <keyboard %>"; raw values may be hexadecimal (0x32).
+ * \retval 0 if ok, -1 if the text is invalid (sets errno and \a error)
+ */
+int parseCurve(const string &text, curve_config_t *config, string *error);
+/** Reads and parses the file \a path, see parseCurve() */
+int loadCurve(const string &path, curve_config_t *config, string *error);
+/** Builds the table of \a config. \retval NULL if out of memory */
+curve_table_t *compileCurve(const curve_config_t &config);
+void freeCurve(curve_table_t *table);
+
+inline const curve_entry_t *curveLookup(const curve_table_t *table, int raw)
+{
+    unsigned int i = raw < 0 ? 0 : (unsigned int)raw;
+    unsigned int last = table->size - 1;
+    return &table->entries[i < last ? i : last];
+}
+
+#endif // CURVE_H
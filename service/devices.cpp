@@ -0,0 +1,287 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include "devices.h"
+#include "attribute.h"
+
+using namespace std;
+
+/** Multicast group of the uevents sent by the kernel (udev resends them on 2) */
+#define UEVENT_KERNEL_GROUP 1
+/** Larger than any uevent (UEVENT_BUFFER_SIZE is 2048 in the kernel) */
+#define UEVENT_MAX_LENGTH 8192
+
+/** Reads a small attribute into \a out, without the trailing newline */
+static bool readString(string path, string &out) {
+    Attribute attr;
+    char buf[64];
+    if(attr.open(path, O_RDONLY) == -1 || attr.read(buf, sizeof(buf)) == -1)
+        return false;
+    buf[strcspn(buf, "\n")] = '\0';
+    out = buf;
+    return true;
+}
+
+static bool sameDevice(const backlight_device_t &a, const backlight_device_t &b) {
+    return a.path == b.path && a.maxBrightness == b.maxBrightness;
+}
+
+/**
+ * "backlight/NAME" or "leds/NAME", where NAME is the last component of
+ * \a devpath: the entry of the device in its class directory
+ */
+static string deviceKey(const string &subsystem, const string &devpath) {
+    return subsystem + "/" + devpath.substr(devpath.rfind('/') + 1);
+}
+
+/** Adds \a name to \a names, or removes it, keeping one copy at most */
+static void setMember(vector<string> &names, const string &name, bool member) {
+    vector<string>::iterator it = find(names.begin(), names.end(), name);
+    if(member && it == names.end())
+        names.push_back(name);
+    else if(!member && it != names.end())
+        names.erase(it);
+}
+
+DeviceRegistry::DeviceRegistry()
+{
+    fd = -1;
+    uevents = false;
+    scans = 0;
+}
+
+DeviceRegistry::~DeviceRegistry()
+{
+    if(fd >= 0)
+        close(fd);
+}
+
+int DeviceRegistry::init(string backlightDir, string ledsDir, vector<string> priority, bool uevents)
+{
+    this->backlightDir = backlightDir;
+    this->ledsDir = ledsDir;
+    this->priority = priority;
+    this->uevents = uevents;
+
+    scan();
+
+    return uevents ? openUevents() : openInotify();
+}
+
+int DeviceRegistry::openUevents()
+{
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if(fd == -1)
+        return -1;
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = UEVENT_KERNEL_GROUP;
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int DeviceRegistry::openInotify()
+{
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd == -1)
+        return -1;
+
+    // Class directories only contain symlinks to the devices
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+    if(inotify_add_watch(fd, backlightDir.c_str(), mask) == -1 ||
+            inotify_add_watch(fd, ledsDir.c_str(), mask) == -1) {
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+bool DeviceRegistry::onEvent()
+{
+    bool any = false;
+    if(uevents) {
+        any = readUevents();
+    } else {
+        char buf[4096];
+        while(read(fd, buf, sizeof(buf)) > 0)
+            any = true;
+    }
+    return any && scan();
+}
+
+bool DeviceRegistry::onUevent(const char *buf, size_t len)
+{
+    return parseUevent(buf, len) && scan();
+}
+
+/** Consumes the pending uevents. Returns true if one of them is about our devices. */
+bool DeviceRegistry::readUevents()
+{
+    char buf[UEVENT_MAX_LENGTH];
+    bool any = false;
+    while(1) {
+        struct sockaddr_nl from;
+        socklen_t length = sizeof(from);
+        ssize_t n = recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&from, &length);
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            // Some uevents were dropped: one of them may have been ours
+            if(errno == ENOBUFS) {
+                any = true;
+                continue;
+            }
+            return any;
+        }
+        // Only the kernel speaks for the devices
+        if(from.nl_pid != 0)
+            continue;
+        buf[n] = '\0';
+        if(parseUevent(buf, n))
+            any = true;
+    }
+}
+
+/**
+ * A uevent is "ACTION@DEVPATH" followed by KEY=VALUE strings, each one
+ * NUL-terminated. Returns true if it adds or removes a backlight or a LED.
+ * sysfs may still show a device for a while after its "remove": the uevent
+ * itself is what tells that it's gone.
+ */
+bool DeviceRegistry::parseUevent(const char *buf, size_t len)
+{
+    string action, subsystem, devpath, oldDevpath;
+    for(size_t i = strlen(buf) + 1; i < len; i += strlen(buf + i) + 1) {
+        if(strncmp(buf + i, "ACTION=", 7) == 0)
+            action = buf + i + 7;
+        else if(strncmp(buf + i, "SUBSYSTEM=", 10) == 0)
+            subsystem = buf + i + 10;
+        else if(strncmp(buf + i, "DEVPATH=", 8) == 0)
+            devpath = buf + i + 8;
+        else if(strncmp(buf + i, "DEVPATH_OLD=", 12) == 0)
+            oldDevpath = buf + i + 12;
+    }
+    if(subsystem != "backlight" && subsystem != "leds")
+        return false;
+
+    // "change" is sent for every brightness change by some drivers
+    if(action == "add") {
+        setMember(removed, deviceKey(subsystem, devpath), false);
+    } else if(action == "remove") {
+        setMember(removed, deviceKey(subsystem, devpath), true);
+    } else if(action == "move") {
+        setMember(removed, deviceKey(subsystem, oldDevpath), true);
+        setMember(removed, deviceKey(subsystem, devpath), false);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool DeviceRegistry::scan()
+{
+    scans++;
+
+    backlight_device_t bestScreen;
+    bestScreen.maxBrightness = 0;
+    int bestRank = -1;
+
+    vector<backlight_device_t> screens = list(backlightDir, false);
+    for(size_t i = 0; i < screens.size(); i++) {
+        int r = rank(screens[i]);
+        if(bestRank == -1 || r < bestRank) {
+            bestRank = r;
+            bestScreen = screens[i];
+        }
+    }
+
+    backlight_device_t bestKeyboard;
+    bestKeyboard.maxBrightness = 0;
+    vector<backlight_device_t> leds = list(ledsDir, true);
+    for(size_t i = 0; i < leds.size(); i++) {
+        if(leds[i].name.find("kbd_backlight") != string::npos &&
+                (bestKeyboard.path.empty() || leds[i].name < bestKeyboard.name)) {
+            bestKeyboard = leds[i];
+        }
+    }
+
+    bool changed = !sameDevice(screen, bestScreen) || !sameDevice(keyboard, bestKeyboard);
+    screen = bestScreen;
+    keyboard = bestKeyboard;
+    return changed;
+}
+
+vector<backlight_device_t> DeviceRegistry::list(string dir, bool isLed)
+{
+    vector<backlight_device_t> devices;
+
+    DIR *d = opendir(dir.c_str());
+    if(d == NULL)
+        return devices;
+
+    struct dirent *entry;
+    while((entry = readdir(d)) != NULL) {
+        if(entry->d_name[0] == '.')
+            continue;
+        string key = deviceKey(isLed ? "leds" : "backlight", entry->d_name);
+        if(find(removed.begin(), removed.end(), key) != removed.end())
+            continue;
+
+        backlight_device_t dev;
+        dev.name = entry->d_name;
+        dev.path = dir + "/" + dev.name + "/";
+
+        string max;
+        if(!readString(dev.path + "max_brightness", max))
+            continue;
+        dev.maxBrightness = atoi(max.c_str());
+        if(dev.maxBrightness <= 0)
+            continue;
+        if(!isLed)
+            readString(dev.path + "type", dev.type);
+
+        devices.push_back(dev);
+    }
+
+    closedir(d);
+    return devices;
+}
+
+/** Position of the device in the priority list; unlisted devices come last */
+int DeviceRegistry::rank(const backlight_device_t &dev)
+{
+    for(size_t i = 0; i < priority.size(); i++) {
+        if(priority[i] == dev.name || priority[i] == dev.type)
+            return (int)i;
+    }
+    return (int)priority.size();
+}
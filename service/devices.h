@@ -0,0 +1,93 @@
+#ifndef DEVICES_H
+#define DEVICES_H
+
+#include <string>
+#include <vector>
+using namespace std;
+
+/** A backlight (or LED) device found under /sys/class */
+typedef struct {
+    /** directory name, e.g. "intel_backlight" */
+    string name;
+    /** full path of the device directory, with the trailing '/' */
+    string path;
+    /** "firmware", "platform" or "raw" for backlights, empty for LEDs */
+    string type;
+    int maxBrightness;
+} backlight_device_t;
+
+/**
+ * Finds the screen and keyboard backlight devices and caches what the
+ * control loop needs to know about them.
+ *
+ * Devices are enumerated once by scan(). After that the kernel tells us
+ * through uevents (NETLINK_KOBJECT_UEVENT) when a backlight or a LED is
+ * added or removed. sysfs never reports such changes to inotify, but a
+ * fake tree does, and nobody sends uevents for it: there the class
+ * directories are watched with inotify instead. Either way the owner polls
+ * getFd() for POLLIN and calls onEvent(), which rescans only if something
+ * has been added or removed.
+ */
+class DeviceRegistry
+{
+public:
+    DeviceRegistry();
+    ~DeviceRegistry();
+
+    /**
+     * \param backlightDir  usually /sys/class/backlight
+     * \param ledsDir       usually /sys/class/leds
+     * \param priority      screen devices in order of preference; each entry
+     *                      matches either a device name or its type
+     * \param uevents       follow the kernel's uevents, rather than watching
+     *                      the directories with inotify (fake tree)
+     * \retval 0 if ok, -1 if the devices can't be followed (sets errno).
+     *         Devices are scanned anyway.
+     */
+    int init(string backlightDir, string ledsDir, vector<string> priority, bool uevents);
+
+    /** Enumerates the devices again. Returns true if the selection changed. */
+    bool scan();
+
+    int getFd() const { return fd; }
+    /** Must be called when getFd() is readable. Returns true if the selection changed. */
+    bool onEvent();
+    /** Handles one uevent of \a len bytes, as onEvent() does with those it
+     *  reads. Returns true if the selection changed. */
+    bool onUevent(const char *buf, size_t len);
+
+    bool hasScreen() const { return !screen.path.empty(); }
+    bool hasKeyboard() const { return !keyboard.path.empty(); }
+    const backlight_device_t &getScreen() const { return screen; }
+    const backlight_device_t &getKeyboard() const { return keyboard; }
+
+    /** Number of times the devices have been enumerated */
+    unsigned long getScanCount() const { return scans; }
+
+private:
+    DeviceRegistry(const DeviceRegistry &);
+    DeviceRegistry &operator=(const DeviceRegistry &);
+
+    string backlightDir;
+    string ledsDir;
+    vector<string> priority;
+    /** netlink socket if uevents, inotify instance otherwise */
+    int fd;
+    bool uevents;
+    unsigned long scans;
+    /** devices whose "remove" uevent has come ("backlight/NAME" or
+     *  "leds/NAME"), skipped by scan() until added again */
+    vector<string> removed;
+
+    backlight_device_t screen;
+    backlight_device_t keyboard;
+
+    int openUevents();
+    int openInotify();
+    bool readUevents();
+    bool parseUevent(const char *buf, size_t len);
+    vector<backlight_device_t> list(string dir, bool isLed);
+    int rank(const backlight_device_t &dev);
+};
+
+#endif // DEVICES_H
@@ -0,0 +1,58 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdint.h>
+#include <string.h>
+#include "comsock.h"
+
+/*
+ * State change events streamed to the clients that sent MSG_SUBSCRIBE.
+ * Each MSG_EVENT carries one event: 1 byte for the kind followed by the
+ * value as a little-endian 32 bit integer.
+ *
+ * Events describe state, not history: when a subscriber can't keep up,
+ * only the latest value of each kind is kept for it.
+ */
+
+/** enabled (1) or disabled (0) */
+#define EVENT_ENABLED   0
+/** raw value read from the ambient light sensor */
+#define EVENT_LUX       1
+/** lid open (1), closed (0), or the error codes of getLidStatus() */
+#define EVENT_LID       2
+/** raw brightness written to the screen backlight */
+#define EVENT_SCREEN    3
+/** raw brightness written to the keyboard backlight */
+#define EVENT_KEYBOARD  4
+#define EVENT_KINDS     5
+
+#define EVENT_PAYLOAD_LEN 5
+
+static inline void packEvent(int kind, int32_t value, char *buf) {
+    uint32_t v = (uint32_t)value;
+    buf[0] = (char)kind;
+    buf[1] = (char)(v & 0xFF);
+    buf[2] = (char)((v >> 8) & 0xFF);
+    buf[3] = (char)((v >> 16) & 0xFF);
+    buf[4] = (char)((v >> 24) & 0xFF);
+}
+
+/** \retval 0 if ok, -1 if \a msg is not a valid event */
+static inline int unpackEvent(const message_t *msg, int *kind, int32_t *value) {
+    if(msg->type != MSG_EVENT || msg->length != EVENT_PAYLOAD_LEN)
+        return -1;
+    const unsigned char *b = (const unsigned char *)msg->buffer;
+    if(b[0] >= EVENT_KINDS)
+        return -1;
+    *kind = b[0];
+    *value = (int32_t)((uint32_t)b[1] | ((uint32_t)b[2] << 8) |
+                       ((uint32_t)b[3] << 16) | ((uint32_t)b[4] << 24));
+    return 0;
+}
+
+static inline const char *eventName(int kind) {
+    static const char *names[EVENT_KINDS] = { "enabled", "lux", "lid", "screen", "keyboard" };
+    return kind >= 0 && kind < EVENT_KINDS ? names[kind] : "unknown";
+}
+
+#endif // EVENTS_H
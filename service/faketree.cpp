@@ -0,0 +1,172 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <linux/input.h>
+#include "faketree.h"
+
+using namespace std;
+
+const string FAKE_ALS_DIR = "/sys/bus/acpi/devices/ACPI0008:00/";
+const string FAKE_LID_DIR = "/proc/acpi/button/lid/LID/";
+const string FAKE_SCREEN_DIR = "/sys/class/backlight/intel_backlight/";
+const string FAKE_KBD_DIR = "/sys/class/leds/asus::kbd_backlight/";
+const string FAKE_RUN_DIR = "/var/run/";
+const string FAKE_INPUT_DIR = "/sys/class/input/event0/";
+const string FAKE_INPUT_DEV = "/dev/input/event0";
+const string FAKE_IIO_DIR = "/sys/bus/iio/devices/iio:device0/";
+const string FAKE_IIO_DEV = "/dev/iio:device0";
+
+static bool g_fakeIio = false;
+
+const int FAKE_SCREEN_MAX = 1000;
+const int FAKE_KBD_MAX = 3;
+
+static void makeDirs(string path) {
+    for(size_t pos = 1; pos != string::npos; pos = path.find('/', pos + 1)) {
+        string dir = path.substr(0, pos);
+        if(mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+            err(EXIT_FAILURE, "mkdir %s", dir.c_str());
+    }
+}
+
+static string intToString(int value) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", value);
+    return buf;
+}
+
+void writeFakeFile(string path, string data) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0666);
+    if(fd == -1)
+        err(EXIT_FAILURE, "%s", path.c_str());
+    if(pwrite(fd, data.c_str(), data.length(), 0) != (ssize_t)data.length())
+        err(EXIT_FAILURE, "%s", path.c_str());
+    if(ftruncate(fd, data.length()) == -1)
+        err(EXIT_FAILURE, "%s", path.c_str());
+    close(fd);
+}
+
+/** Fixed width, so the daemon never reads a partially written value */
+void setFakeAli(string root, int value) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%10d\n", value);
+    writeFakeFile(root + FAKE_ALS_DIR + "ali", buf);
+}
+
+void setFakeIio(string root, int value) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%10d\n", value);
+    writeFakeFile(root + FAKE_IIO_DIR + "in_illuminance_raw", buf);
+
+    // One sample, as described by in_illuminance_type
+    if(value < 0)
+        value = 0;
+    if(value > 0xFFFF)
+        value = 0xFFFF;
+    unsigned char sample[2] = { (unsigned char)(value & 0xFF), (unsigned char)(value >> 8) };
+    int fd = ::open((root + FAKE_IIO_DEV).c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if(fd == -1)
+        return;
+    if(write(fd, sample, sizeof(sample)) != (ssize_t)sizeof(sample))
+        warn("%s", (root + FAKE_IIO_DEV).c_str());
+    close(fd);
+}
+
+void setFakeLight(string root, int value) {
+    if(g_fakeIio)
+        setFakeIio(root, value);
+    else
+        setFakeAli(root, value);
+}
+
+void setFakeLid(string root, bool open) {
+    writeFakeFile(root + FAKE_LID_DIR + "state", open ? "state:      open  \n" : "state:      closed\n");
+
+    // Nobody listening (ENXIO) is fine: the daemon reads procfs then
+    int fd = ::open((root + FAKE_INPUT_DEV).c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if(fd == -1)
+        return;
+    struct input_event ev[2];
+    memset(ev, 0, sizeof(ev));
+    gettimeofday(&ev[0].time, NULL);
+    ev[0].type = EV_SW;
+    ev[0].code = SW_LID;
+    ev[0].value = open ? 0 : 1;
+    ev[1].time = ev[0].time;
+    ev[1].type = EV_SYN;
+    ev[1].code = SYN_REPORT;
+    if(write(fd, ev, sizeof(ev)) != (ssize_t)sizeof(ev))
+        warn("%s", (root + FAKE_INPUT_DEV).c_str());
+    close(fd);
+}
+
+static void createFakeIio(string root) {
+    string dir = root + FAKE_IIO_DIR;
+    makeDirs(dir + "scan_elements/");
+    makeDirs(dir + "buffer/");
+    writeFakeFile(dir + "name", "fake-als\n");
+    writeFakeFile(dir + "in_illuminance_scale", "1.000000\n");
+    writeFakeFile(dir + "scan_elements/in_illuminance_en", "0\n");
+    writeFakeFile(dir + "scan_elements/in_illuminance_index", "0\n");
+    writeFakeFile(dir + "scan_elements/in_illuminance_type", "le:u16/16>>0\n");
+    // Enabled, so that the daemon has to turn it off
+    writeFakeFile(dir + "scan_elements/in_timestamp_en", "1\n");
+    writeFakeFile(dir + "scan_elements/in_timestamp_index", "1\n");
+    writeFakeFile(dir + "scan_elements/in_timestamp_type", "le:s64/64>>0\n");
+    writeFakeFile(dir + "buffer/length", "2\n");
+    writeFakeFile(dir + "buffer/watermark", "1\n");
+    writeFakeFile(dir + "buffer/enable", "0\n");
+    if(mkfifo((root + FAKE_IIO_DEV).c_str(), 0666) == -1 && errno != EEXIST)
+        err(EXIT_FAILURE, "mkfifo %s", (root + FAKE_IIO_DEV).c_str());
+    setFakeIio(root, 0x190);
+}
+
+void createFakeTree(string root, bool iio) {
+    g_fakeIio = iio;
+    if(iio) {
+        makeDirs(root + FAKE_IIO_DEV);
+        createFakeIio(root);
+    } else {
+        makeDirs(root + FAKE_ALS_DIR);
+        writeFakeFile(root + FAKE_ALS_DIR + "enable", "0");
+        setFakeAli(root, 0x190);
+    }
+    makeDirs(root + FAKE_LID_DIR);
+    makeDirs(root + FAKE_SCREEN_DIR);
+    makeDirs(root + FAKE_KBD_DIR);
+    makeDirs(root + FAKE_RUN_DIR);
+    makeDirs(root + FAKE_INPUT_DIR + "device/capabilities/");
+    makeDirs(root + FAKE_INPUT_DEV);
+
+    writeFakeFile(root + FAKE_INPUT_DIR + "device/name", "Lid Switch\n");
+    writeFakeFile(root + FAKE_INPUT_DIR + "device/capabilities/sw", "1\n");
+    if(mkfifo((root + FAKE_INPUT_DEV).c_str(), 0666) == -1 && errno != EEXIST)
+        err(EXIT_FAILURE, "mkfifo %s", (root + FAKE_INPUT_DEV).c_str());
+    writeFakeFile(root + FAKE_SCREEN_DIR + "type", "raw\n");
+    writeFakeFile(root + FAKE_SCREEN_DIR + "max_brightness", intToString(FAKE_SCREEN_MAX) + "\n");
+    writeFakeFile(root + FAKE_SCREEN_DIR + "brightness", intToString(FAKE_SCREEN_MAX / 2) + "\n");
+    writeFakeFile(root + FAKE_KBD_DIR + "max_brightness", intToString(FAKE_KBD_MAX) + "\n");
+    writeFakeFile(root + FAKE_KBD_DIR + "brightness", "0\n");
+    setFakeLid(root, true);
+}
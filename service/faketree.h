@@ -0,0 +1,45 @@
+#ifndef FAKETREE_H
+#define FAKETREE_H
+
+#include <string>
+using namespace std;
+
+/*
+ * A fake sysfs/procfs tree with the devices als-controller expects on a
+ * Zenbook, for als-controller --root. Shared by the simulator and the
+ * benchmark.
+ *
+ * The light sensor is either the ACPI0008 device or an IIO device whose
+ * character device is a FIFO: writing to it is what the kernel does when
+ * the buffer is enabled.
+ */
+
+extern const string FAKE_ALS_DIR;
+extern const string FAKE_LID_DIR;
+extern const string FAKE_SCREEN_DIR;
+extern const string FAKE_KBD_DIR;
+extern const string FAKE_RUN_DIR;
+/** Lid switch: its capabilities, and a FIFO standing for the event device */
+extern const string FAKE_INPUT_DIR;
+extern const string FAKE_INPUT_DEV;
+extern const string FAKE_IIO_DIR;
+extern const string FAKE_IIO_DEV;
+
+extern const int FAKE_SCREEN_MAX;
+extern const int FAKE_KBD_MAX;
+
+/** Creates the tree under \a root, with an IIO sensor if \a iio. Exits on error. */
+void createFakeTree(string root, bool iio = false);
+/** Sets the raw value returned by the ali attribute. */
+void setFakeAli(string root, int value);
+/** Sets in_illuminance_raw, and streams it if the daemon reads the buffer. */
+void setFakeIio(string root, int value);
+/** setFakeAli() or setFakeIio(), for the sensor of the last tree created */
+void setFakeLight(string root, int value);
+/** Updates procfs and sends a SW_LID event to whoever reads the event device */
+void setFakeLid(string root, bool open);
+/** Overwrites the file in place, so that descriptors and inotify watches
+ *  held by the daemon keep pointing to it. Exits on error. */
+void writeFakeFile(string path, string data);
+
+#endif // FAKETREE_H
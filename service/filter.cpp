@@ -0,0 +1,128 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <stdlib.h>
+#include "filter.h"
+
+LightFilter::LightFilter()
+{
+    filter_config_t defaults = { 3, 25, 10, 2, 5000, 250 };
+    init(defaults);
+}
+
+void LightFilter::init(const filter_config_t &config)
+{
+    this->config = config;
+    if(this->config.medianWindow < 1)
+        this->config.medianWindow = 1;
+    if(this->config.medianWindow > FILTER_MAX_WINDOW)
+        this->config.medianWindow = FILTER_MAX_WINDOW;
+    if(this->config.medianWindow % 2 == 0)
+        this->config.medianWindow--;
+    if(this->config.emaWeight < 1 || this->config.emaWeight > 100)
+        this->config.emaWeight = 100;
+    if(this->config.settleIntervalMs < 1)
+        this->config.settleIntervalMs = 1;
+
+    windowPos = 0;
+    primed = false;
+    ema = 0;
+    input = applied = 0;
+    appliedAtMs = 0;
+    direction = 0;
+    held = false;
+    samples = appliedCount = suppressedHysteresis = suppressedDwell = 0;
+}
+
+int LightFilter::band() const
+{
+    int b = applied * config.hysteresisPercent / 100;
+    return b > config.hysteresisMin ? b : config.hysteresisMin;
+}
+
+int LightFilter::update(int raw, long long nowMs)
+{
+    __sync_fetch_and_add(&samples, 1);
+
+    // The first sample is taken as it is: there is nothing to smooth yet
+    if(!primed) {
+        for(int i = 0; i < config.medianWindow; i++)
+            window[i] = raw;
+        ema = (int64_t)raw << 8;
+        input = applied = raw;
+        appliedAtMs = nowMs;
+        primed = true;
+        return applied;
+    }
+
+    input = raw;
+    window[windowPos] = raw;
+    windowPos = (windowPos + 1) % config.medianWindow;
+    int sorted[FILTER_MAX_WINDOW];
+    for(int i = 0; i < config.medianWindow; i++) {
+        int v = window[i], j = i;
+        for(; j > 0 && sorted[j - 1] > v; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = v;
+    }
+    int median = sorted[config.medianWindow / 2];
+
+    ema += (((int64_t)median << 8) - ema) * config.emaWeight / 100;
+    int filtered = (int)((ema + 128) >> 8);
+
+    held = false;
+    if(abs(filtered - applied) <= band()) {
+        if(filtered != applied)
+            __sync_fetch_and_add(&suppressedHysteresis, 1);
+        return applied;
+    }
+
+    int dir = filtered > applied ? 1 : -1;
+    if(dir == -direction && nowMs - appliedAtMs < config.dwellMs) {
+        __sync_fetch_and_add(&suppressedDwell, 1);
+        held = true;
+        return applied;
+    }
+
+    applied = filtered;
+    appliedAtMs = nowMs;
+    direction = dir;
+    __sync_fetch_and_add(&appliedCount, 1);
+    return applied;
+}
+
+int LightFilter::nextSampleMs(long long nowMs) const
+{
+    // A single sample away from the output must be confirmed by the next
+    // ones (median), which a sensor notifying only changes wouldn't send
+    if(!primed || abs(input - applied) <= band())
+        return -1;
+    if(held) {
+        long long left = appliedAtMs + config.dwellMs - nowMs;
+        return left > 0 ? (int)left : 0;
+    }
+    // The median or the average are still moving towards the input
+    return config.settleIntervalMs;
+}
+
+filter_stats_t LightFilter::getStats() const
+{
+    filter_stats_t stats;
+    stats.samples = __atomic_load_n(&samples, __ATOMIC_RELAXED);
+    stats.applied = __atomic_load_n(&appliedCount, __ATOMIC_RELAXED);
+    stats.suppressedHysteresis = __atomic_load_n(&suppressedHysteresis, __ATOMIC_RELAXED);
+    stats.suppressedDwell = __atomic_load_n(&suppressedDwell, __ATOMIC_RELAXED);
+    return stats;
+}
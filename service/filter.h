@@ -0,0 +1,86 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+
+/** Longest median window */
+#define FILTER_MAX_WINDOW 9
+
+/** Parameters of a LightFilter */
+typedef struct {
+    /** samples the median is taken over (odd), 1 disables it */
+    int medianWindow;
+    /** weight of a new sample in the moving average (percent), 100 disables it */
+    int emaWeight;
+    /** the filtered value must move farther than this from the applied one
+     *  (percent of the applied one)... */
+    int hysteresisPercent;
+    /** ...and farther than this (raw units) */
+    int hysteresisMin;
+    /** a change in the opposite direction of the previous one is held
+     *  until the previous one has lasted this long (ms) */
+    int dwellMs;
+    /** interval between samples while the output hasn't caught up with
+     *  the input (ms) */
+    int settleIntervalMs;
+} filter_config_t;
+
+/** Counters collected by a LightFilter */
+typedef struct {
+    uint64_t samples;
+    /** changes let through */
+    uint64_t applied;
+    /** samples that differed from the applied value, but within the band */
+    uint64_t suppressedHysteresis;
+    /** changes held because they reversed a recent one */
+    uint64_t suppressedDwell;
+} filter_stats_t;
+
+/**
+ * Smooths the raw sensor readings before they reach the brightness curve,
+ * so that a sensor sitting near the boundary between two levels doesn't
+ * make the backlight flap between them. A sample goes through a median
+ * (drops spikes), then an exponential moving average (smooths noise, in
+ * fixed point), then a hysteresis band around the value last applied,
+ * and finally the dwell time, which rate-limits reversals.
+ */
+class LightFilter
+{
+public:
+    LightFilter();
+
+    void init(const filter_config_t &config);
+
+    /**
+     * Feeds a raw sample taken at \a nowMs (monotonic).
+     * @return the raw value the brightness should be decided on
+     */
+    int update(int raw, long long nowMs);
+    /** Milliseconds before the filter needs another sample, -1 if it's settled */
+    int nextSampleMs(long long nowMs) const;
+
+    filter_stats_t getStats() const;
+
+private:
+    filter_config_t config;
+    int window[FILTER_MAX_WINDOW];
+    int windowPos;
+    bool primed;
+    /** moving average, raw << 8 */
+    int64_t ema;
+    /** last sample, before any filtering */
+    int input;
+    int applied;
+    long long appliedAtMs;
+    /** direction of the last applied change: -1, 0 or 1 */
+    int direction;
+    bool held;
+    uint64_t samples;
+    uint64_t appliedCount;
+    uint64_t suppressedHysteresis;
+    uint64_t suppressedDwell;
+
+    int band() const;
+};
+
+#endif // FILTER_H
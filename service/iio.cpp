@@ -0,0 +1,344 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include "iio.h"
+
+using namespace std;
+
+/** Illuminance channels, in order of preference */
+static const char *CHANNELS[] = { "in_illuminance", "in_illuminance0" };
+
+static bool readAttribute(const string &path, string *out)
+{
+    Attribute a;
+    char buf[256];
+    if(a.open(path, O_RDONLY) == -1 || a.read(buf, sizeof(buf)) == -1)
+        return false;
+    buf[strcspn(buf, "\n")] = '\0';
+    *out = buf;
+    return true;
+}
+
+static int writeAttribute(const string &path, const string &data)
+{
+    Attribute a;
+    if(a.open(path, O_WRONLY) == -1 || a.write(data.c_str(), data.size()) == -1)
+        return -1;
+    return 0;
+}
+
+static double readDouble(const string &path, double fallback)
+{
+    string s;
+    return readAttribute(path, &s) ? strtod(s.c_str(), NULL) : fallback;
+}
+
+/** Entries of \a dir starting with \a prefix, sorted */
+static vector<string> listEntries(const string &dir, const char *prefix)
+{
+    vector<string> names;
+    DIR *d = opendir(dir.c_str());
+    if(d == NULL)
+        return names;
+    struct dirent *entry;
+    while((entry = readdir(d)) != NULL) {
+        if(strncmp(entry->d_name, prefix, strlen(prefix)) == 0)
+            names.push_back(entry->d_name);
+    }
+    closedir(d);
+    sort(names.begin(), names.end());
+    return names;
+}
+
+static string intToString(int value)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", value);
+    return buf;
+}
+
+IioSensor::IioSensor()
+{
+    processed = false;
+    scale = 1;
+    offset = 0;
+    fd = -1;
+    buffered = false;
+    enabled = false;
+    bigEndian = isSigned = false;
+    bits = storageBytes = shift = 0;
+    partialLength = 0;
+    last = lastRead = 0;
+    haveSample = false;
+    samples = reads = 0;
+}
+
+IioSensor::~IioSensor()
+{
+    if(buffered)
+        writeAttribute(dir + "/buffer/enable", "0");
+    if(fd != -1)
+        close(fd);
+}
+
+int IioSensor::open(const string &devicesDir, const string &devDir)
+{
+    vector<string> names = listEntries(devicesDir, "iio:device");
+    for(size_t i = 0; i < names.size(); i++) {
+        if(openDevice(devicesDir, names[i], devDir) == 0)
+            return 0;
+    }
+    errno = ENODEV;
+    return -1;
+}
+
+int IioSensor::openDevice(const string &devicesDir, const string &name, const string &devDir)
+{
+    dir = devicesDir + "/" + name;
+    channel.clear();
+    for(size_t i = 0; i < sizeof(CHANNELS) / sizeof(CHANNELS[0]) && channel.empty(); i++) {
+        string c = dir + "/" + CHANNELS[i];
+        if(access((c + "_input").c_str(), R_OK) == 0) {
+            processed = true;
+            channel = CHANNELS[i];
+        } else if(access((c + "_raw").c_str(), R_OK) == 0) {
+            processed = false;
+            channel = CHANNELS[i];
+        }
+    }
+    if(channel.empty())
+        return -1;
+
+    string base = dir + "/" + channel;
+    if(value.open(base + (processed ? "_input" : "_raw"), O_RDONLY) == -1)
+        return -1;
+    scale = readDouble(base + "_scale", 1);
+    offset = readDouble(base + "_offset", 0);
+
+    dev = devDir + "/" + name;
+    buffered = setupBuffer(devicesDir) == 0;
+    if(!buffered && fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+    return 0;
+}
+
+int IioSensor::setupBuffer(const string &devicesDir)
+{
+    string scan = dir + "/scan_elements/";
+    string type;
+    if(!readAttribute(scan + channel + "_type", &type))
+        return -1;
+
+    // e.g. "le:u16/16>>0": endianness, sign, bits/storage bits >> shift
+    char endian, sign;
+    unsigned int b, s, sh;
+    if(sscanf(type.c_str(), "%ce:%c%u/%u>>%u", &endian, &sign, &b, &s, &sh) != 5 ||
+            s == 0 || s > 64 || s % 8 != 0 || b == 0 || b + sh > s) {
+        errno = EINVAL;
+        return -1;
+    }
+    bigEndian = endian == 'b';
+    isSigned = sign == 's';
+    bits = b;
+    storageBytes = s / 8;
+    shift = sh;
+
+    // The scan can only be changed while the buffer is off. With our
+    // channel alone in it, a sample is just our value, with no padding.
+    writeAttribute(dir + "/buffer/enable", "0");
+    vector<string> elements = listEntries(scan, "in_");
+    for(size_t i = 0; i < elements.size(); i++) {
+        const string &e = elements[i];
+        if(e.size() > 3 && e.compare(e.size() - 3, 3, "_en") == 0 && e != channel + "_en")
+            writeAttribute(scan + e, "0");
+    }
+    if(writeAttribute(scan + channel + "_en", "1") == -1)
+        return -1;
+    writeAttribute(dir + "/buffer/length", intToString(IIO_BUFFER_LENGTH));
+    // Not there before Linux 4.2: then every sample wakes us up
+    writeAttribute(dir + "/buffer/watermark", intToString(IIO_WATERMARK));
+
+    // Samples are pushed by a trigger: use the device's own if none is set
+    string trigger, name;
+    if(readAttribute(dir + "/trigger/current_trigger", &trigger) && trigger.empty() &&
+            readAttribute(dir + "/name", &name)) {
+        vector<string> triggers = listEntries(devicesDir, "trigger");
+        for(size_t i = 0; i < triggers.size(); i++) {
+            string t;
+            if(readAttribute(devicesDir + "/" + triggers[i] + "/name", &t) && t.compare(0, name.size(), name) == 0) {
+                writeAttribute(dir + "/trigger/current_trigger", t);
+                break;
+            }
+        }
+    }
+
+    return reopen();
+}
+
+int IioSensor::reopen()
+{
+    if(fd != -1)
+        close(fd);
+    partialLength = 0;
+    fd = ::open(dev.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    // A FIFO standing for the device (fake tree) reads EOF and polls
+    // POLLHUP whenever no writer holds it: be a writer ourselves
+    struct stat st;
+    if(fd != -1 && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        close(fd);
+        fd = ::open(dev.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    }
+    return fd == -1 ? -1 : 0;
+}
+
+int IioSensor::enable(bool enable)
+{
+    if(!buffered) {
+        enabled = enable;
+        return 0;
+    }
+    if(!enable) {
+        enabled = false;
+        drain();
+        return writeAttribute(dir + "/buffer/enable", "0");
+    }
+
+    // What was queued before belongs to another time. Many drivers refuse
+    // direct reads while the buffer is on (EBUSY): the value to start from
+    // is read now, and kept until the first sample is streamed.
+    drain();
+    haveSample = false;
+    int v;
+    if(readValue(&v) == 0)
+        last = v;
+    enabled = true;
+    return writeAttribute(dir + "/buffer/enable", "1");
+}
+
+int IioSensor::decode(const unsigned char *p) const
+{
+    uint64_t v = 0;
+    for(int i = 0; i < storageBytes; i++) {
+        if(bigEndian)
+            v = (v << 8) | p[i];
+        else
+            v |= (uint64_t)p[i] << (8 * i);
+    }
+    v >>= shift;
+    if(bits < 64)
+        v &= (1ULL << bits) - 1;
+
+    int64_t x = (int64_t)v;
+    if(isSigned && bits < 64 && (v >> (bits - 1)) & 1)
+        x = (int64_t)(v | ~((1ULL << bits) - 1));
+
+    double lux = (x + offset) * scale;
+    if(lux < 0)
+        return 0;
+    return lux > INT_MAX ? INT_MAX : (int)lround(lux);
+}
+
+void IioSensor::drain()
+{
+    unsigned char buf[IIO_BUFFER_LENGTH * 8 + sizeof(partial)];
+    while(fd != -1) {
+        memcpy(buf, partial, partialLength);
+        size_t room = sizeof(buf) - partialLength;
+        ssize_t n = ::read(fd, buf + partialLength, room);
+        if(n == 0)
+            return;
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+        reads++;
+
+        size_t total = partialLength + n;
+        size_t count = total / storageBytes;
+        if(count > 0) {
+            last = decode(buf + (count - 1) * storageBytes);
+            haveSample = true;
+            samples += count;
+        }
+        partialLength = total - count * storageBytes;
+        memcpy(partial, buf + count * storageBytes, partialLength);
+
+        // A short read emptied the queue: don't pay for an EAGAIN
+        if((size_t)n < room)
+            return;
+    }
+}
+
+int IioSensor::read(int *v)
+{
+    // sysfs is never read while the buffer is on: no new sample means the
+    // light hasn't changed
+    if(buffered && enabled) {
+        drain();
+        *v = lastRead = last;
+        return 0;
+    }
+
+    if(readValue(v) == -1)
+        return -1;
+    lastRead = *v;
+    return 0;
+}
+
+/** Reads the sysfs value, converted to lux */
+int IioSensor::readValue(int *v)
+{
+    char buf[64];
+    if(value.read(buf, sizeof(buf)) == -1)
+        return -1;
+    double x = strtod(buf, NULL);
+    *v = (int)lround(processed ? x : (x + offset) * scale);
+    return 0;
+}
+
+int IioSensor::getPollFds(struct pollfd *fds)
+{
+    if(!buffered || !enabled || fd == -1)
+        return 0;
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    return 1;
+}
+
+bool IioSensor::onPoll(const struct pollfd *fds, int nfds)
+{
+    if(nfds < 1 || fds[0].revents == 0)
+        return false;
+    drain();
+    return haveSample && last != lastRead;
+}
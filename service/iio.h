@@ -0,0 +1,92 @@
+#ifndef IIO_H
+#define IIO_H
+
+#include <string>
+#include "sensor.h"
+#include "attribute.h"
+using namespace std;
+
+/** Samples the kernel keeps for us (buffer/length) */
+#define IIO_BUFFER_LENGTH 64
+/** Samples that make the device readable (buffer/watermark): a few, so
+ *  that a fast sensor wakes us up in batches */
+#define IIO_WATERMARK 4
+
+/**
+ * A light sensor of the IIO subsystem (in_illuminance_input or _raw).
+ *
+ * If the device supports buffers, the illuminance channel is the only one
+ * enabled in scan_elements and its samples are streamed through the
+ * character device: every wakeup reads whatever has been queued with a
+ * single read() and keeps the latest sample. The sysfs value is only read
+ * before the buffer is enabled, since drivers may refuse it afterwards.
+ * Without a buffer the sysfs value is read at every sample, and no
+ * notification is available.
+ */
+class IioSensor : public LightSensor
+{
+public:
+    IioSensor();
+    ~IioSensor();
+
+    /**
+     * Opens the first light sensor found.
+     * \param devicesDir usually /sys/bus/iio/devices
+     * \param devDir     where the character devices are, usually /dev
+     */
+    int open(const string &devicesDir, const string &devDir);
+
+    const char *getType() const { return "iio"; }
+    string getPath() const { return dir; }
+    int enable(bool enable);
+    int read(int *value);
+    int getPollFds(struct pollfd *fds);
+    bool onPoll(const struct pollfd *fds, int nfds);
+
+    bool isBuffered() const { return buffered; }
+    /** Samples received through the buffer, and read() calls it took */
+    unsigned long getSampleCount() const { return samples; }
+    unsigned long getReadCount() const { return reads; }
+
+private:
+    IioSensor(const IioSensor &);
+    IioSensor &operator=(const IioSensor &);
+
+    /** sysfs directory of the device, character device */
+    string dir;
+    string dev;
+    /** e.g. "in_illuminance" or "in_illuminance0" */
+    string channel;
+    Attribute value;
+    /** true if value is _input (lux), false if _raw */
+    bool processed;
+    double scale;
+    double offset;
+
+    int fd;
+    bool buffered;
+    bool enabled;
+    /* Layout of a sample, from scan_elements/<channel>_type */
+    bool bigEndian;
+    bool isSigned;
+    int bits;
+    int storageBytes;
+    int shift;
+
+    unsigned char partial[8];
+    int partialLength;
+    int last;
+    bool haveSample;
+    int lastRead;
+    unsigned long samples;
+    unsigned long reads;
+
+    int openDevice(const string &devicesDir, const string &name, const string &devDir);
+    int setupBuffer(const string &devicesDir);
+    int reopen();
+    void drain();
+    int readValue(int *v);
+    int decode(const unsigned char *p) const;
+};
+
+#endif // IIO_H
@@ -0,0 +1,142 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include "lid.h"
+
+using namespace std;
+
+LidMonitor::LidMonitor()
+{
+    fd = -1;
+    state = -2;
+    events = 0;
+}
+
+LidMonitor::~LidMonitor()
+{
+    if(fd != -1)
+        close(fd);
+}
+
+/**
+ * The sw capabilities are hexadecimal words, the most significant first:
+ * SW_LID (0) is the lowest bit of the last one.
+ */
+static bool reportsLid(const string &capabilities)
+{
+    FILE *f = fopen(capabilities.c_str(), "r");
+    if(f == NULL)
+        return false;
+    char buf[256];
+    bool lid = false;
+    if(fgets(buf, sizeof(buf), f) != NULL) {
+        buf[strcspn(buf, "\n")] = '\0';
+        const char *last = strrchr(buf, ' ');
+        last = last == NULL ? buf : last + 1;
+        lid = (strtoul(last, NULL, 16) >> SW_LID) & 1;
+    }
+    fclose(f);
+    return lid;
+}
+
+int LidMonitor::init(string inputClassDir, string devDir)
+{
+    DIR *dir = opendir(inputClassDir.c_str());
+    if(dir == NULL)
+        return -1;
+
+    vector<string> names;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(strncmp(entry->d_name, "event", 5) == 0)
+            names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    sort(names.begin(), names.end());
+
+    for(size_t i = 0; i < names.size(); i++) {
+        if(!reportsLid(inputClassDir + "/" + names[i] + "/device/capabilities/sw"))
+            continue;
+        path = devDir + "/" + names[i];
+        if(reopen() == -1) {
+            path.clear();
+            return -1;
+        }
+
+        // A real device knows the current position, a fake one doesn't
+        unsigned long sw[SW_MAX / (8 * sizeof(unsigned long)) + 1];
+        memset(sw, 0, sizeof(sw));
+        if(ioctl(fd, EVIOCGSW(sizeof(sw)), sw) != -1)
+            state = (sw[0] >> SW_LID) & 1 ? 0 : 1;
+        return 0;
+    }
+
+    errno = ENODEV;
+    return -1;
+}
+
+int LidMonitor::reopen()
+{
+    if(fd != -1)
+        close(fd);
+    fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    return fd == -1 ? -1 : 0;
+}
+
+bool LidMonitor::onEvent()
+{
+    int before = state;
+    struct input_event ev[16];
+
+    while(1) {
+        ssize_t n = read(fd, ev, sizeof(ev));
+        if(n == 0) {
+            // The writer of a fake device (a FIFO) went away: wait for the next one
+            reopen();
+            break;
+        }
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            if(errno == ENODEV) {
+                // Unplugged: the caller goes back to procfs
+                close(fd);
+                fd = -1;
+                state = -2;
+            }
+            break;
+        }
+
+        for(size_t i = 0; i < n / sizeof(struct input_event); i++) {
+            if(ev[i].type == EV_SW && ev[i].code == SW_LID) {
+                state = ev[i].value ? 0 : 1;
+                events++;
+            }
+        }
+    }
+    return state != before;
+}
@@ -0,0 +1,54 @@
+#ifndef LID_H
+#define LID_H
+
+#include <string>
+using namespace std;
+
+/**
+ * Follows the lid through the input device that reports the SW_LID
+ * switch, instead of reading /proc/acpi/button/lid/LID/state.
+ *
+ * The device is looked up once by init(). The owner polls getFd() for
+ * POLLIN and calls onEvent(), which consumes the pending input events.
+ * When no device reports SW_LID, getFd() is -1 and getState() stays
+ * unknown: the caller falls back to procfs.
+ */
+class LidMonitor
+{
+public:
+    LidMonitor();
+    ~LidMonitor();
+
+    /**
+     * \param inputClassDir  usually /sys/class/input
+     * \param devDir         usually /dev/input
+     * \retval 0 if a lid switch has been found, -1 otherwise (sets errno)
+     */
+    int init(string inputClassDir, string devDir);
+
+    int getFd() const { return fd; }
+    /** Path of the device, empty if none */
+    const string &getPath() const { return path; }
+    /** Must be called when getFd() is readable. Returns true if the state changed. */
+    bool onEvent();
+    /** 1 if open, 0 if closed, -2 if unknown (e.g. no event received yet) */
+    int getState() const { return state; }
+    /** Sets the state read elsewhere, until the device reports one */
+    void setState(int state) { this->state = state; }
+
+    /** Number of lid switch events received */
+    unsigned long getEventCount() const { return events; }
+
+private:
+    LidMonitor(const LidMonitor &);
+    LidMonitor &operator=(const LidMonitor &);
+
+    string path;
+    int fd;
+    int state;
+    unsigned long events;
+
+    int reopen();
+};
+
+#endif // LID_H
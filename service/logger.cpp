@@ -0,0 +1,285 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "logger.h"
+
+/*
+ * The queue is an array of slots, each with a sequence number telling
+ * whose turn it is (D. Vyukov's bounded queue): slot i is free for the
+ * producer that claims position p when its sequence is p, and holds a
+ * message for the consumer at position p when it's p + 1. Positions are
+ * claimed with a compare-and-swap, so producers never lock.
+ */
+typedef struct {
+    uint32_t sequence;
+    int priority;
+    char text[LOG_MESSAGE_LENGTH];
+} log_slot_t;
+
+static log_slot_t g_slots[LOG_QUEUE_SIZE];
+static uint32_t g_enqueuePos = 0;
+static uint32_t g_dequeuePos = 0;
+
+static bool g_started = false;
+/** eventfd written by producers when the logger thread sleeps */
+static int g_wakeFd = -1;
+static bool g_sleeping = false;
+static logger_stats_t g_stats;
+
+/* State of the consumer, see emit(). Whoever holds g_emitMtx is the
+ * consumer: the logger thread, or loggerFlush(). */
+static pthread_mutex_t g_emitMtx = PTHREAD_MUTEX_INITIALIZER;
+static int g_lastPriority = -1;
+static char g_last[LOG_MESSAGE_LENGTH];
+static unsigned long g_repeats = 0;
+static long long g_repeatsSinceMs = 0;
+static double g_tokens = LOG_BURST;
+static long long g_tokensAtMs = 0;
+static unsigned long g_suppressedRun = 0;
+
+static long long nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool dequeue(int *priority, char *text)
+{
+    uint32_t pos = __atomic_load_n(&g_dequeuePos, __ATOMIC_RELAXED);
+    log_slot_t *slot;
+    while(1) {
+        slot = &g_slots[pos & (LOG_QUEUE_SIZE - 1)];
+        int32_t diff = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (pos + 1));
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&g_dequeuePos, &pos, pos + 1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&g_dequeuePos, __ATOMIC_RELAXED);
+        }
+    }
+    *priority = slot->priority;
+    memcpy(text, slot->text, LOG_MESSAGE_LENGTH);
+    __atomic_store_n(&slot->sequence, pos + LOG_QUEUE_SIZE, __ATOMIC_RELEASE);
+    return true;
+}
+
+/** Reports the messages coalesced or suppressed so far. Consumer only. */
+static void flushSummaries()
+{
+    if(g_repeats > 0) {
+        syslog(g_lastPriority, "Last message repeated %lu times", g_repeats);
+        g_repeats = 0;
+    }
+    if(g_suppressedRun > 0) {
+        syslog(LOG_WARNING, "%lu messages suppressed by the rate limit", g_suppressedRun);
+        g_suppressedRun = 0;
+    }
+}
+
+/** Hands a message to syslog(), unless repeated or over the rate. Consumer only. */
+static void emit(int priority, const char *text)
+{
+    long long now = nowMs();
+    if(priority == g_lastPriority && strcmp(text, g_last) == 0) {
+        if(g_repeats++ == 0)
+            g_repeatsSinceMs = now;
+        __sync_fetch_and_add(&g_stats.coalesced, 1);
+        return;
+    }
+
+    g_tokens += (now - g_tokensAtMs) * LOG_RATE / 1000.0;
+    if(g_tokens > LOG_BURST)
+        g_tokens = LOG_BURST;
+    g_tokensAtMs = now;
+    if(LOG_PRI(priority) > LOG_CRIT) {
+        if(g_tokens < 1) {
+            g_suppressedRun++;
+            __sync_fetch_and_add(&g_stats.suppressed, 1);
+            return;
+        }
+        g_tokens -= 1;
+    }
+
+    flushSummaries();
+    syslog(priority, "%s", text);
+    g_lastPriority = priority;
+    memcpy(g_last, text, LOG_MESSAGE_LENGTH);
+}
+
+static void drain()
+{
+    int priority;
+    char text[LOG_MESSAGE_LENGTH];
+    while(dequeue(&priority, text))
+        emit(priority, text);
+}
+
+static void *loggerThread(void *)
+{
+    while(1) {
+        pthread_mutex_lock(&g_emitMtx);
+        drain();
+        // A run of repeats is reported once it ends, or after a while
+        if(g_repeats > 0 && nowMs() - g_repeatsSinceMs >= LOG_REPEAT_MS)
+            flushSummaries();
+        bool pending = g_repeats > 0;
+        pthread_mutex_unlock(&g_emitMtx);
+
+        // Producers look at g_sleeping after publishing their message:
+        // either they see it set and wake us, or we see their message.
+        __atomic_store_n(&g_sleeping, true, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        uint32_t pos = __atomic_load_n(&g_dequeuePos, __ATOMIC_RELAXED);
+        if(__atomic_load_n(&g_slots[pos & (LOG_QUEUE_SIZE - 1)].sequence, __ATOMIC_ACQUIRE) == pos + 1) {
+            __atomic_store_n(&g_sleeping, false, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        struct pollfd pfd = { g_wakeFd, POLLIN, 0 };
+        if(poll(&pfd, 1, pending ? LOG_REPEAT_MS : -1) > 0) {
+            uint64_t count;
+            ssize_t ret = read(g_wakeFd, &count, sizeof(count));
+            (void)ret;
+        }
+        __atomic_store_n(&g_sleeping, false, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int loggerStart()
+{
+    if(g_started)
+        return 0;
+    for(uint32_t i = 0; i < LOG_QUEUE_SIZE; i++)
+        g_slots[i].sequence = i;
+    g_tokensAtMs = nowMs();
+
+    g_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(g_wakeFd == -1)
+        return -1;
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, loggerThread, NULL);
+    if(err != 0) {
+        close(g_wakeFd);
+        g_wakeFd = -1;
+        errno = err;
+        return -1;
+    }
+    pthread_detach(thread);
+    __atomic_store_n(&g_started, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void logMessage(int priority, const char *fmt, ...)
+{
+    // setlogmask(0) only reads the mask: don't format what syslog() would discard
+    if(!(setlogmask(0) & LOG_MASK(LOG_PRI(priority))))
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    if(!__atomic_load_n(&g_started, __ATOMIC_ACQUIRE)) {
+        vsyslog(priority, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    uint32_t pos = __atomic_load_n(&g_enqueuePos, __ATOMIC_RELAXED);
+    log_slot_t *slot;
+    while(1) {
+        slot = &g_slots[pos & (LOG_QUEUE_SIZE - 1)];
+        int32_t diff = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&g_enqueuePos, &pos, pos + 1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff < 0) {
+            // A daemon about to die fills the queue: its last words must pass
+            if(LOG_PRI(priority) <= LOG_CRIT)
+                vsyslog(priority, fmt, ap);
+            else
+                __sync_fetch_and_add(&g_stats.dropped, 1);
+            va_end(ap);
+            return;
+        } else {
+            pos = __atomic_load_n(&g_enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->priority = priority;
+    vsnprintf(slot->text, LOG_MESSAGE_LENGTH, fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    __sync_fetch_and_add(&g_stats.queued, 1);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&g_sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&g_sleeping, false, __ATOMIC_SEQ_CST)) {
+        // Only fails if the counter is full, and then the thread is awake
+        uint64_t one = 1;
+        ssize_t ret = write(g_wakeFd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+void loggerFlush(int timeoutMs)
+{
+    if(!__atomic_load_n(&g_started, __ATOMIC_ACQUIRE))
+        return;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    if(pthread_mutex_timedlock(&g_emitMtx, &deadline) == 0) {
+        drain();
+        flushSummaries();
+        pthread_mutex_unlock(&g_emitMtx);
+        return;
+    }
+
+    // The logger thread is stuck in syslog(): what's left is written from
+    // here, as it comes, without coalescing or rate limit
+    int priority;
+    char text[LOG_MESSAGE_LENGTH];
+    while(dequeue(&priority, text))
+        syslog(priority, "%s", text);
+}
+
+logger_stats_t loggerGetStats()
+{
+    logger_stats_t stats;
+    stats.queued = __atomic_load_n(&g_stats.queued, __ATOMIC_RELAXED);
+    stats.dropped = __atomic_load_n(&g_stats.dropped, __ATOMIC_RELAXED);
+    stats.coalesced = __atomic_load_n(&g_stats.coalesced, __ATOMIC_RELAXED);
+    stats.suppressed = __atomic_load_n(&g_stats.suppressed, __ATOMIC_RELAXED);
+    return stats;
+}
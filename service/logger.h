@@ -0,0 +1,66 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include <syslog.h>
+
+/*
+ * Asynchronous logging.
+ *
+ * syslog() writes to a socket, and blocks when journald or syslogd don't
+ * keep up. logMessage() instead formats the message into a slot of a
+ * bounded lock-free queue and returns; a background thread takes the
+ * messages out and hands them to syslog(). Any number of threads can log
+ * at the same time. When the queue is full the message is dropped and
+ * counted: a thread that logs never waits. Messages from LOG_CRIT up are
+ * the exception, they go to syslog() directly rather than being lost.
+ *
+ * The logger thread also coalesces a message repeated several times in a
+ * row into a single "last message repeated" line, and limits the rate to
+ * LOG_RATE messages per second, in bursts of up to LOG_BURST; messages
+ * from LOG_CRIT up are never limited.
+ *
+ * Before loggerStart() and in programs that don't call it, logMessage()
+ * calls syslog() directly.
+ */
+
+/** Messages the queue can hold, a power of 2 */
+#define LOG_QUEUE_SIZE 256
+/** Longest message, longer ones are truncated */
+#define LOG_MESSAGE_LENGTH 248
+#define LOG_RATE 10
+#define LOG_BURST 50
+/** A run of repeated messages is reported after this long at most (ms) */
+#define LOG_REPEAT_MS 10000
+
+typedef struct {
+    /** messages queued by logMessage() */
+    uint64_t queued;
+    /** messages lost because the queue was full */
+    uint64_t dropped;
+    /** messages folded into a "last message repeated" line */
+    uint64_t coalesced;
+    /** messages over the rate limit */
+    uint64_t suppressed;
+} logger_stats_t;
+
+/**
+ * Starts the logger thread. Signals should be blocked first, the thread
+ * inherits the mask.
+ * \retval 0 if ok, -1 on error (sets errno)
+ */
+int loggerStart();
+
+/** Logs a message with syslog() priority \a priority, without blocking */
+void logMessage(int priority, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Writes everything queued so far before returning. If the logger thread
+ * is stuck for more than \a timeoutMs, the calling thread writes the
+ * messages itself. Meant to be called before exit().
+ */
+void loggerFlush(int timeoutMs);
+
+logger_stats_t loggerGetStats();
+
+#endif // LOGGER_H
@@ -13,246 +13,180 @@
    See the License for the specific language governing permissions and
    limitations under the License. */
 
-#include <string.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
+#include <string>
+#include <vector>
 #include <stdlib.h>
-#include <signal.h>
 #include <stdio.h>
-#include <pthread.h>
-#include <syslog.h>
-#include <errno.h>
-#include "comsock.h"
-#include "client.h"
+#include <unistd.h>
 #include <errno.h>
 #include <err.h>
+#include <limits.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "controller.h"
+#include "record.h"
+#include "client.h"
+#include "comsock.h"
 #include <bsd/libutil.h>
 
 using namespace std;
 
-void logServerExit(int __status, int __pri, const char *fmt);
-void startDaemon();
-void enableALS(bool enable);
-void *IPCHandler(void *arg);
-void *clientHandler(void *arg);
-int getLidStatus();
-int fileExist(const char *filename);
-
-volatile bool active = false;
-
-int g_socket = -1;
-
-const string SOCKET_PATH = "/var/run/als-controller.socket";
-char* C_SOCKET_PATH = (char*)SOCKET_PATH.c_str();
-
-pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t start = PTHREAD_COND_INITIALIZER;
-
-/** Signal mask */
-static sigset_t g_sigset;
-
-
-void *sigManager(void *arg) {
-  int signum;
-
-  while(1) {
-    sigwait(&g_sigset, &signum);
-
-    if(signum == SIGINT || signum == SIGTERM) {
-        logServerExit(EXIT_SUCCESS, LOG_INFO, "Terminated.");
-    }
-  }
-
-  return NULL;
-}
-
-void logServerExit(int __status, int __pri, const char *fmt) {
-    closeServerChannel(C_SOCKET_PATH, g_socket);
-    enableALS(false);
-    syslog(__pri, "%s", fmt);
-    if(__status != EXIT_SUCCESS)
-        syslog(LOG_INFO, "Terminated.");
-    closelog();
-    exit(__status);
-}
-
-int fileExist(const char *filename)
+/** Parses the value of a numeric option, exits if it's not in [min, max] */
+static int optionInt(const char *option, const char *value, int min, int max)
 {
-    struct stat buffer;
-    return (stat (filename, &buffer) == 0);
+    char *end;
+    long v = strtol(value, &end, 10);
+    if(*value == '\0' || *end != '\0' || v < min || v > max)
+        errx(EXIT_FAILURE, "%s must be between %d and %d.", option, min, max);
+    return (int)v;
 }
 
-void writeAttribute(string path, string data) {
-    int fd = open(path.c_str(), O_WRONLY);
-    if(fd == -1) {
-        string msg = "Error opening " + path;
-        logServerExit(EXIT_FAILURE, LOG_CRIT, msg.c_str());
-    }
-    if(write(fd, data.c_str(), data.length() + 1) == -1) {
-        string msg = "Error writing to " + path;
-        logServerExit(EXIT_FAILURE, LOG_CRIT, msg.c_str());
-    }
-
-    close(fd);
-}
-
-void enableALS(bool enable) {
-    if(enable) {
-        writeAttribute("/sys/bus/acpi/devices/ACPI0008:00/enable", "1");
-    } else {
-        writeAttribute("/sys/bus/acpi/devices/ACPI0008:00/enable", "0");
-    }
-
-    if (enable)
-        syslog(LOG_INFO, "ALS enabled");
-    else
-        syslog(LOG_INFO, "ALS disabled");
-}
-
-string getScreenBacklightDevicePath() {
-    string path0 = "/sys/class/backlight/acpi_video0/";
-    string path1 = "/sys/class/backlight/intel_backlight/";
-    if (fileExist(path0.c_str())) {
-        return path0;
-    } else {
-        return path1;
-    }
-}
-
-int getScreenBacklightMax()
+/** Splits the value of --backlights at the commas, exits if it's empty */
+static vector<string> optionList(const char *option, const string &value)
 {
-    string path = getScreenBacklightDevicePath() + "max_brightness";
-
-    int fd = open(path.c_str(), O_RDONLY);
-    if(fd == -1) {
-        syslog(LOG_ERR, "Error opening %s", path.c_str());
-        return 0;
-    }
-    
-    char str[100];
-    int count = read(fd, str, sizeof(str));
-    if (count == -1) return 0;
-    str[count] = '\0';
-    close(fd);
-    int value = atoi(str);
-    return value;
-}
-
-void setScreenBacklight(int percent) {
-    int ret = 0;
-    char cmd[100];
-    int maxScreenBacklight = getScreenBacklightMax(); // could be static if we are sure if it will not be changed at program lifetime
-    if (!maxScreenBacklight) {
-        syslog(LOG_ERR, "Failed to get max screen backlight.");
-        return;
-    }
-
-    string path = getScreenBacklightDevicePath() + "brightness";
-    snprintf(cmd, sizeof(cmd), "echo %d | tee %s", maxScreenBacklight * percent / 100, path.c_str());
-    ret = system(cmd);
-    if (ret < 0) {
-        syslog(LOG_ERR, "Failed to set screen backlight.");
-    }
-}
-
-void setKeyboardBacklight(int percent) {
-    int value = 0;
-    int ret = 0;
-    if(percent <= 25) value = 0;
-    else if(percent <= 50) value = 1;
-    else if(percent <= 75) value = 2;
-    else if(percent <= 100) value = 3;
-
-    char cmd[150];
-    snprintf(cmd, 150, "echo %d | tee /sys/class/leds/asus::kbd_backlight/brightness", value);
-    // FIXME system() is not reliable when running with setuid.
-    // Use execl() instead (see setScreenBacklight())
-    ret = system(cmd);
-    if (ret < 0) {
-        syslog(LOG_ERR, "Failed to set keyboard backlight.");
-    }
+    vector<string> list;
+    size_t start = 0;
+    while(start <= value.size()) {
+        size_t end = value.find(',', start);
+        if(end == string::npos)
+            end = value.size();
+        if(end > start)
+            list.push_back(value.substr(start, end - start));
+        start = end + 1;
+    }
+    if(list.empty())
+        errx(EXIT_FAILURE, "%s needs at least one name.", option);
+    return list;
 }
 
 /**
- * @brief getLidStatus
- * @return 1 if opened, 0 if closed, -1 on error, -2 if unknown
+ * Replays a recording (--replay) with the filter options and the curve
+ * given on the command line, prints the decisions that differ from the
+ * recorded ones and exits: 0 if there are none, 1 otherwise, 2 on error.
  */
-int getLidStatus() {
-    int fd = open("/proc/acpi/button/lid/LID/state", O_RDONLY);
-    if(fd == -1) {
-        syslog(LOG_ERR, "Error opening /proc/acpi/button/lid/LID/state");
-        return -1;
-    } else {
-        char str[100];
-        int count = read(fd, str, 100);
-	if (count == -1) return -1;
-        str[count] = '\0';
-        close(fd);
-        string s = string(str);
-        if(s.find("open") != string::npos) {
-            return 1;
-        } else if(s.find("closed") != string::npos) {
-            return 0;
-        } else {
-            return -2;
-        }
-    }
+static void replay(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if(f == NULL)
+        err(2, "%s", path);
+    string data;
+    char buf[65536];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.append(buf, n);
+    fclose(f);
+
+    string source, error;
+    curve_table_t *curve = loadBrightnessCurve(&source, &error);
+    if(curve == NULL)
+        errx(2, "Invalid brightness curve: %s", error.c_str());
+
+    struct timespec t0, t1;
+    replay_stats_t stats;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int ret = replayRecording(data.data(), data.size(), g_filterConfig, curve, stdout, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    freeCurve(curve);
+    if(ret == -1)
+        warnx("%s is truncated or corrupted: replayed up to the last valid record", path);
+
+    double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    long long s = stats.durationMs / 1000;
+    printf("# %llu samples, %llu lid changes, %llu segments, %lldh%02lldm%02llds replayed in %.3f s"
+           " with curve %s: %llu differences\n",
+           (unsigned long long)stats.samples, (unsigned long long)stats.lidChanges,
+           (unsigned long long)stats.segments, s / 3600, s / 60 % 60, s % 60, elapsed,
+           source.c_str(), (unsigned long long)stats.differences);
+    exit(ret == -1 ? 2 : stats.differences > 0 ? 1 : 0);
 }
 
-int getAmbientLightPercent() {
-    int fd = open("/sys/bus/acpi/devices/ACPI0008:00/ali", O_RDONLY);
-    if(fd == -1) {
-        logServerExit(EXIT_FAILURE, LOG_CRIT, "Error opening /sys/bus/acpi/devices/ACPI0008:00/ali");
-    }
-    char strals[100];
-    int count = read(fd, strals, 100);
-    if (count == -1) {
-        logServerExit(EXIT_FAILURE, LOG_CRIT, "Error reading /sys/bus/acpi/devices/ACPI0008:00/ali");
+int main(int argc, char *argv[])
+{
+    bool foreground = false;
+    bool abstract = false;
+    const char *replayPath = NULL;
+
+    /* Options shared by daemon and client are consumed here,
+     * everything else is left to the Client. */
+    int nargs = 1;
+    for(int i = 1; i < argc; i++) {
+        string arg(argv[i]);
+        if((arg == "-r" || arg == "--root") && i + 1 < argc) {
+            char resolved[PATH_MAX];
+            if(realpath(argv[++i], resolved) == NULL)
+                err(EXIT_FAILURE, "%s", argv[i]);
+            g_root = resolved;
+        } else if(arg == "-f" || arg == "--foreground") {
+            foreground = true;
+        } else if(arg == "-a" || arg == "--abstract") {
+            abstract = true;
+        } else if((arg == "-c" || arg == "--curve") && i + 1 < argc) {
+            char resolved[PATH_MAX];
+            if(realpath(argv[++i], resolved) == NULL)
+                err(EXIT_FAILURE, "%s", argv[i]);
+            g_curvePath = resolved;
+        } else if(arg == "--record" && i + 1 < argc) {
+            // The daemon changes directory to /
+            g_recordPath = argv[++i];
+            if(g_recordPath[0] != '/') {
+                char cwd[PATH_MAX];
+                if(getcwd(cwd, sizeof(cwd)) == NULL)
+                    err(EXIT_FAILURE, "getcwd");
+                g_recordPath = string(cwd) + "/" + g_recordPath;
+            }
+        } else if(arg == "--replay" && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if(arg == "--sensor" && i + 1 < argc) {
+            g_sensorType = argv[++i];
+            if(g_sensorType != "acpi" && g_sensorType != "iio" && g_sensorType != "auto")
+                errx(EXIT_FAILURE, "--sensor must be acpi, iio or auto.");
+        } else if(arg == "--backlights" && i + 1 < argc) {
+            g_backlightPriority = optionList(argv[i], argv[i + 1]);
+            i++;
+        } else if(arg == "--median" && i + 1 < argc) {
+            g_filterConfig.medianWindow = optionInt(argv[i], argv[i + 1], 1, FILTER_MAX_WINDOW);
+            i++;
+        } else if(arg == "--ema" && i + 1 < argc) {
+            g_filterConfig.emaWeight = optionInt(argv[i], argv[i + 1], 1, 100);
+            i++;
+        } else if(arg == "--hysteresis" && i + 1 < argc) {
+            g_filterConfig.hysteresisPercent = optionInt(argv[i], argv[i + 1], 0, 100);
+            i++;
+        } else if(arg == "--dwell" && i + 1 < argc) {
+            g_filterConfig.dwellMs = optionInt(argv[i], argv[i + 1], 0, INT_MAX);
+            i++;
+        } else if((arg == "-i" || arg == "--max-interval") && i + 1 < argc) {
+            g_samplerConfig.maxIntervalMs = optionInt(argv[i], argv[i + 1], g_samplerConfig.minIntervalMs,
+                                                      SAMPLER_MAX_INTERVAL_MS);
+            i++;
+        } else {
+            argv[nargs++] = argv[i];
+        }
     }
-    strals[count] = '\0';
-    close(fd);
-
-    // 0x32 (min illuminance), 0xC8, 0x190, 0x258, 0x320 (max illuminance).
-    int als = atoi(strals);
-    //printf("\"%s\"\n", strals);
-    //printf("Illuminance detected: %d\n", als);
 
-    float percent = 0;
+    if(replayPath != NULL)
+        replay(replayPath);
 
-    switch(als) {
-    case 0x32:
-        percent = 10;
-        break;
-    case 0xC8:
-        percent = 25;
-        break;
-    case 0x190:
-        percent = 50;
-        break;
-    case 0x258:
-        percent = 75;
-        break;
-    case 0x320:
-        percent = 100;
-        break;
+    if(abstract) {
+        // A daemon running on a fake tree must not clash with the real one
+        g_socketPath = ABSTRACT_SOCKET_NAME + (g_root.empty() ? "" : ":" + g_root);
+        if(g_socketPath.size() > UNIX_PATH_MAX)
+            errx(EXIT_FAILURE, "--root is too long for an abstract socket name.");
+    } else {
+        g_socketPath = rooted(SOCKET_PATH);
     }
+    C_SOCKET_PATH = (char*)g_socketPath.c_str();
 
-    return percent;
-}
-
-int main(int argc, char *argv[])
-{
-    if(argc > 1) {
-        Client c = Client(argc, argv, SOCKET_PATH);
+    if(nargs > 1) {
+        Client c = Client(nargs, argv, g_socketPath);
         c.Run();
         exit(EXIT_SUCCESS);
     }
 
     struct pidfh *pfh;
     pid_t otherpid;
-    pfh = pidfile_open("/var/run/als-controller.pid", 0600, &otherpid);
+    pfh = pidfile_open(rooted(PIDFILE_PATH).c_str(), 0600, &otherpid);
     if (pfh == NULL) {
         if (errno == EEXIST) {
                     errx(EXIT_FAILURE, "Daemon already running, pid: %jd.",
@@ -262,7 +196,7 @@ int main(int argc, char *argv[])
         warn("Cannot open or create pidfile");
     }
 
-    if (daemon(0, 0) == -1) {
+    if (!foreground && daemon(0, 0) == -1) {
         warn("Cannot daemonize");
         pidfile_remove(pfh);
         exit(EXIT_FAILURE);
@@ -274,147 +208,9 @@ int main(int argc, char *argv[])
     umask(0);
 
     /* Open the log file */
-    openlog("als-controller", LOG_PID, LOG_DAEMON);
+    openlog("als-controller", LOG_PID | (foreground ? LOG_PERROR : 0), LOG_DAEMON);
 
     startDaemon();
     pidfile_remove(pfh);
     return 0;
 }
-
-void startDaemon()
-{
-    syslog(LOG_NOTICE, "Started.");
-
-    /* Signals blocked in all threads.
-     * sigManager is the only thread responsible to catch signals */
-    sigemptyset(&g_sigset);
-    sigaddset(&g_sigset, SIGINT);
-    sigaddset(&g_sigset, SIGTERM);
-    if(pthread_sigmask(SIG_SETMASK, &g_sigset, NULL) != 0) {
-        logServerExit(EXIT_FAILURE, LOG_CRIT, "Sigmask error.");
-    }
-
-    pthread_t sigthread;
-    if(pthread_create(&sigthread, NULL, sigManager, NULL) != 0) {
-        logServerExit(EXIT_FAILURE, LOG_CRIT, "Creating thread.");
-    }
-
-
-    pthread_t thread_id;
-    int err = pthread_create(&thread_id, NULL, IPCHandler, NULL);
-    if(err != 0) {
-        syslog(LOG_CRIT, "Cannot create thread");
-        exit(EXIT_FAILURE);
-    }
-
-    while(1) {
-
-        pthread_mutex_lock(&mtx);
-        while(!active) {
-            pthread_cond_wait(&start, &mtx);
-        }
-        pthread_mutex_unlock(&mtx);
-
-        if(getLidStatus() == 0) {
-            setKeyboardBacklight(0);
-        } else {
-
-            float als = getAmbientLightPercent();
-            //printf("Illuminance percent: %f\n", als);
-
-            if(als <= 10) {
-                setScreenBacklight(40);
-                setKeyboardBacklight(100);
-            } else if(als <= 25) {
-                setScreenBacklight(60);
-                setKeyboardBacklight(0);
-            } else if(als <= 50) {
-                setScreenBacklight(75);
-                setKeyboardBacklight(0);
-            } else if(als <= 75) {
-                setScreenBacklight(90);
-                setKeyboardBacklight(0);
-            } else if(als <= 100) {
-                setScreenBacklight(100);
-                setKeyboardBacklight(0);
-            }
-        }
-
-        sleep(3);
-    }
-
-    logServerExit(EXIT_SUCCESS, LOG_NOTICE, "Terminated.");
-}
-
-void *IPCHandler(void *arg)
-{
-    unlink(C_SOCKET_PATH);
-    g_socket = createServerChannel(C_SOCKET_PATH);
-    if(g_socket == -1) {
-      logServerExit(EXIT_FAILURE, LOG_CRIT, "Error creating socket");
-    }
-
-    // Permessi 777 sulla socket
-    if(chmod(C_SOCKET_PATH, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH) != 0) {
-      closeServerChannel(C_SOCKET_PATH, g_socket);
-      return NULL;
-    }
-
-    while(1)
-    {
-        int client = acceptConnection(g_socket);
-        if(client == -1) {
-            syslog(LOG_ERR, "Error accepting client connection.");
-        } else {
-            pthread_t thread_id;
-            int err = pthread_create(&thread_id, NULL, clientHandler, (void *)(size_t)client);
-            if(err != 0) {
-                logServerExit(EXIT_FAILURE, LOG_CRIT, "Error creating client thread.");
-            }
-        }
-    }
-}
-
-void *clientHandler(void *arg)
-{
-    int client = (int)(size_t)arg;
-    message_t msg;
-
-    if(receiveMessage(client, &msg) == -1) {
-        syslog(LOG_ERR, "Error receiving message from client.");
-        return NULL;
-    }
-
-    if(msg.type == MSG_ENABLE) {
-        enableALS(true);
-        pthread_mutex_lock(&mtx);
-        active = true;
-        pthread_mutex_unlock(&mtx);
-        pthread_cond_signal(&start);
-    } else if(msg.type == MSG_DISABLE) {
-        pthread_mutex_lock(&mtx);
-        active = false;
-        pthread_mutex_unlock(&mtx);
-        enableALS(false);
-    } else if(msg.type == MSG_STATUS) {
-        bool status = false;
-        pthread_mutex_lock(&mtx);
-        status = active;
-        pthread_mutex_unlock(&mtx);
-
-        int sent;
-        message_t msg;
-
-        msg.type = status ? MSG_ENABLED : MSG_DISABLED;
-        msg.buffer = NULL;
-        msg.length = 0;
-
-        sent = sendMessage(client, &msg);
-        if(sent == -1) {
-            syslog(LOG_ERR, "Error sending reply to client.");
-            return NULL;
-        }
-    }
-
-    return NULL;
-}
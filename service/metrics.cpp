@@ -0,0 +1,334 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <string>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "comsock.h"
+
+using namespace std;
+
+const uint32_t HISTOGRAM_BOUNDS_US[HISTOGRAM_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 50000, 100000
+};
+
+void histogramRecord(histogram_t *h, int64_t ns)
+{
+    if(ns < 0)
+        ns = 0;
+    int64_t us = ns / 1000;
+    int b = 0;
+    while(b < HISTOGRAM_BUCKETS - 1 && us >= (int64_t)HISTOGRAM_BOUNDS_US[b])
+        b++;
+    __sync_fetch_and_add(&h->counts[b], 1);
+    __sync_fetch_and_add(&h->sumNs, (uint64_t)ns);
+}
+
+void histogramRead(const histogram_t *h, histogram_t *out)
+{
+    for(int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        out->counts[b] = __atomic_load_n(&h->counts[b], __ATOMIC_RELAXED);
+    out->sumNs = __atomic_load_n(&h->sumNs, __ATOMIC_RELAXED);
+}
+
+int requestKind(char type)
+{
+    switch(type) {
+    case MSG_ENABLE: return REQUEST_ENABLE;
+    case MSG_DISABLE: return REQUEST_DISABLE;
+    case MSG_STATUS: return REQUEST_STATUS;
+    case MSG_SUBSCRIBE: return REQUEST_SUBSCRIBE;
+    case MSG_TOGGLE: return REQUEST_TOGGLE;
+    case MSG_STATS: return REQUEST_STATS;
+    case MSG_TRACE: return REQUEST_TRACE;
+    case MSG_RELOAD: return REQUEST_RELOAD;
+    default: return REQUEST_OTHER;
+    }
+}
+
+const char *requestKindName(int kind)
+{
+    static const char *names[REQUEST_KINDS] = {
+        "enable", "disable", "status", "subscribe", "toggle", "stats", "trace", "reload", "other"
+    };
+    return kind >= 0 && kind < REQUEST_KINDS ? names[kind] : "other";
+}
+
+/* -= Binary form =- */
+
+static void putVarint(string &out, uint64_t v)
+{
+    while(v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static void putHistogram(string &out, const histogram_t *h)
+{
+    for(int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        putVarint(out, h->counts[b]);
+    putVarint(out, h->sumNs);
+}
+
+static void putBacklight(string &out, const backlight_metrics_t *b)
+{
+    putVarint(out, b->issued);
+    putVarint(out, b->skipped);
+    putVarint(out, b->errors);
+    putHistogram(out, &b->writeTime);
+}
+
+string encodeMetrics(const metrics_t *m)
+{
+    string out;
+    out.push_back((char)METRICS_VERSION);
+    out.push_back((char)HISTOGRAM_BUCKETS);
+    putVarint(out, m->iterations);
+    putHistogram(out, &m->sensorRead);
+    putHistogram(out, &m->lidRead);
+    putBacklight(out, &m->screen);
+    putBacklight(out, &m->keyboard);
+    for(int k = 0; k < REQUEST_KINDS; k++)
+        putVarint(out, m->requests[k]);
+    putHistogram(out, &m->acceptToReply);
+    putVarint(out, m->connections);
+    putVarint(out, m->rssBytes);
+    putVarint(out, m->wakeups);
+    putVarint(out, m->wakeupsPerHour);
+    putVarint(out, m->sampleIntervalMs);
+    putVarint(out, m->lightChanges);
+    putHistogram(out, &m->reactionTime);
+    putVarint(out, m->filterApplied);
+    putVarint(out, m->filterSuppressedHysteresis);
+    putVarint(out, m->filterSuppressedDwell);
+    return out;
+}
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    bool error;
+} decoder_t;
+
+static uint64_t getVarint(decoder_t *d)
+{
+    uint64_t v = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        if(d->p >= d->end) {
+            d->error = true;
+            return 0;
+        }
+        unsigned char c = *d->p++;
+        v |= (uint64_t)(c & 0x7F) << shift;
+        if(!(c & 0x80))
+            return v;
+    }
+    d->error = true;
+    return 0;
+}
+
+static void getHistogram(decoder_t *d, histogram_t *h)
+{
+    for(int b = 0; b < HISTOGRAM_BUCKETS; b++)
+        h->counts[b] = getVarint(d);
+    h->sumNs = getVarint(d);
+}
+
+static void getBacklight(decoder_t *d, backlight_metrics_t *b)
+{
+    b->issued = getVarint(d);
+    b->skipped = getVarint(d);
+    b->errors = getVarint(d);
+    getHistogram(d, &b->writeTime);
+}
+
+int decodeMetrics(const char *data, unsigned int length, metrics_t *m)
+{
+    if(length < 2 || data[0] != METRICS_VERSION || data[1] != HISTOGRAM_BUCKETS) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    decoder_t d;
+    d.p = (const unsigned char *)data + 2;
+    d.end = (const unsigned char *)data + length;
+    d.error = false;
+
+    memset(m, 0, sizeof(*m));
+    m->iterations = getVarint(&d);
+    getHistogram(&d, &m->sensorRead);
+    getHistogram(&d, &m->lidRead);
+    getBacklight(&d, &m->screen);
+    getBacklight(&d, &m->keyboard);
+    for(int k = 0; k < REQUEST_KINDS; k++)
+        m->requests[k] = getVarint(&d);
+    getHistogram(&d, &m->acceptToReply);
+    m->connections = getVarint(&d);
+    m->rssBytes = getVarint(&d);
+    m->wakeups = getVarint(&d);
+    m->wakeupsPerHour = getVarint(&d);
+    m->sampleIntervalMs = getVarint(&d);
+    m->lightChanges = getVarint(&d);
+    getHistogram(&d, &m->reactionTime);
+    m->filterApplied = getVarint(&d);
+    m->filterSuppressedHysteresis = getVarint(&d);
+    m->filterSuppressedDwell = getVarint(&d);
+
+    if(d.error) {
+        errno = EBADMSG;
+        return -1;
+    }
+    return 0;
+}
+
+/* -= Prometheus text format =- */
+
+static void appendf(string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void appendf(string &out, const char *fmt, ...)
+{
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    out += line;
+}
+
+static void header(string &out, const char *name, const char *type, const char *help)
+{
+    appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/** Writes the series of one histogram; \a labels is empty or ends with a comma */
+static void renderHistogram(string &out, const char *name, const char *labels, const histogram_t *h)
+{
+    uint64_t cumulative = 0;
+    for(int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        cumulative += h->counts[b];
+        if(b < HISTOGRAM_BUCKETS - 1)
+            appendf(out, "%s_bucket{%sle=\"%g\"} %llu\n", name, labels,
+                    HISTOGRAM_BOUNDS_US[b] / 1e6, (unsigned long long)cumulative);
+        else
+            appendf(out, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, labels,
+                    (unsigned long long)cumulative);
+    }
+
+    string plain(labels);
+    if(!plain.empty())
+        plain = "{" + plain.substr(0, plain.size() - 1) + "}";
+    appendf(out, "%s_sum%s %.9f\n", name, plain.c_str(), h->sumNs / 1e9);
+    appendf(out, "%s_count%s %llu\n", name, plain.c_str(), (unsigned long long)cumulative);
+}
+
+string renderMetrics(const metrics_t *m)
+{
+    string out;
+    const backlight_metrics_t *devices[2] = { &m->screen, &m->keyboard };
+    const char *deviceNames[2] = { "screen", "keyboard" };
+
+    header(out, "als_loop_iterations_total", "counter", "Control loop iterations.");
+    appendf(out, "als_loop_iterations_total %llu\n", (unsigned long long)m->iterations);
+
+    header(out, "als_sensor_read_seconds", "histogram", "Time to read the ambient light sensor.");
+    renderHistogram(out, "als_sensor_read_seconds", "", &m->sensorRead);
+
+    header(out, "als_lid_read_seconds", "histogram", "Time to read the lid state.");
+    renderHistogram(out, "als_lid_read_seconds", "", &m->lidRead);
+
+    header(out, "als_backlight_writes_total", "counter",
+           "Backlight updates, by outcome (skipped: the device already had the value).");
+    for(int i = 0; i < 2; i++) {
+        appendf(out, "als_backlight_writes_total{device=\"%s\",result=\"issued\"} %llu\n",
+                deviceNames[i], (unsigned long long)devices[i]->issued);
+        appendf(out, "als_backlight_writes_total{device=\"%s\",result=\"skipped\"} %llu\n",
+                deviceNames[i], (unsigned long long)devices[i]->skipped);
+        appendf(out, "als_backlight_writes_total{device=\"%s\",result=\"error\"} %llu\n",
+                deviceNames[i], (unsigned long long)devices[i]->errors);
+    }
+
+    header(out, "als_backlight_write_seconds", "histogram", "Time to update a backlight.");
+    for(int i = 0; i < 2; i++) {
+        string labels = string("device=\"") + deviceNames[i] + "\",";
+        renderHistogram(out, "als_backlight_write_seconds", labels.c_str(), &devices[i]->writeTime);
+    }
+
+    header(out, "als_ipc_requests_total", "counter", "Requests received on the control socket, by type.");
+    for(int k = 0; k < REQUEST_KINDS; k++)
+        appendf(out, "als_ipc_requests_total{type=\"%s\"} %llu\n",
+                requestKindName(k), (unsigned long long)m->requests[k]);
+
+    header(out, "als_ipc_accept_to_reply_seconds", "histogram",
+           "Time from accepting a connection to sending its first reply.");
+    renderHistogram(out, "als_ipc_accept_to_reply_seconds", "", &m->acceptToReply);
+
+    header(out, "als_ipc_connections", "gauge", "Open connections on the control socket.");
+    appendf(out, "als_ipc_connections %llu\n", (unsigned long long)m->connections);
+
+    header(out, "als_wakeups_total", "counter", "Control loop wakeups, for any reason.");
+    appendf(out, "als_wakeups_total %llu\n", (unsigned long long)m->wakeups);
+
+    header(out, "als_wakeups_per_hour", "gauge", "Average control loop wakeups per hour since start.");
+    appendf(out, "als_wakeups_per_hour %llu\n", (unsigned long long)m->wakeupsPerHour);
+
+    header(out, "als_sample_interval_seconds", "gauge", "Current interval between two sensor samples.");
+    appendf(out, "als_sample_interval_seconds %g\n", m->sampleIntervalMs / 1e3);
+
+    header(out, "als_light_changes_total", "counter", "Changes of ambient light detected.");
+    appendf(out, "als_light_changes_total %llu\n", (unsigned long long)m->lightChanges);
+
+    header(out, "als_reaction_seconds", "histogram",
+           "Time a change of light may have waited before being sampled.");
+    renderHistogram(out, "als_reaction_seconds", "", &m->reactionTime);
+
+    header(out, "als_filter_changes_total", "counter", "Changes of light let through by the filter.");
+    appendf(out, "als_filter_changes_total %llu\n", (unsigned long long)m->filterApplied);
+
+    header(out, "als_filter_suppressed_total", "counter", "Samples the filter kept from changing the brightness.");
+    appendf(out, "als_filter_suppressed_total{reason=\"hysteresis\"} %llu\n",
+            (unsigned long long)m->filterSuppressedHysteresis);
+    appendf(out, "als_filter_suppressed_total{reason=\"dwell\"} %llu\n",
+            (unsigned long long)m->filterSuppressedDwell);
+
+    header(out, "process_resident_memory_bytes", "gauge", "Resident memory size in bytes.");
+    appendf(out, "process_resident_memory_bytes %llu\n", (unsigned long long)m->rssBytes);
+
+    return out;
+}
+
+uint64_t residentBytes()
+{
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    unsigned long long size, resident;
+    if(sscanf(buf, "%llu %llu", &size, &resident) != 2)
+        return 0;
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
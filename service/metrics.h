@@ -0,0 +1,108 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <stdint.h>
+#include <time.h>
+using namespace std;
+
+/** Number of buckets of a histogram_t, the last one has no upper bound */
+#define HISTOGRAM_BUCKETS 16
+
+/** Upper bounds of the histogram buckets, in microseconds */
+extern const uint32_t HISTOGRAM_BOUNDS_US[HISTOGRAM_BUCKETS - 1];
+
+/**
+ * Latency histogram with fixed buckets. Recording is lock-free, so the
+ * thread that measures never waits for the one that reports.
+ */
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t sumNs;
+} histogram_t;
+
+/** Adds a sample of \a ns nanoseconds to \a h. Thread-safe. */
+void histogramRecord(histogram_t *h, int64_t ns);
+/** Copies \a h into \a out, one field at a time. */
+void histogramRead(const histogram_t *h, histogram_t *out);
+
+/** Clock used for every latency measure */
+inline int64_t metricsClockNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** Request types counted separately; anything else is REQUEST_OTHER */
+enum {
+    REQUEST_ENABLE,
+    REQUEST_DISABLE,
+    REQUEST_STATUS,
+    REQUEST_SUBSCRIBE,
+    REQUEST_TOGGLE,
+    REQUEST_STATS,
+    REQUEST_TRACE,
+    REQUEST_RELOAD,
+    REQUEST_OTHER,
+    REQUEST_KINDS
+};
+
+/** Maps a message type to its REQUEST_* kind */
+int requestKind(char type);
+const char *requestKindName(int kind);
+
+/** Counters of one backlight */
+typedef struct {
+    uint64_t issued;
+    uint64_t skipped;
+    uint64_t errors;
+    histogram_t writeTime;
+} backlight_metrics_t;
+
+/** Snapshot of everything the daemon reports (see MSG_STATS) */
+typedef struct {
+    uint64_t iterations;
+    histogram_t sensorRead;
+    histogram_t lidRead;
+    backlight_metrics_t screen;
+    backlight_metrics_t keyboard;
+    uint64_t requests[REQUEST_KINDS];
+    /** from accept() to the first reply sent on the connection */
+    histogram_t acceptToReply;
+    uint64_t connections;
+    uint64_t rssBytes;
+    /** control loop wakeups, for any reason */
+    uint64_t wakeups;
+    uint64_t wakeupsPerHour;
+    /** current sampling interval (ms) */
+    uint64_t sampleIntervalMs;
+    /** light changes detected, see sampler_stats_t::reactionTime */
+    uint64_t lightChanges;
+    histogram_t reactionTime;
+    /** see filter_stats_t */
+    uint64_t filterApplied;
+    uint64_t filterSuppressedHysteresis;
+    uint64_t filterSuppressedDwell;
+} metrics_t;
+
+/** Version of the binary format written by encodeMetrics() */
+#define METRICS_VERSION 1
+
+/**
+ * Encodes \a m in the binary form sent over the socket: a version byte
+ * and the number of histogram buckets, followed by every field of
+ * metrics_t in declaration order as an unsigned LEB128 varint.
+ */
+string encodeMetrics(const metrics_t *m);
+/**
+ * Decodes what encodeMetrics() produced.
+ * \retval 0 if ok, -1 if the data is truncated or of another version (sets errno)
+ */
+int decodeMetrics(const char *data, unsigned int length, metrics_t *m);
+/** Renders \a m in the Prometheus text exposition format */
+string renderMetrics(const metrics_t *m);
+
+/** Resident set size of the calling process, in bytes, 0 if unknown */
+uint64_t residentBytes();
+
+#endif // METRICS_H
@@ -0,0 +1,194 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+#include "ramp.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+static int64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/** Maps the progress t in [0, 1] according to the easing curve */
+static double ease(easing_t easing, double t) {
+    switch(easing) {
+    case EASE_IN_OUT:
+        return t * t * (3 - 2 * t);
+    case EASE_OUT:
+        return t * (2 - t);
+    case EASE_LINEAR:
+    default:
+        return t;
+    }
+}
+
+BrightnessRamp::BrightnessRamp(BacklightWriter &writer) : writer(writer)
+{
+    memset(&config, 0, sizeof(config));
+    memset(&stats, 0, sizeof(stats));
+    timerFd = -1;
+    fullScale = 0;
+    running = false;
+    from = to = current = -1;
+    frames = frame = 0;
+    startNs = intervalNs = 0;
+}
+
+BrightnessRamp::~BrightnessRamp()
+{
+    if(timerFd >= 0)
+        close(timerFd);
+}
+
+int BrightnessRamp::init(ramp_config_t config)
+{
+    this->config = config;
+    if(timerFd < 0) {
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if(timerFd == -1)
+            return -1;
+    }
+    return 0;
+}
+
+int BrightnessRamp::setTarget(int value, bool immediate)
+{
+    if(running && value == to && !immediate)
+        return 0;
+
+    int start = current;
+    if(!running) {
+        start = writer.getLastWritten();
+        if(start == -1 && writer.get(&start) == -1)
+            start = value;
+    }
+
+    if(running) {
+        stats.preempted++;
+        stop();
+    }
+
+    int delta = abs(value - start);
+    if(immediate || timerFd < 0 || config.durationMs <= 0 || delta == 0) {
+        writeFrame(value);
+        to = value;
+        return 0;
+    }
+
+    int64_t durationNs = (int64_t)config.durationMs * 1000000LL;
+    if(fullScale > 0 && delta < fullScale)
+        durationNs = durationNs * delta / fullScale;
+
+    // The longest the frame budget allows, but never more frames than
+    // distinct steps of at least minStep.
+    int byFps = (int)(durationNs * config.maxFps / NSEC_PER_SEC);
+    int bySteps = delta / (config.minStep > 0 ? config.minStep : 1);
+    frames = byFps < bySteps ? byFps : bySteps;
+    if(frames < 1)
+        frames = 1;
+    intervalNs = durationNs / frames;
+
+    stats.transitions++;
+    stats.lastPlannedFrames = frames;
+    if(frames > stats.maxPlannedFrames)
+        stats.maxPlannedFrames = frames;
+
+    from = start;
+    to = value;
+    frame = 0;
+    startNs = monotonicNs();
+    running = true;
+
+    return armFrame(1);
+}
+
+void BrightnessRamp::cancel()
+{
+    if(running)
+        stop();
+}
+
+void BrightnessRamp::finish()
+{
+    if(running) {
+        stop();
+        writeFrame(to);
+    }
+}
+
+void BrightnessRamp::onTimer()
+{
+    uint64_t expirations;
+    if(read(timerFd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    if(!running)
+        return;
+
+    // Absolute deadlines: work out which frame we are at from the clock,
+    // skipping the ones we were too late for.
+    int due = (int)((monotonicNs() - startNs) / intervalNs);
+    if(due <= frame)
+        due = frame + 1;
+    if(due > frames)
+        due = frames;
+    stats.missedFrames += due - frame - 1;
+    frame = due;
+
+    if(frame >= frames) {
+        stop();
+        writeFrame(to);
+        return;
+    }
+
+    double t = ease(config.easing, (double)frame / frames);
+    int value = from + (int)((to - from) * t + (to > from ? 0.5 : -0.5));
+    if(abs(value - current) >= (config.minStep > 0 ? config.minStep : 1))
+        writeFrame(value);
+
+    armFrame(frame + 1);
+}
+
+void BrightnessRamp::writeFrame(int value)
+{
+    stats.frames++;
+    if(writer.set(value) != -1)
+        current = value;
+}
+
+int BrightnessRamp::armFrame(int k)
+{
+    int64_t deadline = startNs + intervalNs * k;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / NSEC_PER_SEC;
+    its.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+    return timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+void BrightnessRamp::stop()
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(timerFd, 0, &its, NULL);
+    running = false;
+}
@@ -0,0 +1,115 @@
+#ifndef RAMP_H
+#define RAMP_H
+
+#include <stdint.h>
+#include "backlight.h"
+
+/** Easing curves available for a transition */
+typedef enum {
+    EASE_LINEAR,
+    /** slow start, fast middle, slow end (smoothstep) */
+    EASE_IN_OUT,
+    /** fast start, slow end (quadratic) */
+    EASE_OUT
+} easing_t;
+
+/** Transition parameters */
+typedef struct {
+    /** duration of a transition across the whole range (see setFullScale()),
+        0 = jump straight to the target */
+    int durationMs;
+    /** upper bound on the number of writes per second */
+    int maxFps;
+    /** smallest change (in raw device units) worth a write */
+    int minStep;
+    easing_t easing;
+} ramp_config_t;
+
+/** Counters collected by a BrightnessRamp */
+typedef struct {
+    /** transitions started */
+    unsigned long transitions;
+    /** transitions taken over by a new target before the end */
+    unsigned long preempted;
+    /** frames (writes requested to the BacklightWriter) in total */
+    unsigned long frames;
+    /** timer expirations we were too late to serve */
+    unsigned long missedFrames;
+    /** frames planned for the last transition */
+    int lastPlannedFrames;
+    /** the largest number of frames ever planned for one transition */
+    int maxPlannedFrames;
+} ramp_stats_t;
+
+/**
+ * Moves a backlight towards a target value over time, writing one
+ * intermediate value per frame through a BacklightWriter.
+ *
+ * Frames are scheduled on a CLOCK_MONOTONIC timerfd with absolute
+ * deadlines (start + k * interval), so a late wakeup never shifts the
+ * following frames. The owner polls getFd() for POLLIN and calls
+ * onTimer() when it becomes readable.
+ *
+ * A transition lasts durationMs scaled by the size of the change relative
+ * to the full scale of the device, so that every transition moves at the
+ * same speed. The number of frames is bounded both by maxFps and by
+ * minStep, so small changes cost a single write.
+ */
+class BrightnessRamp
+{
+public:
+    BrightnessRamp(BacklightWriter &writer);
+    ~BrightnessRamp();
+
+    /** Creates the timer. Returns -1 on error (sets errno). */
+    int init(ramp_config_t config);
+    void setConfig(ramp_config_t config) { this->config = config; }
+    ramp_config_t getConfig() const { return config; }
+    /** Largest value of the device; 0 (unknown) makes every transition last durationMs */
+    void setFullScale(int max) { fullScale = max; }
+
+    /**
+     * Starts a transition to \a value. If a transition is already running,
+     * the new one starts from the value currently shown.
+     * \param immediate  write \a value at once, without ramping
+     * \retval 0 if ok, -1 on error (sets errno)
+     */
+    int setTarget(int value, bool immediate = false);
+    /** Stops the current transition where it is. */
+    void cancel();
+    /** Writes the remaining frames at once. */
+    void finish();
+
+    int getFd() const { return timerFd; }
+    bool isRunning() const { return running; }
+    int getTarget() const { return to; }
+    ramp_stats_t getStats() const { return stats; }
+
+    /** Must be called when getFd() is readable. */
+    void onTimer();
+
+private:
+    BrightnessRamp(const BrightnessRamp &);
+    BrightnessRamp &operator=(const BrightnessRamp &);
+
+    BacklightWriter &writer;
+    ramp_config_t config;
+    ramp_stats_t stats;
+    int timerFd;
+    int fullScale;
+
+    bool running;
+    int from;
+    int to;
+    int current;
+    int frames;
+    int frame;
+    int64_t startNs;
+    int64_t intervalNs;
+
+    void writeFrame(int value);
+    int armFrame(int k);
+    void stop();
+};
+
+#endif // RAMP_H
@@ -0,0 +1,273 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <string>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include "record.h"
+#include "logger.h"
+
+using namespace std;
+
+/** Longest record: a kind byte and five varints */
+static const size_t MAX_RECORD_LENGTH = 1 + 5 * 10;
+
+static unsigned char *putVarint(unsigned char *p, uint64_t v)
+{
+    while(v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+Recorder::Recorder()
+{
+    pthread_mutex_init(&mutex, NULL);
+    fd = -1;
+    length = 0;
+    lastMs = pendingSinceMs = 0;
+    lastLid = -3;
+}
+
+Recorder::~Recorder()
+{
+    flush();
+    if(fd != -1)
+        close(fd);
+    pthread_mutex_destroy(&mutex);
+}
+
+int Recorder::open(const string &path, long long nowMs)
+{
+    int f = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(f == -1)
+        return -1;
+
+    pthread_mutex_lock(&mutex);
+    if(fd != -1) {
+        flushLocked();
+        close(fd);
+    }
+    fd = f;
+    this->path = path;
+    lastLid = -3;
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    memcpy(buffer + length, RECORD_MAGIC, RECORD_MAGIC_LENGTH);
+    unsigned char *p = putVarint(buffer + length + RECORD_MAGIC_LENGTH,
+                                 (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+    if(length == 0)
+        pendingSinceMs = nowMs;
+    length = p - buffer;
+    lastMs = nowMs;
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+void Recorder::put(int kind, long long nowMs, const int *values, int count)
+{
+    pthread_mutex_lock(&mutex);
+    if(fd == -1) {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    if(length + MAX_RECORD_LENGTH > sizeof(buffer))
+        flushLocked();
+    if(length == 0)
+        pendingSinceMs = nowMs;
+
+    unsigned char *p = buffer + length;
+    *p++ = (unsigned char)kind;
+    p = putVarint(p, nowMs > lastMs ? nowMs - lastMs : 0);
+    for(int i = 0; i < count; i++)
+        p = putVarint(p, zigzag(values[i]));
+    length = p - buffer;
+    lastMs = nowMs > lastMs ? nowMs : lastMs;
+
+    // A quiet sensor would otherwise keep the records in memory for hours
+    if(nowMs - pendingSinceMs >= RECORD_FLUSH_MS)
+        flushLocked();
+    pthread_mutex_unlock(&mutex);
+}
+
+void Recorder::sample(long long nowMs, int raw, int filtered, int screen, int kbd)
+{
+    if(fd == -1)
+        return;
+    int values[] = { raw, filtered, screen, kbd };
+    put(RECORD_SAMPLE, nowMs, values, 4);
+}
+
+void Recorder::lid(long long nowMs, int state)
+{
+    if(fd == -1 || state == lastLid)
+        return;
+    lastLid = state;
+    put(RECORD_LID, nowMs, &state, 1);
+}
+
+int Recorder::flush()
+{
+    pthread_mutex_lock(&mutex);
+    int ret = flushLocked();
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+int Recorder::flushLocked()
+{
+    size_t done = 0;
+    while(fd != -1 && done < length) {
+        ssize_t n = write(fd, buffer + done, length - done);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n == -1) {
+            logMessage(LOG_ERR, "Error writing %s, recording stopped: %s", path.c_str(), strerror(errno));
+            close(fd);
+            fd = -1;
+            length = 0;
+            return -1;
+        }
+        done += n;
+    }
+    length = 0;
+    return 0;
+}
+
+/* -= Replay =- */
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    bool error;
+} decoder_t;
+
+static uint64_t getVarint(decoder_t *d)
+{
+    uint64_t v = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        if(d->p >= d->end) {
+            d->error = true;
+            return 0;
+        }
+        unsigned char c = *d->p++;
+        v |= (uint64_t)(c & 0x7F) << shift;
+        if(!(c & 0x80))
+            return v;
+    }
+    d->error = true;
+    return 0;
+}
+
+static void printTime(FILE *out, long long epochMs)
+{
+    time_t t = (time_t)(epochMs / 1000);
+    struct tm tm;
+    char buf[32];
+    localtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(out, "%s.%03d", buf, (int)(epochMs % 1000));
+}
+
+int replayRecording(const char *data, size_t length, const filter_config_t &filter,
+                    const curve_table_t *curve, FILE *out, replay_stats_t *stats)
+{
+    decoder_t d = { (const unsigned char *)data, (const unsigned char *)data + length, false };
+    LightFilter lightFilter;
+    long long startMs = 0, nowMs = 0;
+    int lid = -2;
+    memset(stats, 0, sizeof(*stats));
+
+    while(d.p < d.end && !d.error) {
+        // A new segment: the daemon was restarted, and so is its filter
+        if(*d.p == RECORD_MAGIC[0]) {
+            if(d.end - d.p < RECORD_MAGIC_LENGTH || memcmp(d.p, RECORD_MAGIC, RECORD_MAGIC_LENGTH) != 0)
+                break;
+            d.p += RECORD_MAGIC_LENGTH;
+            startMs = (long long)getVarint(&d);
+            stats->durationMs += nowMs;
+            nowMs = 0;
+            lid = -2;
+            lightFilter.init(filter);
+            stats->segments++;
+            if(out != NULL) {
+                fprintf(out, "# ");
+                printTime(out, startMs);
+                fprintf(out, " recording started\n");
+            }
+            continue;
+        }
+        if(stats->segments == 0)
+            break;
+
+        int kind = *d.p++;
+        nowMs += (long long)getVarint(&d);
+        if(kind == RECORD_LID) {
+            int state = (int)unzigzag(getVarint(&d));
+            if(!d.error && state != lid) {
+                lid = state;
+                stats->lidChanges++;
+            }
+            continue;
+        }
+        if(kind != RECORD_SAMPLE)
+            break;
+
+        int raw = (int)unzigzag(getVarint(&d));
+        int filtered = (int)unzigzag(getVarint(&d));
+        int screen = (int)unzigzag(getVarint(&d));
+        int kbd = (int)unzigzag(getVarint(&d));
+        if(d.error)
+            break;
+        stats->samples++;
+
+        int replayed = lightFilter.update(raw, nowMs);
+        const curve_entry_t *e = curveLookup(curve, replayed);
+        if(e->screen == screen && e->keyboard == kbd)
+            continue;
+        stats->differences++;
+        if(out != NULL) {
+            printTime(out, startMs + nowMs);
+            fprintf(out, " raw=%d recorded: filtered=%d screen=%.2f%% keyboard=%.2f%%"
+                    " replayed: filtered=%d screen=%.2f%% keyboard=%.2f%%\n",
+                    raw, filtered, screen * 100.0 / BRIGHTNESS_ONE, kbd * 100.0 / BRIGHTNESS_ONE,
+                    replayed, e->screen * 100.0 / BRIGHTNESS_ONE, e->keyboard * 100.0 / BRIGHTNESS_ONE);
+        }
+    }
+    stats->durationMs += nowMs;
+
+    if(d.p < d.end || d.error) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "filter.h"
+#include "curve.h"
+using namespace std;
+
+/*
+ * Recordings of what the sensor saw (--record) and their replay (--replay).
+ *
+ * A recording is a sequence of segments, one per daemon start, appended to
+ * the same file. A segment starts with RECORD_MAGIC followed by the wall
+ * clock time (ms since the epoch); then come records made of a kind byte,
+ * the milliseconds elapsed since the previous record and the values, all
+ * as LEB128 varints (values zigzag encoded):
+ *
+ *   RECORD_SAMPLE  raw illuminance, filtered illuminance, screen, keyboard
+ *   RECORD_LID     lid state (see getLidStatus()), only when it changes
+ *
+ * screen and keyboard are the brightness decided for the sample
+ * (BRIGHTNESS_ONE = 100%), before any transition.
+ */
+#define RECORD_MAGIC "ALSREC1\n"
+#define RECORD_MAGIC_LENGTH 8
+
+enum {
+    RECORD_SAMPLE = 1,
+    RECORD_LID
+};
+
+/** Records are written to the file in chunks of this size... */
+#define RECORD_BUFFER_SIZE 65536
+/** ...or when the oldest record waiting has been there this long (ms) */
+#define RECORD_FLUSH_MS 60000
+
+/**
+ * Appends records to a recording. Records are accumulated in memory and
+ * written in large chunks, so the control loop doesn't pay a system call
+ * per sample. Errors stop the recording, they never stop the caller.
+ */
+class Recorder
+{
+public:
+    Recorder();
+    ~Recorder();
+
+    /**
+     * Opens \a path for appending and starts a new segment.
+     * \retval 0 if ok, -1 on error (sets errno)
+     */
+    int open(const string &path, long long nowMs);
+    bool isOpen() const { return fd != -1; }
+
+    void sample(long long nowMs, int raw, int filtered, int screen, int kbd);
+    /** Records \a state if it differs from the last one recorded */
+    void lid(long long nowMs, int state);
+    /** Writes the records accumulated so far. Can be called from any thread. */
+    int flush();
+
+private:
+    Recorder(const Recorder &);
+    Recorder &operator=(const Recorder &);
+
+    pthread_mutex_t mutex;
+    int fd;
+    string path;
+    unsigned char buffer[RECORD_BUFFER_SIZE];
+    size_t length;
+    long long lastMs;
+    /** when the first record of the buffer was added */
+    long long pendingSinceMs;
+    int lastLid;
+
+    void put(int kind, long long nowMs, const int *values, int count);
+    int flushLocked();
+};
+
+/** What replayRecording() went through */
+typedef struct {
+    uint64_t segments;
+    uint64_t samples;
+    uint64_t lidChanges;
+    /** samples whose replayed brightness differs from the recorded one */
+    uint64_t differences;
+    /** time covered by the recording (ms) */
+    long long durationMs;
+} replay_stats_t;
+
+/**
+ * Feeds the samples of a recording through a LightFilter configured with
+ * \a filter and through \a curve, on a virtual clock that follows the
+ * recorded times, and compares the brightness decided with the recorded
+ * one. Every difference is printed to \a out (unless NULL).
+ * \retval 0 if the whole recording was replayed, -1 if it's invalid or
+ *         truncated (sets errno; \a stats covers what came before)
+ */
+int replayRecording(const char *data, size_t length, const filter_config_t &filter,
+                    const curve_table_t *curve, FILE *out, replay_stats_t *stats);
+
+#endif // RECORD_H
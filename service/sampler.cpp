@@ -0,0 +1,107 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/prctl.h>
+#include "sampler.h"
+#include "logger.h"
+
+AdaptiveSampler::AdaptiveSampler()
+{
+    sampler_config_t defaults = { 250, 8000, 2, 10 };
+    init(defaults);
+}
+
+void AdaptiveSampler::init(const sampler_config_t &config)
+{
+    this->config = config;
+    if(this->config.minIntervalMs < 1)
+        this->config.minIntervalMs = 1;
+    if(this->config.minIntervalMs > SAMPLER_MAX_INTERVAL_MS)
+        this->config.minIntervalMs = SAMPLER_MAX_INTERVAL_MS;
+    if(this->config.maxIntervalMs > SAMPLER_MAX_INTERVAL_MS)
+        this->config.maxIntervalMs = SAMPLER_MAX_INTERVAL_MS;
+    if(this->config.maxIntervalMs < this->config.minIntervalMs)
+        this->config.maxIntervalMs = this->config.minIntervalMs;
+
+    intervalMs = this->config.minIntervalMs;
+    lastPercent = -1;
+    startNs = metricsClockNs();
+    lastSampleNs = 0;
+    lastWakeNs = 0;
+    lastWakeNotified = false;
+    slackNs = -1;
+    wakeups = samples = changes = 0;
+    memset(&reactionTime, 0, sizeof(reactionTime));
+}
+
+void AdaptiveSampler::onWakeup(bool notified)
+{
+    __sync_fetch_and_add(&wakeups, 1);
+    lastWakeNs = metricsClockNs();
+    lastWakeNotified = notified;
+}
+
+bool AdaptiveSampler::onSample(int percent)
+{
+    int64_t now = metricsClockNs();
+    bool changed = lastPercent != -1 && abs(percent - lastPercent) > config.changeThreshold;
+
+    if(changed) {
+        int64_t since = lastWakeNotified ? lastWakeNs : lastSampleNs;
+        histogramRecord(&reactionTime, now - since);
+        __sync_fetch_and_add(&changes, 1);
+        intervalMs = config.minIntervalMs;
+    } else if(lastPercent != -1) {
+        int64_t doubled = (int64_t)intervalMs * 2;
+        intervalMs = doubled > config.maxIntervalMs ? config.maxIntervalMs : (int)doubled;
+    }
+
+    // Small fluctuations don't move the reference, or a slow drift would never count
+    if(lastPercent == -1 || changed)
+        lastPercent = percent;
+    lastSampleNs = now;
+    __sync_fetch_and_add(&samples, 1);
+    return changed;
+}
+
+void AdaptiveSampler::applySlack()
+{
+    int64_t slack = (int64_t)intervalMs * config.slackPercent * 10000;
+    if(slack < 50000)
+        slack = 50000; // the kernel default
+    if(slack > LONG_MAX)
+        slack = LONG_MAX;
+    if(slack == slackNs)
+        return;
+    if(prctl(PR_SET_TIMERSLACK, (long)slack, 0, 0, 0) == -1)
+        logMessage(LOG_WARNING, "Cannot set the timer slack");
+    slackNs = (long)slack;
+}
+
+sampler_stats_t AdaptiveSampler::getStats() const
+{
+    sampler_stats_t stats;
+    stats.wakeups = __atomic_load_n(&wakeups, __ATOMIC_RELAXED);
+    stats.samples = __atomic_load_n(&samples, __ATOMIC_RELAXED);
+    stats.changes = __atomic_load_n(&changes, __ATOMIC_RELAXED);
+    stats.intervalMs = intervalMs;
+    double hours = (metricsClockNs() - startNs) / 3.6e12;
+    stats.wakeupsPerHour = hours > 0 ? stats.wakeups / hours : 0;
+    histogramRead(&reactionTime, &stats.reactionTime);
+    return stats;
+}
@@ -0,0 +1,84 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+#include "metrics.h"
+
+/** Longest sampling interval accepted (ms): an hour */
+#define SAMPLER_MAX_INTERVAL_MS (3600 * 1000)
+
+/** Parameters of an AdaptiveSampler */
+typedef struct {
+    /** interval right after a change of light (ms) */
+    int minIntervalMs;
+    /** ceiling reached while the light stays stable, at most
+        SAMPLER_MAX_INTERVAL_MS (ms) */
+    int maxIntervalMs;
+    /** a reading farther than this from the previous one is a change (percent points) */
+    int changeThreshold;
+    /** timer slack granted to the wait, as a percentage of the interval */
+    int slackPercent;
+} sampler_config_t;
+
+/** Counters collected by an AdaptiveSampler */
+typedef struct {
+    /** times the control loop woke up, for any reason */
+    uint64_t wakeups;
+    uint64_t samples;
+    uint64_t changes;
+    /** current interval (ms) */
+    int intervalMs;
+    /** wakeups per hour since init() */
+    double wakeupsPerHour;
+    /**
+     * For each change: the time from the wakeup to the sample if the
+     * driver notified it, otherwise the time since the previous sample,
+     * i.e. the longest the change may have gone unnoticed.
+     */
+    histogram_t reactionTime;
+} sampler_stats_t;
+
+/**
+ * Chooses how long the control loop sleeps between two samples when the
+ * sensor driver doesn't notify changes. After a change the interval drops
+ * to minIntervalMs, then it doubles at every stable reading up to
+ * maxIntervalMs. The longer the interval, the more timer slack the thread
+ * gets (PR_SET_TIMERSLACK), so that the kernel can coalesce our wakeup
+ * with others.
+ */
+class AdaptiveSampler
+{
+public:
+    AdaptiveSampler();
+
+    void init(const sampler_config_t &config);
+
+    /** Called every time the loop wakes up; \a notified if the driver woke it */
+    void onWakeup(bool notified);
+    /** Called with every reading (0-100). \retval true if the light changed */
+    bool onSample(int percent);
+
+    /** Time to sleep before the next sample (ms) */
+    int getIntervalMs() const { return intervalMs; }
+    /** Sets the timer slack of the calling thread for the current interval */
+    void applySlack();
+
+    sampler_stats_t getStats() const;
+
+private:
+    sampler_config_t config;
+    int intervalMs;
+    int lastPercent;
+    int64_t startNs;
+    int64_t lastSampleNs;
+    int64_t lastWakeNs;
+    bool lastWakeNotified;
+    /** slack currently set, -1 if never set */
+    long slackNs;
+    uint64_t wakeups;
+    uint64_t samples;
+    uint64_t changes;
+    histogram_t reactionTime;
+};
+
+#endif // SAMPLER_H
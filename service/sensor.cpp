@@ -0,0 +1,151 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <string>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "sensor.h"
+#include "attribute.h"
+#include "iio.h"
+
+using namespace std;
+
+const string ALI_PATH = "/sys/bus/acpi/devices/ACPI0008:00/ali";
+const string ALS_ENABLE_PATH = "/sys/bus/acpi/devices/ACPI0008:00/enable";
+const string IIO_DEVICES_PATH = "/sys/bus/iio/devices";
+const string IIO_DEV_PATH = "/dev";
+
+/** The ACPI0008 device of the als module (Asus Zenbooks) */
+class AcpiSensor : public LightSensor
+{
+public:
+    AcpiSensor() { inotifyFd = -1; }
+    ~AcpiSensor();
+
+    int open(const string &root);
+
+    const char *getType() const { return "acpi"; }
+    string getPath() const { return ali.getPath(); }
+    int enable(bool enable) { return alsEnable.writeInt(enable ? 1 : 0); }
+    int read(int *value);
+    int getPollFds(struct pollfd *fds);
+    bool onPoll(const struct pollfd *fds, int nfds);
+
+private:
+    Attribute ali;
+    Attribute alsEnable;
+    /** inotify instance watching the ali file (only useful on a fake tree) */
+    int inotifyFd;
+};
+
+AcpiSensor::~AcpiSensor()
+{
+    if(inotifyFd != -1)
+        close(inotifyFd);
+}
+
+int AcpiSensor::open(const string &root)
+{
+    if(alsEnable.open(root + ALS_ENABLE_PATH, O_WRONLY) == -1 || ali.open(root + ALI_PATH, O_RDONLY) == -1)
+        return -1;
+
+    // sysfs only reports POLLPRI after the attribute has been read once
+    char buf[100];
+    ali.read(buf, sizeof(buf));
+
+    // A regular file never reports POLLPRI, so a fake attribute written by
+    // a test or simulator is watched through inotify instead.
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotifyFd != -1 &&
+            inotify_add_watch(inotifyFd, ali.getPath().c_str(), IN_MODIFY | IN_CLOSE_WRITE) == -1) {
+        close(inotifyFd);
+        inotifyFd = -1;
+    }
+    return 0;
+}
+
+int AcpiSensor::read(int *value)
+{
+    char str[100];
+    if(ali.read(str, sizeof(str)) == -1)
+        return -1;
+    *value = atoi(str);
+    return 0;
+}
+
+int AcpiSensor::getPollFds(struct pollfd *fds)
+{
+    int n = 0;
+    if(ali.isOpen()) {
+        fds[n].fd = ali.getFd();
+        fds[n].events = POLLPRI | POLLERR;
+        n++;
+    }
+    if(inotifyFd != -1) {
+        fds[n].fd = inotifyFd;
+        fds[n].events = POLLIN;
+        n++;
+    }
+    return n;
+}
+
+bool AcpiSensor::onPoll(const struct pollfd *fds, int nfds)
+{
+    bool changed = false;
+    char buf[4096];
+    for(int i = 0; i < nfds; i++) {
+        if(fds[i].revents == 0)
+            continue;
+        changed = true;
+        if(fds[i].fd == ali.getFd()) {
+            // Re-arm the notification
+            ali.read(buf, sizeof(buf));
+        } else {
+            while(::read(inotifyFd, buf, sizeof(buf)) > 0);
+        }
+    }
+    return changed;
+}
+
+LightSensor *openLightSensor(const string &type, const string &root, string *error)
+{
+    if(type == "acpi" || (type == "auto" && access((root + ALI_PATH).c_str(), F_OK) == 0)) {
+        AcpiSensor *acpi = new AcpiSensor();
+        if(acpi->open(root) == 0)
+            return acpi;
+        *error = "cannot open " + root + ALI_PATH;
+        delete acpi;
+        return NULL;
+    }
+
+    if(type == "iio" || type == "auto") {
+        IioSensor *iio = new IioSensor();
+        if(iio->open(root + IIO_DEVICES_PATH, root + IIO_DEV_PATH) == 0)
+            return iio;
+        if(type == "iio")
+            *error = "no IIO light sensor in " + root + IIO_DEVICES_PATH;
+        else
+            *error = "neither " + root + ALI_PATH + " nor an IIO light sensor in " + root + IIO_DEVICES_PATH;
+        delete iio;
+        return NULL;
+    }
+
+    *error = "unknown sensor type " + type;
+    errno = EINVAL;
+    return NULL;
+}
@@ -0,0 +1,51 @@
+#ifndef SENSOR_H
+#define SENSOR_H
+
+#include <string>
+#include <poll.h>
+using namespace std;
+
+/** Most descriptors a LightSensor asks to poll */
+#define SENSOR_MAX_FDS 2
+
+/**
+ * An ambient light sensor. The control loop reads it every time it wakes
+ * up, and polls the descriptors it provides to wake up when the light
+ * changes. A sensor without notifications provides none, and is sampled
+ * at the pace chosen by the AdaptiveSampler.
+ *
+ * All the methods returning int return -1 on error and set errno.
+ */
+class LightSensor
+{
+public:
+    virtual ~LightSensor() {}
+
+    /** "acpi" or "iio" */
+    virtual const char *getType() const = 0;
+    /** What the sensor reads from, for the logs */
+    virtual string getPath() const = 0;
+
+    /** Powers the sensor (or its stream of samples) on or off */
+    virtual int enable(bool enable) = 0;
+    /** Latest illuminance: raw units of the sensor for ACPI0008, lux for IIO */
+    virtual int read(int *value) = 0;
+
+    /** Fills \a fds with the descriptors to poll, returns how many (at most SENSOR_MAX_FDS) */
+    virtual int getPollFds(struct pollfd *fds) = 0;
+    /**
+     * Called after poll() with the entries filled by getPollFds().
+     * Returns true if the light may have changed.
+     */
+    virtual bool onPoll(const struct pollfd *fds, int nfds) = 0;
+};
+
+/**
+ * Opens the sensor of type \a type under the tree \a root: "acpi" for the
+ * ACPI0008 device of the als module, "iio" for the first IIO light sensor,
+ * "auto" for the first of the two that exists.
+ * \retval NULL if there is no such sensor (\a error says why)
+ */
+LightSensor *openLightSensor(const string &type, const string &root, string *error);
+
+#endif // SENSOR_H
@@ -0,0 +1,549 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include "server.h"
+#include "logger.h"
+
+using namespace std;
+
+/** Events handled by a single epoll_wait() call */
+#define MAX_EVENTS 64
+/** Events are moved to the output of a subscriber only while it has less
+ *  than this many bytes waiting to be sent */
+#define SUBSCRIBER_BUFFER_LIMIT 512
+/** A connection with more than this waiting to be sent is dropped. Only one
+ *  reply is queued at a time, and the largest one (a full trace) is a few
+ *  hundred KB. */
+#define CONNECTION_BUFFER_LIMIT (4 * 1024 * 1024)
+
+static int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if(flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+IPCServer::IPCServer()
+{
+    listenFd = -1;
+    epollFd = -1;
+    wakeFd = -1;
+    stopTimeoutMs = -1;
+    handler = NULL;
+    subscribers = 0;
+    coalesced = 0;
+    maxMessageLength = getMaxMessageLength();
+    memset(&msgStats, 0, sizeof(msgStats));
+    memset(&acceptToReply, 0, sizeof(acceptToReply));
+    knownMask = dirtyMask = 0;
+    memset(latest, 0, sizeof(latest));
+    pthread_mutex_init(&eventsMtx, NULL);
+}
+
+IPCServer::~IPCServer()
+{
+    close();
+    pthread_mutex_destroy(&eventsMtx);
+}
+
+int IPCServer::open(string path, request_handler_t handler)
+{
+    this->path = path;
+    this->handler = handler;
+
+    // An abstract socket has no file to remove, and no permissions either
+    bool abstract = isAbstractSocket(path.c_str());
+    if(!abstract)
+        unlink(path.c_str());
+    listenFd = createServerChannel((char *)path.c_str());
+    if(listenFd == -1)
+        return -1;
+
+    int tmp_errno;
+    // Permessi 666 sulla socket
+    if((!abstract && chmod(path.c_str(), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH) != 0) ||
+            setNonBlocking(listenFd) == -1) {
+        tmp_errno = errno;
+        close();
+        errno = tmp_errno;
+        return -1;
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev, wakeEv;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL identifies the listening socket
+    wakeEv.events = EPOLLIN;
+    wakeEv.data.ptr = &wakeFd;
+    if(epollFd == -1 || wakeFd == -1 ||
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev) == -1 ||
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &wakeEv) == -1) {
+        tmp_errno = errno;
+        close();
+        errno = tmp_errno;
+        return -1;
+    }
+
+    // Whatever was published so far reaches the subscribers as initial state
+    pthread_mutex_lock(&eventsMtx);
+    dirtyMask = 0;
+    pthread_mutex_unlock(&eventsMtx);
+
+    return 0;
+}
+
+void IPCServer::close()
+{
+    while(!connections.empty())
+        drop(connections.begin()->second);
+    releaseDropped();
+
+    if(listenFd >= 0) {
+        closeServerChannel((char *)path.c_str(), listenFd);
+        listenFd = -1;
+    }
+    if(epollFd >= 0) {
+        ::close(epollFd);
+        epollFd = -1;
+    }
+    if(wakeFd >= 0) {
+        ::close(wakeFd);
+        wakeFd = -1;
+    }
+}
+
+void IPCServer::run()
+{
+    struct epoll_event events[MAX_EVENTS];
+    bool draining = false;
+    int64_t deadlineNs = 0;
+
+    while(1) {
+        int timeout = -1;
+        if(draining) {
+            int64_t left = deadlineNs - metricsClockNs();
+            if(left <= 0 || isDrained())
+                return;
+            timeout = (int)((left + 999999) / 1000000);
+        }
+
+        int n = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            logMessage(LOG_ERR, "Error waiting for client events.");
+            return;
+        }
+
+        for(int i = 0; i < n; i++) {
+            if(events[i].data.ptr == NULL) {
+                acceptAll();
+                continue;
+            }
+            if(events[i].data.ptr == &wakeFd) {
+                dispatchEvents();
+                int stop = __atomic_load_n(&stopTimeoutMs, __ATOMIC_ACQUIRE);
+                if(stop >= 0 && !draining) {
+                    draining = true;
+                    deadlineNs = metricsClockNs() + stop * 1000000LL;
+                    startDraining();
+                }
+                continue;
+            }
+
+            connection_t *c = (connection_t *)events[i].data.ptr;
+            if(c->fd == -1)
+                continue; // dropped earlier in this batch
+
+            if(events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                drop(c);
+                continue;
+            }
+            bool readable = events[i].events & EPOLLIN;
+            if(events[i].events & EPOLLOUT) {
+                if(flush(c) == -1) {
+                    drop(c);
+                    continue;
+                }
+                // Reading stopped while replies were waiting: the next
+                // requests may already be in the reader, not in the socket
+                readable = readable || c->out.empty();
+            }
+            if(readable)
+                onReadable(c);
+        }
+
+        releaseDropped();
+    }
+}
+
+void IPCServer::acceptAll()
+{
+    while(1) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd == -1) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                logMessage(LOG_ERR, "Error accepting client connection.");
+            return;
+        }
+
+        connection_t *c = new connection_t;
+        c->fd = fd;
+        c->waitingOut = false;
+        c->subscribed = false;
+        c->acceptedNs = metricsClockNs();
+        c->pendingMask = 0;
+        initMessageReader(&c->reader);
+        c->reader.maxLength = maxMessageLength;
+        c->reader.stats = &msgStats;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if(epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            logMessage(LOG_ERR, "Error accepting client connection.");
+            closeConnection(fd);
+            delete c;
+            continue;
+        }
+        connections[fd] = c;
+    }
+}
+
+void IPCServer::onReadable(connection_t *c)
+{
+    message_t msg;
+    int fd = c->fd;
+    int ret = 0;
+
+    // A peer that doesn't read its replies gets no more of them: its
+    // requests wait in the socket until the output has been sent
+    while(c->out.empty() && (ret = readMessageNB(fd, &c->reader, &msg)) == 1) {
+        handler(*this, fd, &msg);
+        releaseMessage(&c->reader, &msg);
+        // A failed reply drops the connection
+        if(c->fd == -1)
+            return;
+    }
+
+    if(ret == -1) {
+        if(errno == EMSGSIZE)
+            logMessage(LOG_WARNING, "Dropping client: message of %u bytes exceeds the %u bytes limit.",
+                       c->reader.length, c->reader.maxLength);
+        else if(errno != ENOTCONN)
+            logMessage(LOG_ERR, "Error receiving message from client.");
+        drop(c);
+    }
+}
+
+void IPCServer::stop(int timeoutMs)
+{
+    __atomic_store_n(&stopTimeoutMs, timeoutMs, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if(wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        logMessage(LOG_ERR, "Error waking up the IPC server.");
+}
+
+/** No new connections; requests already in the sockets are answered now */
+void IPCServer::startDraining()
+{
+    if(listenFd >= 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, listenFd, NULL);
+        closeServerChannel((char *)path.c_str(), listenFd);
+        listenFd = -1;
+    }
+
+    vector<connection_t *> all;
+    for(map<int, connection_t *>::iterator it = connections.begin(); it != connections.end(); ++it)
+        all.push_back(it->second);
+    for(size_t i = 0; i < all.size(); i++) {
+        if(all[i]->fd != -1)
+            onReadable(all[i]);
+    }
+    releaseDropped();
+}
+
+/** true when every reply has left */
+bool IPCServer::isDrained() const
+{
+    for(map<int, connection_t *>::const_iterator it = connections.begin(); it != connections.end(); ++it) {
+        if(!it->second->out.empty())
+            return false;
+    }
+    return true;
+}
+
+int IPCServer::send(int conn, message_t *msg)
+{
+    map<int, connection_t *>::iterator it = connections.find(conn);
+    if(it == connections.end()) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    connection_t *c = it->second;
+
+    char header[MSG_HEADER_LEN];
+    int hlen = packHeader(msg, c->reader.framing, header);
+    if(hlen == -1)
+        return -1;
+
+    if(c->acceptedNs != 0) {
+        histogramRecord(&acceptToReply, metricsClockNs() - c->acceptedNs);
+        c->acceptedNs = 0;
+    }
+
+    size_t sent = 0, total = hlen + msg->length;
+    if(c->out.empty()) {
+        // Usual case: header and payload go straight from here to the socket
+        struct iovec iov[2];
+        struct msghdr mh;
+        iov[0].iov_base = header;
+        iov[0].iov_len = hlen;
+        iov[1].iov_base = msg->buffer;
+        iov[1].iov_len = msg->length;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = msg->length > 0 ? 2 : 1;
+
+        ssize_t n;
+        do {
+            n = sendmsg(c->fd, &mh, MSG_NOSIGNAL);
+        } while(n == -1 && errno == EINTR);
+        if(n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            drop(c);
+            errno = ENOTCONN;
+            return -1;
+        }
+        if(n > 0)
+            sent = n;
+    }
+
+    if(c->out.size() + (total - sent) > CONNECTION_BUFFER_LIMIT) {
+        logMessage(LOG_WARNING, "Dropping client: %zu bytes of replies not read.", c->out.size() + (total - sent));
+        drop(c);
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    // Only what the socket didn't take is copied
+    if(sent < (size_t)hlen) {
+        c->out.append(header + sent, hlen - sent);
+        sent = hlen;
+    }
+    if(sent < total)
+        c->out.append(msg->buffer + (sent - hlen), total - sent);
+
+    if(flush(c) == -1) {
+        drop(c);
+        errno = ENOTCONN;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes as much pending output as the socket accepts. While something is
+ * left, epoll reports EPOLLOUT instead of EPOLLIN: requests aren't read
+ * until the replies have gone.
+ */
+int IPCServer::flush(connection_t *c)
+{
+    while(1) {
+        fillEvents(c);
+        if(c->out.empty())
+            break;
+
+        ssize_t n = ::send(c->fd, c->out.data(), c->out.size(), MSG_NOSIGNAL);
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        c->out.erase(0, n);
+    }
+
+    bool wantOut = !c->out.empty();
+    if(wantOut != c->waitingOut) {
+        struct epoll_event ev;
+        ev.events = wantOut ? EPOLLOUT : EPOLLIN;
+        ev.data.ptr = c;
+        if(epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+            return -1;
+        c->waitingOut = wantOut;
+    }
+    return 0;
+}
+
+int IPCServer::subscribe(int conn)
+{
+    map<int, connection_t *>::iterator it = connections.find(conn);
+    if(it == connections.end()) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    connection_t *c = it->second;
+
+    if(!c->subscribed) {
+        c->subscribed = true;
+        subscribers++;
+    }
+
+    pthread_mutex_lock(&eventsMtx);
+    for(int k = 0; k < EVENT_KINDS; k++)
+        c->pending[k] = latest[k];
+    c->pendingMask = knownMask;
+    pthread_mutex_unlock(&eventsMtx);
+
+    if(flush(c) == -1) {
+        drop(c);
+        errno = ENOTCONN;
+        return -1;
+    }
+    return 0;
+}
+
+msgstats_t IPCServer::getMessageStats() const
+{
+    // Counted by the IPC thread, read by the others
+    msgstats_t s;
+    s.oversize = __atomic_load_n(&msgStats.oversize, __ATOMIC_RELAXED);
+    s.poolHits = __atomic_load_n(&msgStats.poolHits, __ATOMIC_RELAXED);
+    s.poolMisses = __atomic_load_n(&msgStats.poolMisses, __ATOMIC_RELAXED);
+    return s;
+}
+
+void IPCServer::publish(int kind, int value)
+{
+    if(kind < 0 || kind >= EVENT_KINDS)
+        return;
+
+    unsigned int bit = 1u << kind;
+    bool wake = false;
+
+    pthread_mutex_lock(&eventsMtx);
+    if(!(knownMask & bit) || latest[kind] != value) {
+        latest[kind] = value;
+        knownMask |= bit;
+        wake = dirtyMask == 0;
+        dirtyMask |= bit;
+    }
+    pthread_mutex_unlock(&eventsMtx);
+
+    // One wakeup is enough for any number of events published before
+    // run() gets to them
+    if(wake && wakeFd >= 0) {
+        uint64_t one = 1;
+        if(write(wakeFd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            logMessage(LOG_ERR, "Error waking up the IPC server.");
+    }
+}
+
+/** Hands the events published since the last call to every subscriber */
+void IPCServer::dispatchEvents()
+{
+    uint64_t count;
+    if(read(wakeFd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        return;
+
+    int values[EVENT_KINDS];
+    pthread_mutex_lock(&eventsMtx);
+    unsigned int dirty = dirtyMask;
+    memcpy(values, latest, sizeof(values));
+    dirtyMask = 0;
+    pthread_mutex_unlock(&eventsMtx);
+
+    if(dirty == 0 || subscribers == 0)
+        return;
+
+    vector<connection_t *> targets;
+    for(map<int, connection_t *>::iterator it = connections.begin(); it != connections.end(); ++it) {
+        if(it->second->subscribed)
+            targets.push_back(it->second);
+    }
+
+    for(size_t i = 0; i < targets.size(); i++) {
+        connection_t *c = targets[i];
+        for(int k = 0; k < EVENT_KINDS; k++) {
+            unsigned int bit = 1u << k;
+            if(!(dirty & bit))
+                continue;
+            if(c->pendingMask & bit)
+                __sync_fetch_and_add(&coalesced, 1);
+            c->pending[k] = values[k];
+            c->pendingMask |= bit;
+        }
+        if(flush(c) == -1)
+            drop(c);
+    }
+}
+
+/** Moves pending events to the output buffer, as long as it has room */
+void IPCServer::fillEvents(connection_t *c)
+{
+    for(int k = 0; k < EVENT_KINDS && c->pendingMask != 0; k++) {
+        unsigned int bit = 1u << k;
+        if(!(c->pendingMask & bit))
+            continue;
+        if(c->out.size() >= SUBSCRIBER_BUFFER_LIMIT)
+            return;
+
+        char payload[EVENT_PAYLOAD_LEN];
+        char packed[MSG_HEADER_LEN + EVENT_PAYLOAD_LEN];
+        message_t msg;
+        msg.type = MSG_EVENT;
+        msg.id = 0;
+        msg.length = EVENT_PAYLOAD_LEN;
+        msg.buffer = payload;
+        packEvent(k, c->pending[k], payload);
+        int len = packMessage(&msg, c->reader.framing, packed, sizeof(packed));
+        c->out.append(packed, len);
+        c->pendingMask &= ~bit;
+    }
+}
+
+void IPCServer::drop(connection_t *c)
+{
+    if(c->subscribed)
+        subscribers--;
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, c->fd, NULL);
+    connections.erase(c->fd);
+    closeConnection(c->fd);
+    // Other events of the current batch may still point to c
+    c->fd = -1;
+    dropped.push_back(c);
+}
+
+void IPCServer::releaseDropped()
+{
+    for(size_t i = 0; i < dropped.size(); i++) {
+        // Freed only now: the handler may still be using its receive buffer
+        resetMessageReader(&dropped[i]->reader);
+        delete dropped[i];
+    }
+    dropped.clear();
+}
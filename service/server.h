@@ -0,0 +1,147 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include "comsock.h"
+#include "events.h"
+#include "metrics.h"
+using namespace std;
+
+class IPCServer;
+
+/**
+ * Called for every complete message received on connection \a conn.
+ * msg->buffer is only valid during the call: the server reuses it for the
+ * next message. Replies are queued with IPCServer::send().
+ */
+typedef void (*request_handler_t)(IPCServer &server, int conn, message_t *msg);
+
+/**
+ * Serves the control socket from a single thread with epoll.
+ *
+ * All the sockets are non-blocking: every connection keeps the state of
+ * the message it is receiving (a msgreader_t) and the bytes it still has
+ * to send, so a slow or partial peer never blocks the others. A
+ * connection can send any number of messages and is closed when the peer
+ * closes its side.
+ *
+ * Connections that subscribed receive the events passed to publish(),
+ * which can be called from any thread. Each subscriber holds at most one
+ * pending event per kind: when it can't keep up, a newer event replaces
+ * the pending one of the same kind (counted by getCoalescedEvents()), so
+ * neither its memory nor the publisher's time grows with its backlog.
+ *
+ * The socket is world-writable, so a request longer than
+ * setMaxMessageLength() drops the connection before anything is allocated
+ * for it, and the requests of a connection are not read while its replies
+ * wait to be sent: a peer that never reads costs one reply, whatever it
+ * sends. Requests are received in a buffer owned by the connection and
+ * reused, so steady-state traffic doesn't allocate (see getMessageStats()).
+ */
+class IPCServer
+{
+public:
+    IPCServer();
+    ~IPCServer();
+
+    /**
+     * Creates the socket at \a path (removing a stale one) and makes it
+     * accessible to everybody. A \a path starting with
+     * ABSTRACT_SOCKET_PREFIX names a Linux abstract socket instead.
+     * \retval 0 if ok, -1 on error (sets errno)
+     */
+    int open(string path, request_handler_t handler);
+    /** Closes every connection and removes the socket. */
+    void close();
+
+    /** Serves the connections. Returns after stop(), or on error. */
+    void run();
+    /**
+     * Makes run() stop accepting connections (the socket is removed),
+     * answer the requests already received and return once every reply
+     * has been sent, or after \a timeoutMs. Thread-safe.
+     */
+    void stop(int timeoutMs);
+
+    /**
+     * Queues \a msg on connection \a conn; it is sent as soon as the
+     * socket is writable.
+     * \retval 0 if ok, -1 on error (sets errno)
+     */
+    int send(int conn, message_t *msg);
+
+    bool isOpen() const { return listenFd >= 0; }
+    /** Starts streaming events to \a conn, beginning with the current state. */
+    int subscribe(int conn);
+    /** Thread-safe. Publishes \a value for \a kind if it changed. */
+    void publish(int kind, int value);
+
+    /** Longest request payload accepted by the connections opened from now on */
+    void setMaxMessageLength(unsigned int length) { maxMessageLength = length; }
+    /** Oversize requests rejected and receive buffer reuse, over all connections */
+    msgstats_t getMessageStats() const;
+
+    /** Time from accept() to the first reply of each connection */
+    const histogram_t &getAcceptToReply() const { return acceptToReply; }
+
+    int getConnectionCount() const { return (int)connections.size(); }
+    int getSubscriberCount() const { return subscribers; }
+    unsigned long getCoalescedEvents() const { return __atomic_load_n(&coalesced, __ATOMIC_RELAXED); }
+
+private:
+    IPCServer(const IPCServer &);
+    IPCServer &operator=(const IPCServer &);
+
+    typedef struct {
+        int fd;
+        msgreader_t reader;
+        /** bytes not yet accepted by the socket */
+        string out;
+        /** true if EPOLLOUT is currently requested, instead of EPOLLIN */
+        bool waitingOut;
+        bool subscribed;
+        /** when the connection was accepted, 0 once it got its first reply */
+        int64_t acceptedNs;
+        /** events not yet moved to out, one slot per kind */
+        int pending[EVENT_KINDS];
+        unsigned int pendingMask;
+    } connection_t;
+
+    string path;
+    int listenFd;
+    int epollFd;
+    request_handler_t handler;
+    map<int, connection_t *> connections;
+    /** connections closed but not yet freed, see releaseDropped() */
+    vector<connection_t *> dropped;
+    int subscribers;
+    unsigned long coalesced;
+    unsigned int maxMessageLength;
+    msgstats_t msgStats;
+    histogram_t acceptToReply;
+
+    /* State shared with the publishing threads, protected by eventsMtx */
+    pthread_mutex_t eventsMtx;
+    int latest[EVENT_KINDS];
+    unsigned int knownMask;
+    unsigned int dirtyMask;
+    /** eventfd that wakes up run() when something has been published */
+    int wakeFd;
+    /** set by stop(), -1 until then */
+    int stopTimeoutMs;
+
+    void acceptAll();
+    void startDraining();
+    bool isDrained() const;
+    void dispatchEvents();
+    void fillEvents(connection_t *c);
+    void onReadable(connection_t *c);
+    int flush(connection_t *c);
+    void drop(connection_t *c);
+    void releaseDropped();
+};
+
+#endif // SERVER_H
@@ -0,0 +1,262 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/*
+ * als-simulator: builds a fake sysfs/procfs tree for als-controller --root,
+ * drives the ali and lid values from a sequence file and records every
+ * brightness write made by the daemon, with a timestamp. With -i the
+ * sensor is an IIO device instead of the ACPI0008 one.
+ *
+ * Sequence file format, one command per line ('#' starts a comment):
+ *
+ *     <delay ms> ali <raw value>       e.g. "500 ali 0x190" (lux with -i)
+ *     <delay ms> lid open|closed
+ *     <delay ms> run <shell command>   e.g. "0 run ./als-controller -r /tmp/sim -e"
+ *     <delay ms> wait
+ *
+ * Delays are relative to the previous command. The sequence is read from
+ * stdin when no file (or "-") is given, so it can be generated by a script.
+ *
+ * Output, one event per line: "<µs since start> <event> <value>", where the
+ * event is one of ali, lid (inputs) or screen, keyboard, enable (writes).
+ */
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include "faketree.h"
+
+using namespace std;
+
+/** Time given to the daemon to finish its transitions after the last command */
+const int DEFAULT_LINGER_MS = 2000;
+
+typedef struct {
+    string name;
+    string path;
+    int wd;
+    string last;
+} recorded_file_t;
+
+static string g_root;
+static FILE *g_out = stdout;
+static long long g_startUs;
+static int g_inotifyFd = -1;
+static vector<recorded_file_t> g_recorded;
+static vector<pid_t> g_children;
+
+static long long monotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void logEvent(const char *event, const char *value) {
+    fprintf(g_out, "%lld %s %s\n", monotonicUs() - g_startUs, event, value);
+    fflush(g_out);
+}
+
+static string intToString(int value) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", value);
+    return buf;
+}
+
+static void setAli(int value) {
+    setFakeLight(g_root, value);
+    logEvent("ali", intToString(value).c_str());
+}
+
+static void setLid(bool open) {
+    setFakeLid(g_root, open);
+    logEvent("lid", open ? "open" : "closed");
+}
+
+static void watch(string name, string path) {
+    recorded_file_t f;
+    f.name = name;
+    f.path = path;
+    f.wd = inotify_add_watch(g_inotifyFd, path.c_str(), IN_MODIFY);
+    if(f.wd == -1)
+        err(EXIT_FAILURE, "inotify_add_watch %s", path.c_str());
+    g_recorded.push_back(f);
+}
+
+static void recordChanges() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while((len = read(g_inotifyFd, buf, sizeof(buf))) > 0) {
+        for(char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            for(size_t i = 0; i < g_recorded.size(); i++) {
+                recorded_file_t &f = g_recorded[i];
+                if(f.wd != ev->wd)
+                    continue;
+
+                char value[32];
+                int fd = open(f.path.c_str(), O_RDONLY);
+                if(fd == -1)
+                    continue;
+                ssize_t n = read(fd, value, sizeof(value) - 1);
+                close(fd);
+                if(n <= 0)
+                    continue; // caught between truncate and write
+                value[n] = '\0';
+                value[strcspn(value, "\n")] = '\0';
+
+                // Truncate and write generate two events for the same value
+                if(f.last != value) {
+                    f.last = value;
+                    logEvent(f.name.c_str(), value);
+                }
+            }
+        }
+    }
+}
+
+/** Records writes for \a ms milliseconds */
+static void pump(int ms) {
+    long long deadline = monotonicUs() + (long long)ms * 1000;
+    while(1) {
+        long long left = deadline - monotonicUs();
+        if(left <= 0)
+            return;
+        struct pollfd pfd = { g_inotifyFd, POLLIN, 0 };
+        if(poll(&pfd, 1, (int)((left + 999) / 1000)) > 0)
+            recordChanges();
+    }
+}
+
+static void runCommand(string cmd) {
+    pid_t pid = fork();
+    if(pid == -1)
+        err(EXIT_FAILURE, "fork");
+    if(pid == 0) {
+        execl("/bin/sh", "sh", "-c", cmd.c_str(), (char *)NULL);
+        _exit(127);
+    }
+    g_children.push_back(pid);
+    logEvent("run", cmd.c_str());
+}
+
+static void runSequence(FILE *in) {
+    char line[1024];
+    int lineno = 0;
+
+    while(fgets(line, sizeof(line), in) != NULL) {
+        lineno++;
+        line[strcspn(line, "#\n")] = '\0';
+
+        char cmd[32];
+        int delay, consumed;
+        if(sscanf(line, "%d %31s %n", &delay, cmd, &consumed) < 2)
+            continue;
+        char *arg = line + consumed;
+
+        pump(delay);
+
+        if(strcmp(cmd, "ali") == 0) {
+            setAli((int)strtol(arg, NULL, 0));
+        } else if(strcmp(cmd, "lid") == 0) {
+            setLid(strncmp(arg, "closed", 6) != 0);
+        } else if(strcmp(cmd, "run") == 0) {
+            runCommand(arg);
+        } else if(strcmp(cmd, "wait") != 0) {
+            errx(EXIT_FAILURE, "line %d: unknown command \"%s\"", lineno, cmd);
+        }
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s -r ROOT [-i] [-o LOG] [-l LINGER_MS] [SEQUENCE]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int linger = DEFAULT_LINGER_MS;
+    const char *sequence = "-";
+    const char *output = NULL;
+    bool iio = false;
+
+    int opt;
+    while((opt = getopt(argc, argv, "r:io:l:h")) != -1) {
+        switch(opt) {
+        case 'r': g_root = optarg; break;
+        case 'i': iio = true; break;
+        case 'o': output = optarg; break;
+        case 'l': linger = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if(g_root.empty())
+        usage(argv[0]);
+    if(optind < argc)
+        sequence = argv[optind];
+
+    if(output != NULL && (g_out = fopen(output, "w")) == NULL)
+        err(EXIT_FAILURE, "%s", output);
+
+    g_startUs = monotonicUs();
+
+    if(mkdir(g_root.c_str(), 0755) == -1 && errno != EEXIST)
+        err(EXIT_FAILURE, "%s", g_root.c_str());
+    char resolved[PATH_MAX];
+    if(realpath(g_root.c_str(), resolved) == NULL)
+        err(EXIT_FAILURE, "%s", g_root.c_str());
+    g_root = resolved;
+
+    createFakeTree(g_root, iio);
+    logEvent("ali", intToString(0x190).c_str());
+    logEvent("lid", "open");
+
+    g_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(g_inotifyFd == -1)
+        err(EXIT_FAILURE, "inotify_init1");
+    watch("screen", g_root + FAKE_SCREEN_DIR + "brightness");
+    watch("keyboard", g_root + FAKE_KBD_DIR + "brightness");
+    // For IIO, "enable" is the buffer being turned on and off
+    watch("enable", g_root + (iio ? FAKE_IIO_DIR + "buffer/enable" : FAKE_ALS_DIR + "enable"));
+
+    FILE *in = stdin;
+    if(strcmp(sequence, "-") != 0 && (in = fopen(sequence, "r")) == NULL)
+        err(EXIT_FAILURE, "%s", sequence);
+    runSequence(in);
+    pump(linger);
+
+    for(size_t i = 0; i < g_children.size(); i++) {
+        kill(g_children[i], SIGTERM);
+        waitpid(g_children[i], NULL, 0);
+    }
+    recordChanges();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,878 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+/*
+ * als-tests: checks the behaviour of the control loop against a fake sysfs
+ * tree, the same one used by the simulator and the benchmark.
+ *
+ * Every test runs in a process of its own, on a tree of its own, so that
+ * the globals of the controller start afresh. A failed check makes the
+ * process exit with a message. The exit status is 0 if all tests passed.
+ *
+ *   ./als-tests            runs all the tests
+ *   ./als-tests NAME...    runs only these
+ */
+
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include "controller.h"
+#include "faketree.h"
+#include "server.h"
+#include "metrics.h"
+#include "logger.h"
+#include "comsock.h"
+#include "iio.h"
+#include "filter.h"
+#include "curve.h"
+#include "record.h"
+#include "devices.h"
+
+using namespace std;
+
+/** Longest a test may take before it's killed (s) */
+const int TEST_TIMEOUT_S = 30;
+/** Longest wait for something that doesn't depend on a timer of the daemon (ms) */
+const int WAIT_TIMEOUT_MS = 2000;
+/** A notified change must reach the screen within this (ms) */
+const int REACTION_TIMEOUT_MS = 500;
+/** Sampling interval that no test waits for: what happens earlier is
+ *  caused by a notification (ms) */
+const int SLOW_SAMPLING_MS = 20000;
+/** Time given to the loop to finish what it's doing (ms) */
+const int SETTLE_MS = 100;
+/** Length of the window in which an idle loop must not wake up (ms) */
+const int IDLE_WINDOW_MS = 2000;
+/** Requests a client that never reads could send if the daemon took them all */
+const int PIPELINED_REQUESTS = 100000;
+/** Duration of a full-scale screen transition, when a test enables them (ms) */
+const int TRANSITION_MS = 800;
+
+#define CHECK(cond) \
+    do { if(!(cond)) errx(EXIT_FAILURE, "%s:%d: %s", __FILE__, __LINE__, #cond); } while(0)
+#define CHECK_EQUAL(actual, expected) \
+    do { \
+        long long a_ = (actual), e_ = (expected); \
+        if(a_ != e_) \
+            errx(EXIT_FAILURE, "%s:%d: %s is %lld, expected %lld", __FILE__, __LINE__, #actual, a_, e_); \
+    } while(0)
+
+/* -= Helpers =- */
+
+static long long monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** Integer in the file \a path, -1 if it can't be read */
+static int readValue(const string &path) {
+    char value[32];
+    int fd = open(path.c_str(), O_RDONLY);
+    ssize_t n = fd == -1 ? -1 : read(fd, value, sizeof(value) - 1);
+    if(fd != -1)
+        close(fd);
+    if(n <= 0)
+        return -1;
+    value[n] = '\0';
+    return atoi(value);
+}
+
+/** Waits at most \a timeoutMs for the file \a path to hold \a expected */
+static bool waitValue(const string &path, int expected, int timeoutMs) {
+    int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotifyFd == -1 || inotify_add_watch(inotifyFd, path.c_str(), IN_MODIFY) == -1)
+        err(EXIT_FAILURE, "inotify %s", path.c_str());
+
+    long long deadline = monotonicNs() + timeoutMs * 1000000LL;
+    bool found;
+    char buf[4096];
+    while(!(found = readValue(path) == expected)) {
+        long long left = (deadline - monotonicNs()) / 1000000;
+        if(left <= 0)
+            break;
+        struct pollfd pfd = { inotifyFd, POLLIN, 0 };
+        if(poll(&pfd, 1, (int)left) > 0)
+            while(read(inotifyFd, buf, sizeof(buf)) > 0);
+    }
+    close(inotifyFd);
+    return found;
+}
+
+static string screenPath() { return g_root + FAKE_SCREEN_DIR + "brightness"; }
+static string keyboardPath() { return g_root + FAKE_KBD_DIR + "brightness"; }
+
+/** What the screen brightness file holds for the light \a als */
+static int expectedScreen(int als) {
+    int screen, kbd;
+    decideBacklight(als, &screen, &kbd);
+    return (long long)FAKE_SCREEN_MAX * screen / BRIGHTNESS_ONE;
+}
+
+static int expectedKeyboard(int als) {
+    int screen, kbd;
+    decideBacklight(als, &screen, &kbd);
+    return (long long)FAKE_KBD_MAX * kbd / BRIGHTNESS_ONE;
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *) {
+    return remove(path);
+}
+
+static void removeTree(const string &path) {
+    nftw(path.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* -= The control loop, as run by the daemon =- */
+
+static pthread_t g_controlThread;
+/** Never opened: only its counters are read */
+static IPCServer g_metricsServer;
+
+static void *controlThread(void *) {
+    controlLoop();
+    return NULL;
+}
+
+/** Starts the control loop, enabled, and waits until it has applied the initial light */
+static void startLoop() {
+    initControl();
+    setActive(true);
+    if(pthread_create(&g_controlThread, NULL, controlThread, NULL) != 0)
+        errx(EXIT_FAILURE, "Cannot create the control thread");
+    CHECK(waitValue(screenPath(), expectedScreen(0x190), WAIT_TIMEOUT_MS));
+}
+
+static void stopLoop() {
+    requestShutdown();
+    pthread_join(g_controlThread, NULL);
+    shutdownControl();
+}
+
+static uint64_t getWakeups() {
+    metrics_t m;
+    collectMetrics(g_metricsServer, &m);
+    return m.wakeups;
+}
+
+/* -= Tests =- */
+
+/** A change of ali reaches the screen long before the next sample is due */
+static void testNotifyReaction() {
+    g_samplerConfig.minIntervalMs = g_samplerConfig.maxIntervalMs = SLOW_SAMPLING_MS;
+    startLoop();
+
+    setFakeLight(g_root, 0x32);
+    CHECK(waitValue(screenPath(), expectedScreen(0x32), REACTION_TIMEOUT_MS));
+    setFakeLight(g_root, 0x320);
+    CHECK(waitValue(screenPath(), expectedScreen(0x320), REACTION_TIMEOUT_MS));
+    stopLoop();
+}
+
+/** Once the driver has notified, a stable light doesn't wake the loop up */
+static void testNotifyIdle() {
+    startLoop();
+    setFakeLight(g_root, 0x32);
+    CHECK(waitValue(screenPath(), expectedScreen(0x32), REACTION_TIMEOUT_MS));
+    usleep(SETTLE_MS * 1000);
+
+    uint64_t before = getWakeups();
+    usleep(IDLE_WINDOW_MS * 1000);
+    CHECK_EQUAL(getWakeups() - before, 0);
+    stopLoop();
+}
+
+/**
+ * SW_LID events of the input device pause the loop at once (keyboard off,
+ * light changes ignored) and resume it, with the light of the moment
+ */
+static void testLidEvents() {
+    g_samplerConfig.minIntervalMs = g_samplerConfig.maxIntervalMs = SLOW_SAMPLING_MS;
+    startLoop();
+    setFakeLight(g_root, 0x32);
+    CHECK(expectedKeyboard(0x32) > 0);
+    CHECK(waitValue(keyboardPath(), expectedKeyboard(0x32), REACTION_TIMEOUT_MS));
+
+    setFakeLid(g_root, false);
+    CHECK(waitValue(keyboardPath(), 0, REACTION_TIMEOUT_MS));
+    setFakeLight(g_root, 0x320);
+    usleep(SETTLE_MS * 1000);
+    CHECK_EQUAL(readValue(screenPath()), expectedScreen(0x32));
+
+    setFakeLid(g_root, true);
+    CHECK(waitValue(screenPath(), expectedScreen(0x320), REACTION_TIMEOUT_MS));
+
+    // The keyboard comes back too, if it's dark when the lid opens
+    setFakeLid(g_root, false);
+    setFakeLight(g_root, 0x32);
+    usleep(SETTLE_MS * 1000);
+    CHECK_EQUAL(readValue(keyboardPath()), 0);
+    CHECK_EQUAL(readValue(screenPath()), expectedScreen(0x320));
+    setFakeLid(g_root, true);
+    CHECK(waitValue(keyboardPath(), expectedKeyboard(0x32), REACTION_TIMEOUT_MS));
+    CHECK(waitValue(screenPath(), expectedScreen(0x32), REACTION_TIMEOUT_MS));
+    stopLoop();
+}
+
+/** Without a lid switch device, closing the lid is seen through procfs even
+ *  though the sensor notifies */
+static void testLidProcfsFallback() {
+    removeTree(g_root + FAKE_INPUT_DIR);
+    startLoop();
+    setFakeLight(g_root, 0x32);
+    CHECK(waitValue(keyboardPath(), expectedKeyboard(0x32), REACTION_TIMEOUT_MS));
+    CHECK(expectedKeyboard(0x32) > 0);
+
+    setFakeLid(g_root, false);
+    CHECK(waitValue(keyboardPath(), 0, LID_POLL_MS + WAIT_TIMEOUT_MS));
+    stopLoop();
+}
+
+/** A small change of brightness takes a fraction of a full-scale transition */
+static void testTransitionDuration() {
+    g_screenRampConfig.durationMs = TRANSITION_MS;
+    startLoop();
+
+    // 75% to 90% of the range: 15% of TRANSITION_MS
+    long long t0 = monotonicNs();
+    setFakeLight(g_root, 0x258);
+    CHECK(waitValue(screenPath(), expectedScreen(0x258), TRANSITION_MS / 2));
+    CHECK((monotonicNs() - t0) / 1000000 < TRANSITION_MS / 2);
+    stopLoop();
+}
+
+/**
+ * Each stage of the light filter on its own: the median drops a spike, the
+ * moving average smooths a step, the hysteresis band holds small changes
+ * and the dwell time holds a reversal
+ */
+static void testLightFilter() {
+    LightFilter filter;
+    filter_config_t median = { 3, 100, 0, 0, 0, 250 };
+    filter.init(median);
+    CHECK_EQUAL(filter.update(100, 0), 100);
+    CHECK_EQUAL(filter.update(1000, 100), 100);
+    CHECK_EQUAL(filter.update(1000, 200), 1000);
+
+    filter_config_t average = { 1, 25, 0, 0, 0, 250 };
+    filter.init(average);
+    CHECK_EQUAL(filter.update(0, 0), 0);
+    CHECK_EQUAL(filter.update(400, 100), 100);
+    CHECK_EQUAL(filter.update(400, 200), 175);
+    // Still catching up with the input
+    CHECK_EQUAL(filter.nextSampleMs(200), 250);
+
+    filter_config_t hysteresis = { 1, 100, 10, 2, 0, 250 };
+    filter.init(hysteresis);
+    CHECK_EQUAL(filter.update(1000, 0), 1000);
+    CHECK_EQUAL(filter.update(1080, 100), 1000);
+    CHECK_EQUAL(filter.nextSampleMs(100), -1);
+    CHECK_EQUAL(filter.update(1150, 200), 1150);
+    CHECK_EQUAL(filter.getStats().suppressedHysteresis, 1);
+
+    filter_config_t dwell = { 1, 100, 0, 0, 5000, 250 };
+    filter.init(dwell);
+    CHECK_EQUAL(filter.update(100, 0), 100);
+    CHECK_EQUAL(filter.update(200, 1000), 200);
+    CHECK_EQUAL(filter.update(100, 2000), 200);
+    CHECK_EQUAL(filter.nextSampleMs(2000), 4000);
+    // Further in the same direction isn't a reversal
+    CHECK_EQUAL(filter.update(300, 3000), 300);
+    CHECK_EQUAL(filter.update(100, 4000), 300);
+    CHECK_EQUAL(filter.update(100, 8000), 100);
+    CHECK_EQUAL(filter.getStats().suppressedDwell, 2);
+}
+
+/** Parses \a text, which must be rejected with an error starting with \a expected */
+static void checkCurveError(const char *text, const char *expected) {
+    curve_config_t config;
+    string error;
+    errno = 0;
+    if(parseCurve(text, &config, &error) != -1)
+        errx(EXIT_FAILURE, "curve accepted: %s", text);
+    CHECK_EQUAL(errno, EINVAL);
+    if(error.compare(0, strlen(expected), expected) != 0)
+        errx(EXIT_FAILURE, "curve \"%s\" rejected with \"%s\", expected \"%s\"", text, error.c_str(), expected);
+}
+
+/**
+ * Malformed and non-monotonic curves are rejected with the line at fault;
+ * a valid one compiles to the interpolated brightness, read as perceived
+ * lightness with perception cie
+ */
+static void testBrightnessCurve() {
+    checkCurveError("", "no points");
+    checkCurveError("# only a comment\n\n", "no points");
+    checkCurveError("0x32 40\n", "line 1: expected <raw>");
+    checkCurveError("0 10 0\n\nfifty 40 0\n", "line 3: expected <raw>");
+    checkCurveError("0 10 0 # fine\n50 40 0 0\n", "line 2: expected <raw>");
+    checkCurveError("-1 10 0\n", "line 1: raw value out of range");
+    checkCurveError("0 101 0\n", "line 1: brightness must be");
+    checkCurveError("perception sRGB\n0 10 0\n", "line 1: expected perception");
+    checkCurveError("perception gamma 20\n0 10 0\n", "line 1: gamma must be");
+    checkCurveError("100 50 0\n50 60 0\n", "line 2: raw values must be increasing");
+    checkCurveError("0x32 40 100\n50 60 0\n", "line 2: raw values must be increasing");
+
+    curve_config_t config;
+    string error;
+    CHECK(parseCurve("# raw screen keyboard\n0xA 0 100\n110 100 0  # full\n", &config, &error) == 0);
+    CHECK_EQUAL(config.perception, CURVE_LINEAR);
+    CHECK_EQUAL(config.points.size(), 2);
+    CHECK_EQUAL(config.points[0].raw, 10);
+    curve_table_t *table = compileCurve(config);
+    CHECK(table != NULL);
+    CHECK_EQUAL(table->size, 111);
+    // Before the first point and after the last one the curve is flat
+    CHECK_EQUAL(curveLookup(table, -5)->screen, 0);
+    CHECK_EQUAL(curveLookup(table, 5)->keyboard, BRIGHTNESS_ONE);
+    CHECK_EQUAL(curveLookup(table, 60)->screen, BRIGHTNESS_ONE / 2);
+    CHECK_EQUAL(curveLookup(table, 60)->keyboard, BRIGHTNESS_ONE / 2);
+    CHECK_EQUAL(curveLookup(table, 1000)->screen, BRIGHTNESS_ONE);
+    CHECK_EQUAL(curveLookup(table, 1000)->light, 100);
+    freeCurve(table);
+
+    // L* 50 is 18.4% of the light, L* 5 on the linear part near black
+    CHECK(parseCurve("perception cie\n0 0 0\n100 100 100\n", &config, &error) == 0);
+    CHECK_EQUAL(config.perception, CURVE_CIE);
+    table = compileCurve(config);
+    CHECK(table != NULL);
+    CHECK_EQUAL(curveLookup(table, 0)->screen, 0);
+    CHECK_EQUAL(curveLookup(table, 5)->screen, 55);
+    CHECK_EQUAL(curveLookup(table, 50)->screen, 1842);
+    CHECK_EQUAL(curveLookup(table, 50)->keyboard, BRIGHTNESS_ONE / 2);
+    CHECK_EQUAL(curveLookup(table, 100)->screen, BRIGHTNESS_ONE);
+    freeCurve(table);
+}
+
+/** Records \a count samples of a light swinging between \a low and \a high
+ *  as the daemon would, deciding them with \a filter and \a curve */
+static void recordSwings(Recorder &recorder, LightFilter &filter, const curve_table_t *curve,
+                         long long *nowMs, int count, int low, int high) {
+    for(int i = 0; i < count; i++, *nowMs += 700) {
+        int raw = (i / 4) % 2 ? high : low;
+        int filtered = filter.update(raw, *nowMs);
+        const curve_entry_t *e = curveLookup(curve, filtered);
+        recorder.sample(*nowMs, raw, filtered, e->screen, e->keyboard);
+    }
+}
+
+/** Whole content of the file \a path */
+static string readFile(const string &path) {
+    string data;
+    char buf[4096];
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    CHECK(fd != -1);
+    ssize_t n;
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+        data.append(buf, n);
+    close(fd);
+    return data;
+}
+
+/**
+ * A recording of two daemon runs replays without differences with the
+ * options it was made with, and with some with other ones; a truncated
+ * one is replayed up to the last whole record and reported as invalid
+ */
+static void testRecordReplay() {
+    string path = g_root + "/recording";
+    filter_config_t config = { 3, 25, 10, 2, 5000, 250 };
+    curve_table_t *curve = compileCurve(defaultCurve());
+    CHECK(curve != NULL);
+
+    long long nowMs = 0;
+    {
+        Recorder recorder;
+        LightFilter filter;
+        filter.init(config);
+        CHECK(recorder.open(path, nowMs) == 0);
+        recorder.lid(nowMs, 1);
+        recordSwings(recorder, filter, curve, &nowMs, 40, 0x32, 0x258);
+        recorder.lid(nowMs, 0);
+        recorder.lid(nowMs, 0);
+        recorder.lid(nowMs + 1000, 1);
+    }
+    // The daemon restarted: a new segment, a new filter
+    nowMs = 0;
+    {
+        Recorder recorder;
+        LightFilter filter;
+        filter.init(config);
+        CHECK(recorder.open(path, nowMs) == 0);
+        recordSwings(recorder, filter, curve, &nowMs, 20, 0xC8, 0x320);
+    }
+    string data = readFile(path);
+
+    replay_stats_t stats;
+    CHECK(replayRecording(data.data(), data.size(), config, curve, NULL, &stats) == 0);
+    CHECK_EQUAL(stats.segments, 2);
+    CHECK_EQUAL(stats.samples, 60);
+    CHECK_EQUAL(stats.lidChanges, 3);
+    CHECK_EQUAL(stats.differences, 0);
+    CHECK_EQUAL(stats.durationMs, 40 * 700 + 1000 + 19 * 700);
+
+    filter_config_t passThrough = { 1, 100, 0, 0, 0, 1 };
+    CHECK(replayRecording(data.data(), data.size(), passThrough, curve, NULL, &stats) == 0);
+    CHECK(stats.differences > 0);
+
+    // The last sample loses its last byte
+    errno = 0;
+    CHECK(replayRecording(data.data(), data.size() - 1, config, curve, NULL, &stats) == -1);
+    CHECK_EQUAL(errno, EINVAL);
+    CHECK_EQUAL(stats.samples, 59);
+    CHECK_EQUAL(stats.differences, 0);
+
+    // Cut in the middle of the magic of the second segment
+    size_t second = data.find(RECORD_MAGIC, RECORD_MAGIC_LENGTH);
+    CHECK(second != string::npos);
+    CHECK(replayRecording(data.data(), second + 3, config, curve, NULL, &stats) == -1);
+    CHECK_EQUAL(stats.segments, 1);
+    CHECK_EQUAL(stats.samples, 40);
+    freeCurve(curve);
+}
+
+/**
+ * Adds the firmware backlight acpi_video0, with a range of 0-100, to the
+ * fake tree. \return the path of its brightness file
+ */
+static string addFakeBacklight() {
+    // Built aside and moved in, as sysfs adds the whole device at once
+    string staging = g_root + "/acpi_video0/";
+    string device = g_root + "/sys/class/backlight/acpi_video0/";
+    CHECK(mkdir(staging.c_str(), 0755) == 0);
+    writeFakeFile(staging + "type", "firmware\n");
+    writeFakeFile(staging + "max_brightness", "100\n");
+    writeFakeFile(staging + "brightness", "0\n");
+    CHECK(rename(staging.c_str(), device.c_str()) == 0);
+    return device + "brightness";
+}
+
+/** A backlight preferred to the current one takes over when it appears */
+static void testBacklightHotplug() {
+    startLoop();
+    string brightness = addFakeBacklight();
+
+    int screen, kbd;
+    decideBacklight(0x190, &screen, &kbd);
+    CHECK(waitValue(brightness, 100 * screen / BRIGHTNESS_ONE, WAIT_TIMEOUT_MS));
+    stopLoop();
+}
+
+/** The order of preference of the backlights can be changed (--backlights) */
+static void testBacklightPriority() {
+    string firmware = addFakeBacklight();
+    g_backlightPriority.clear();
+    g_backlightPriority.push_back("raw");
+    startLoop();
+
+    // startLoop() has seen the raw one change
+    CHECK_EQUAL(readValue(firmware), 0);
+    stopLoop();
+}
+
+/**
+ * A backlight whose "remove" uevent has come is given up at once, even if
+ * sysfs still shows it, and taken back when it's added again
+ */
+static void testBacklightRemoveUevent() {
+    addFakeBacklight();
+    DeviceRegistry devices;
+    CHECK(devices.init(g_root + "/sys/class/backlight", g_root + "/sys/class/leds",
+                       g_backlightPriority, false) == 0);
+    CHECK(devices.getScreen().name == "acpi_video0");
+
+    const char removal[] = "remove@/devices/LNXSYSTM:00/LNXVIDEO:00/backlight/acpi_video0\0"
+                           "ACTION=remove\0"
+                           "DEVPATH=/devices/LNXSYSTM:00/LNXVIDEO:00/backlight/acpi_video0\0"
+                           "SUBSYSTEM=backlight";
+    CHECK(devices.onUevent(removal, sizeof(removal)));
+    CHECK(devices.getScreen().name == "intel_backlight");
+    CHECK(devices.hasKeyboard());
+
+    const char addition[] = "add@/devices/LNXSYSTM:00/LNXVIDEO:00/backlight/acpi_video0\0"
+                            "ACTION=add\0"
+                            "DEVPATH=/devices/LNXSYSTM:00/LNXVIDEO:00/backlight/acpi_video0\0"
+                            "SUBSYSTEM=backlight";
+    CHECK(devices.onUevent(addition, sizeof(addition)));
+    CHECK(devices.getScreen().name == "acpi_video0");
+}
+
+/** Opens the IIO sensor of the fake tree, which must have a buffer */
+static void openFakeIio(IioSensor *sensor) {
+    CHECK(sensor->open(g_root + "/sys/bus/iio/devices", g_root + "/dev") == 0);
+    CHECK(sensor->isBuffered());
+}
+
+/**
+ * Once the buffer is enabled sysfs is never read (drivers may answer
+ * EBUSY): until a sample is streamed, the value read before enabling it
+ * stands.
+ */
+static void testIioEnable() {
+    IioSensor sensor;
+    openFakeIio(&sensor);
+    string raw = g_root + FAKE_IIO_DIR + "in_illuminance_raw";
+    writeFakeFile(raw, "123\n");
+    CHECK(sensor.enable(true) == 0);
+    CHECK_EQUAL(readValue(g_root + FAKE_IIO_DIR + "buffer/enable"), 1);
+
+    // What a direct read would get, if the driver allowed it
+    writeFakeFile(raw, "999\n");
+    int value;
+    CHECK(sensor.read(&value) == 0);
+    CHECK_EQUAL(value, 123);
+
+    // The same after a suspend and resume
+    CHECK(sensor.enable(false) == 0);
+    CHECK(sensor.enable(true) == 0);
+    writeFakeFile(raw, "123\n");
+    CHECK(sensor.read(&value) == 0);
+    CHECK_EQUAL(value, 999);
+}
+
+/** Writes \a count bytes of scan records to the FIFO standing for the device */
+static void writeScan(const unsigned char *data, size_t count) {
+    string dev = g_root + FAKE_IIO_DEV;
+    int fd = open(dev.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    CHECK(fd != -1);
+    CHECK(write(fd, data, count) == (ssize_t)count);
+    close(fd);
+}
+
+/** Reads the sensor, which must not fail */
+static int readSensor(IioSensor &sensor) {
+    int value;
+    CHECK(sensor.read(&value) == 0);
+    return value;
+}
+
+/**
+ * Scan records streamed through the character device (le:u16 in the fake
+ * tree): whole ones, ones split between two reads, batches of a watermark
+ * drained by a single read(), and the setup of the buffer itself.
+ */
+static void testIioBuffer() {
+    IioSensor sensor;
+    openFakeIio(&sensor);
+    string dir = g_root + FAKE_IIO_DIR;
+    CHECK_EQUAL(readValue(dir + "scan_elements/in_illuminance_en"), 1);
+    CHECK_EQUAL(readValue(dir + "scan_elements/in_timestamp_en"), 0);
+    CHECK_EQUAL(readValue(dir + "buffer/length"), IIO_BUFFER_LENGTH);
+    CHECK_EQUAL(readValue(dir + "buffer/watermark"), IIO_WATERMARK);
+    CHECK(sensor.enable(true) == 0);
+
+    struct pollfd fds[SENSOR_MAX_FDS];
+    CHECK_EQUAL(sensor.getPollFds(fds), 1);
+    CHECK_EQUAL(poll(fds, 1, 0), 0);
+
+    // A record makes the device readable
+    const unsigned char one[] = { 0xF4, 0x01 };
+    writeScan(one, sizeof(one));
+    CHECK_EQUAL(poll(fds, 1, WAIT_TIMEOUT_MS), 1);
+    CHECK(sensor.onPoll(fds, 1));
+    CHECK_EQUAL(readSensor(sensor), 500);
+    CHECK_EQUAL(sensor.getSampleCount(), 1);
+
+    // Half a record is kept until the rest arrives
+    const unsigned char split[] = { 0xBC, 0x02 };
+    writeScan(split, 1);
+    CHECK_EQUAL(readSensor(sensor), 500);
+    writeScan(split + 1, 1);
+    CHECK_EQUAL(readSensor(sensor), 700);
+    CHECK_EQUAL(sensor.getSampleCount(), 2);
+
+    // A watermark of records, and half of the next one, in a single read()
+    unsigned char batch[IIO_WATERMARK * 2 + 1];
+    for(int i = 0; i < IIO_WATERMARK; i++) {
+        batch[2 * i] = (unsigned char)(100 * (i + 1));
+        batch[2 * i + 1] = (unsigned char)((100 * (i + 1)) >> 8);
+    }
+    batch[IIO_WATERMARK * 2] = 0x2C;
+    unsigned long reads = sensor.getReadCount();
+    writeScan(batch, sizeof(batch));
+    CHECK_EQUAL(readSensor(sensor), 100 * IIO_WATERMARK);
+    CHECK_EQUAL(sensor.getReadCount() - reads, 1);
+    CHECK_EQUAL(sensor.getSampleCount(), 2 + IIO_WATERMARK);
+    const unsigned char rest[] = { 0x01 };
+    writeScan(rest, sizeof(rest));
+    CHECK_EQUAL(readSensor(sensor), 300);
+
+    // Nothing new: the device isn't readable, and the last value stands
+    CHECK_EQUAL(readSensor(sensor), 300);
+    CHECK_EQUAL(poll(fds, 1, 0), 0);
+
+    // What was queued while disabled is thrown away
+    CHECK(sensor.enable(false) == 0);
+    writeScan(one, sizeof(one));
+    writeFakeFile(dir + "in_illuminance_raw", "42\n");
+    CHECK(sensor.enable(true) == 0);
+    CHECK_EQUAL(readSensor(sensor), 42);
+}
+
+/** The control loop switches the buffer of the sensor it reads when the
+ *  daemon is disabled and enabled again */
+static void testIioEnableLoop() {
+    string enable = g_root + FAKE_IIO_DIR + "buffer/enable";
+    startLoop();
+    CHECK_EQUAL(readValue(enable), 1);
+
+    setActive(false);
+    CHECK(waitValue(enable, 0, WAIT_TIMEOUT_MS));
+    setActive(true);
+    CHECK(waitValue(enable, 1, WAIT_TIMEOUT_MS));
+    stopLoop();
+    CHECK_EQUAL(readValue(enable), 0);
+}
+
+static void *serverThread(void *server) {
+    ((IPCServer *)server)->run();
+    return NULL;
+}
+
+/**
+ * A client that sends requests without reading the replies is throttled
+ * (its requests stay in the socket), and still gets every reply once it
+ * reads them.
+ */
+static void testIpcBackpressure() {
+    IPCServer server;
+    pthread_t thread;
+    string socket = g_root + SOCKET_PATH;
+    CHECK(server.open(socket, handleRequest) == 0);
+    CHECK(pthread_create(&thread, NULL, serverThread, &server) == 0);
+
+    int fd = openConnectionMs((char *)socket.c_str(), CONNECT_FIRST_DELAY_MS, CONNECT_DEADLINE_MS);
+    CHECK(fd != -1);
+    message_t msg;
+    msg.type = MSG_STATS;
+    msg.id = 1;
+    msg.buffer = NULL;
+    msg.length = 0;
+    char request[MSG_HEADER_LEN];
+    int length = packMessage(&msg, MSG_FRAMING_BINARY, request, sizeof(request));
+    CHECK(length > 0);
+
+    // Without throttling the daemon would take them all, however slowly
+    int sent = 0;
+    while(sent < PIPELINED_REQUESTS) {
+        if(send(fd, request, length, MSG_DONTWAIT | MSG_NOSIGNAL) == length) {
+            sent++;
+            continue;
+        }
+        CHECK(errno == EAGAIN);
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        if(poll(&pfd, 1, SETTLE_MS) == 0)
+            break;
+    }
+    CHECK(sent < PIPELINED_REQUESTS);
+
+    for(int i = 0; i < sent; i++) {
+        CHECK(receiveFrame(fd, &msg, MSG_FRAMING_BINARY) != -1);
+        CHECK_EQUAL(msg.type, MSG_STATS_DATA);
+        freeMessage(&msg, 0);
+    }
+    closeConnection(fd);
+    server.stop(0);
+    pthread_join(thread, NULL);
+}
+
+/** Writes the \a count bytes of \a data to \a fd, which must take them all */
+static void writeBytes(int fd, const char *data, size_t count) {
+    CHECK(write(fd, data, count) == (ssize_t)count);
+}
+
+/**
+ * receiveFrame() parses both framings, and rejects a malformed header or
+ * a length over the maximum before reading the payload; readMessageNB()
+ * does the same, a piece at a time
+ */
+static void testFrameParsing() {
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+    message_t msg;
+
+    const char binary[] = "\xB1" "C" "\x34\x12" "\x03\x00\x00\x00" "abc";
+    writeBytes(fds[1], binary, sizeof(binary) - 1);
+    CHECK_EQUAL(receiveFrame(fds[0], &msg, MSG_FRAMING_BINARY), MSG_BIN_HEADER_LEN + 3);
+    CHECK_EQUAL(msg.type, 'C');
+    CHECK_EQUAL(msg.id, 0x1234);
+    CHECK_EQUAL(msg.length, 3);
+    CHECK(memcmp(msg.buffer, "abc", 3) == 0);
+    freeMessage(&msg, 0);
+
+    writeBytes(fds[1], "D0000000002xy", 13);
+    CHECK_EQUAL(receiveFrame(fds[0], &msg, MSG_FRAMING_ASCII), MSG_HEADER_LEN + 2);
+    CHECK_EQUAL(msg.type, 'D');
+    CHECK_EQUAL(msg.id, 0);
+    CHECK_EQUAL(msg.length, 2);
+    freeMessage(&msg, 0);
+
+    writeBytes(fds[1], "XC\x00\x00\x00\x00\x00\x00", 8);
+    CHECK(receiveFrame(fds[0], &msg, MSG_FRAMING_BINARY) == -1);
+    CHECK_EQUAL(errno, EBADMSG);
+    writeBytes(fds[1], "E00000000x1", MSG_HEADER_LEN);
+    CHECK(receiveFrame(fds[0], &msg, MSG_FRAMING_ASCII) == -1);
+    CHECK_EQUAL(errno, EBADMSG);
+
+    // The payload of a frame too long stays in the socket, one of the
+    // maximum length passes
+    setMaxMessageLength(16);
+    char oversize[MSG_BIN_HEADER_LEN + 17] = "\xB1" "C" "\x00\x00" "\x11\x00\x00\x00";
+    writeBytes(fds[1], oversize, sizeof(oversize));
+    CHECK(receiveFrame(fds[0], &msg, MSG_FRAMING_BINARY) == -1);
+    CHECK_EQUAL(errno, EMSGSIZE);
+    char rest[64];
+    CHECK_EQUAL(recv(fds[0], rest, sizeof(rest), MSG_DONTWAIT), 17);
+    writeBytes(fds[1], "F0000000016", MSG_HEADER_LEN);
+    writeBytes(fds[1], rest, 16);
+    CHECK_EQUAL(receiveFrame(fds[0], &msg, MSG_FRAMING_ASCII), MSG_HEADER_LEN + 16);
+    freeMessage(&msg, 0);
+
+    // Non-blocking: a frame in two pieces, then one too long
+    CHECK(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    msgreader_t reader;
+    msgstats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    initMessageReader(&reader);
+    reader.stats = &stats;
+    writeBytes(fds[1], binary, 6);
+    CHECK_EQUAL(readMessageNB(fds[0], &reader, &msg), 0);
+    writeBytes(fds[1], binary + 6, sizeof(binary) - 1 - 6);
+    CHECK_EQUAL(readMessageNB(fds[0], &reader, &msg), 1);
+    CHECK_EQUAL(msg.id, 0x1234);
+    CHECK(msg.length == 3 && memcmp(msg.buffer, "abc", 3) == 0);
+    releaseMessage(&reader, &msg);
+    writeBytes(fds[1], oversize, MSG_BIN_HEADER_LEN);
+    CHECK(readMessageNB(fds[0], &reader, &msg) == -1);
+    CHECK_EQUAL(errno, EMSGSIZE);
+    CHECK_EQUAL(stats.oversize, 1);
+    resetMessageReader(&reader);
+
+    // A payload cut short by the peer
+    CHECK(fcntl(fds[0], F_SETFL, 0) == 0);
+    writeBytes(fds[1], "G0000000005ab", 13);
+    close(fds[1]);
+    CHECK(receiveFrame(fds[0], &msg, MSG_FRAMING_ASCII) == -1);
+    CHECK_EQUAL(errno, ENOTCONN);
+    close(fds[0]);
+}
+
+typedef struct {
+    const char *name;
+    void (*run)();
+    /** the fake sensor is an IIO device rather than the ACPI one */
+    bool iio;
+} test_t;
+
+static const test_t TESTS[] = {
+    { "notify_reaction", testNotifyReaction, false },
+    { "notify_idle", testNotifyIdle, false },
+    { "lid_events", testLidEvents, false },
+    { "lid_procfs_fallback", testLidProcfsFallback, false },
+    { "transition_duration", testTransitionDuration, false },
+    { "light_filter", testLightFilter, false },
+    { "brightness_curve", testBrightnessCurve, false },
+    { "record_replay", testRecordReplay, false },
+    { "backlight_hotplug", testBacklightHotplug, false },
+    { "backlight_priority", testBacklightPriority, false },
+    { "backlight_remove_uevent", testBacklightRemoveUevent, false },
+    { "ipc_backpressure", testIpcBackpressure, false },
+    { "frame_parsing", testFrameParsing, false },
+    { "iio_enable", testIioEnable, true },
+    { "iio_buffer", testIioBuffer, true },
+    { "iio_enable_loop", testIioEnableLoop, true },
+};
+static const int TEST_COUNT = sizeof(TESTS) / sizeof(TESTS[0]);
+
+/** Runs \a test in a child process on a new tree. \retval true if it passed */
+static bool runTest(const test_t &test) {
+    char tmpl[] = "/tmp/als-tests.XXXXXX";
+    if(mkdtemp(tmpl) == NULL)
+        err(EXIT_FAILURE, "mkdtemp");
+    long long t0 = monotonicNs();
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == -1)
+        err(EXIT_FAILURE, "fork");
+    if(pid == 0) {
+        alarm(TEST_TIMEOUT_S);
+        g_root = tmpl;
+        createFakeTree(g_root, test.iio);
+        g_sensorType = test.iio ? "iio" : "acpi";
+
+        // The daemon's complaints go to stderr too, next to the failure
+        openlog("als-tests", LOG_PID | LOG_PERROR, LOG_USER);
+        setlogmask(LOG_UPTO(LOG_WARNING));
+        if(loggerStart() == -1)
+            err(EXIT_FAILURE, "loggerStart");
+
+        // Changes must reach the brightness in one iteration, unless the
+        // test enables transitions
+        g_screenRampConfig.durationMs = 0;
+        g_kbdRampConfig.durationMs = 0;
+        filter_config_t passThrough = { 1, 100, 0, 0, 0, 1 };
+        g_filterConfig = passThrough;
+
+        test.run();
+        loggerFlush(1000);
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+    while(waitpid(pid, &status, 0) == -1 && errno == EINTR);
+    removeTree(tmpl);
+
+    bool passed = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    if(WIFSIGNALED(status))
+        printf("%s: killed by signal %d%s\n", test.name, WTERMSIG(status),
+               WTERMSIG(status) == SIGALRM ? " (timeout)" : "");
+    printf("%s %s (%lld ms)\n", passed ? "PASS" : "FAIL", test.name, (monotonicNs() - t0) / 1000000);
+    return passed;
+}
+
+int main(int argc, char *argv[])
+{
+    int failed = 0, run = 0;
+    for(int i = 0; i < TEST_COUNT; i++) {
+        bool selected = argc == 1;
+        for(int a = 1; a < argc && !selected; a++)
+            selected = strcmp(argv[a], TESTS[i].name) == 0;
+        if(!selected)
+            continue;
+        run++;
+        if(!runTest(TESTS[i]))
+            failed++;
+    }
+
+    if(run == 0)
+        errx(EXIT_FAILURE, "No such test");
+    printf("%d of %d tests passed\n", run - failed, run);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,243 @@
+/*
+   Copyright 2013-2014 Daniele Di Sarli
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License. */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "trace.h"
+#include "curve.h"
+
+using namespace std;
+
+__thread trace_ring_t *t_traceRing = NULL;
+
+static trace_ring_t *g_rings[TRACE_MAX_THREADS];
+static int g_ringCount = 0;
+/** Shared by the threads that didn't get a ring of their own, never dumped */
+static trace_ring_t g_overflowRing;
+
+trace_ring_t *traceThread(const char *name)
+{
+    if(t_traceRing != NULL) {
+        if(name != NULL && t_traceRing != &g_overflowRing)
+            snprintf(t_traceRing->name, sizeof(t_traceRing->name), "%s", name);
+        return t_traceRing;
+    }
+
+    int slot = __sync_fetch_and_add(&g_ringCount, 1);
+    trace_ring_t *r = NULL;
+    if(slot < TRACE_MAX_THREADS)
+        r = (trace_ring_t *)calloc(1, sizeof(trace_ring_t));
+    if(r == NULL) {
+        t_traceRing = &g_overflowRing;
+        return t_traceRing;
+    }
+
+    if(name != NULL)
+        snprintf(r->name, sizeof(r->name), "%s", name);
+    else
+        snprintf(r->name, sizeof(r->name), "thread-%u", (unsigned char)slot);
+    __atomic_store_n(&g_rings[slot], r, __ATOMIC_RELEASE);
+    t_traceRing = r;
+    return r;
+}
+
+string traceDump()
+{
+    string out;
+    trace_file_header_t fh;
+    memset(&fh, 0, sizeof(fh));
+    memcpy(fh.magic, TRACE_MAGIC, sizeof(fh.magic));
+    fh.version = TRACE_VERSION;
+    fh.eventSize = sizeof(trace_event_t);
+    out.append((const char *)&fh, sizeof(fh));
+
+    int rings = __atomic_load_n(&g_ringCount, __ATOMIC_ACQUIRE);
+    if(rings > TRACE_MAX_THREADS)
+        rings = TRACE_MAX_THREADS;
+
+    vector<trace_event_t> events;
+    events.reserve(TRACE_RING_SIZE);
+    for(int i = 0; i < rings; i++) {
+        trace_ring_t *r = __atomic_load_n(&g_rings[i], __ATOMIC_ACQUIRE);
+        if(r == NULL)
+            continue;
+
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        events.clear();
+        for(uint64_t k = first; k < head; k++)
+            events.push_back(r->events[k & (TRACE_RING_SIZE - 1)]);
+
+        // Whatever the writer reached meanwhile (plus the slot it may be
+        // writing right now) has overwritten the oldest copied entries
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t now = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t valid = now + 1 > TRACE_RING_SIZE ? now + 1 - TRACE_RING_SIZE : 0;
+        size_t skip = 0;
+        if(valid > first)
+            skip = (size_t)min(valid - first, (uint64_t)events.size());
+
+        trace_thread_header_t th;
+        memset(&th, 0, sizeof(th));
+        memcpy(th.name, r->name, sizeof(th.name));
+        th.name[sizeof(th.name) - 1] = '\0';
+        th.count = events.size() - skip;
+        th.lost = first + skip;
+        out.append((const char *)&th, sizeof(th));
+        if(th.count > 0)
+            out.append((const char *)&events[skip], th.count * sizeof(trace_event_t));
+        fh.threads++;
+    }
+
+    memcpy(&out[0], &fh, sizeof(fh));
+    return out;
+}
+
+unsigned int traceDumpMaxSize()
+{
+    return sizeof(trace_file_header_t) +
+           TRACE_MAX_THREADS * (sizeof(trace_thread_header_t) + TRACE_RING_SIZE * sizeof(trace_event_t));
+}
+
+int traceDumpToFile(const string &path)
+{
+    string data = traceDump();
+    string tmp = path + ".tmp";
+
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd == -1)
+        return -1;
+
+    size_t done = 0;
+    while(done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            int tmp_errno = errno;
+            close(fd);
+            unlink(tmp.c_str());
+            errno = tmp_errno;
+            return -1;
+        }
+        done += n;
+    }
+
+    if(close(fd) == -1 || rename(tmp.c_str(), path.c_str()) == -1) {
+        int tmp_errno = errno;
+        unlink(tmp.c_str());
+        errno = tmp_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/* -= Decoder =- */
+
+typedef struct {
+    trace_event_t event;
+    const char *thread;
+} decoded_event_t;
+
+static bool earlier(const decoded_event_t &x, const decoded_event_t &y)
+{
+    return x.event.ns < y.event.ns;
+}
+
+static void printEvent(FILE *out, double us, const char *thread, const trace_event_t *e)
+{
+    fprintf(out, "%12.3f %-10s ", us, thread);
+    switch(e->type) {
+    case TRACE_SENSOR:
+        fprintf(out, "sensor als=%d\n", e->a);
+        break;
+    case TRACE_LID:
+        fprintf(out, "lid %s\n", e->a == 1 ? "open" : e->a == 0 ? "closed" : "unknown");
+        break;
+    case TRACE_DECISION:
+        fprintf(out, "decision light=%d%% screen=%.2f%% keyboard=%.2f%%\n", e->a,
+                e->b * 100.0 / BRIGHTNESS_ONE, e->c * 100.0 / BRIGHTNESS_ONE);
+        break;
+    case TRACE_WRITE:
+        fprintf(out, "write %s value=%d %s\n", e->a == TRACE_DEV_SCREEN ? "screen" : "keyboard",
+                e->b, e->c == 1 ? "written" : e->c == 0 ? "skipped" : "error");
+        break;
+    case TRACE_REQUEST:
+        fprintf(out, "request type=%c id=%d conn=%d\n", (char)e->a, e->b, e->c);
+        break;
+    case TRACE_ENABLE:
+        fprintf(out, "%s\n", e->a ? "enable" : "disable");
+        break;
+    default:
+        fprintf(out, "event %u a=%d b=%d c=%d\n", e->type, e->a, e->b, e->c);
+        break;
+    }
+}
+
+int decodeTrace(const char *data, size_t length, FILE *out)
+{
+    trace_file_header_t fh;
+    if(length < sizeof(fh)) {
+        errno = EBADMSG;
+        return -1;
+    }
+    memcpy(&fh, data, sizeof(fh));
+    if(memcmp(fh.magic, TRACE_MAGIC, sizeof(fh.magic)) != 0 || fh.version != TRACE_VERSION ||
+            fh.eventSize != sizeof(trace_event_t) || fh.threads > TRACE_MAX_THREADS) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    vector<decoded_event_t> events;
+    vector<string> names(fh.threads);
+    size_t pos = sizeof(fh);
+    for(uint32_t t = 0; t < fh.threads; t++) {
+        trace_thread_header_t th;
+        if(length - pos < sizeof(th)) {
+            errno = EBADMSG;
+            return -1;
+        }
+        memcpy(&th, data + pos, sizeof(th));
+        pos += sizeof(th);
+        if((length - pos) / sizeof(trace_event_t) < th.count) {
+            errno = EBADMSG;
+            return -1;
+        }
+
+        th.name[sizeof(th.name) - 1] = '\0';
+        names[t] = th.name;
+        if(th.lost > 0)
+            fprintf(out, "# %s: %llu older events overwritten\n", th.name, (unsigned long long)th.lost);
+        for(uint32_t k = 0; k < th.count; k++) {
+            decoded_event_t d;
+            memcpy(&d.event, data + pos, sizeof(trace_event_t));
+            d.thread = names[t].c_str();
+            events.push_back(d);
+            pos += sizeof(trace_event_t);
+        }
+    }
+
+    stable_sort(events.begin(), events.end(), earlier);
+    for(size_t i = 0; i < events.size(); i++)
+        printEvent(out, (events[i].event.ns - events[0].event.ns) / 1000.0, events[i].thread, &events[i].event);
+    return 0;
+}
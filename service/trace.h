@@ -0,0 +1,125 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+#include "metrics.h"
+using namespace std;
+
+/*
+ * Per-thread trace rings.
+ *
+ * Every thread records its events in its own ring of TRACE_RING_SIZE
+ * entries, overwriting the oldest ones. Recording an event takes a clock
+ * read and a few stores: no lock, no system call, no allocation. Another
+ * thread can copy the rings at any time (traceDump()) without stopping
+ * the writers; entries overwritten during the copy are discarded.
+ *
+ * Tracing is compiled in unless ALS_NO_TRACE is defined.
+ */
+
+/** Entries per thread, a power of 2 */
+#define TRACE_RING_SIZE 2048
+/** Threads that can record events; events of further threads are dropped */
+#define TRACE_MAX_THREADS 8
+
+/** Event types and the meaning of their arguments */
+enum {
+    /** a: raw illuminance */
+    TRACE_SENSOR = 1,
+    /** a: lid state (see getLidStatus()) */
+    TRACE_LID,
+    /** a: illuminance percent, b: screen and c: keyboard brightness (BRIGHTNESS_ONE = 100%) */
+    TRACE_DECISION,
+    /** a: TRACE_DEV_*, b: value, c: result of BacklightWriter::set() */
+    TRACE_WRITE,
+    /** a: message type, b: request id, c: connection */
+    TRACE_REQUEST,
+    /** a: 1 if enabled, 0 if disabled */
+    TRACE_ENABLE
+};
+
+/** Devices of TRACE_WRITE events */
+#define TRACE_DEV_SCREEN   0
+#define TRACE_DEV_KEYBOARD 1
+
+typedef struct {
+    uint64_t ns;
+    uint16_t type;
+    uint16_t reserved;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+} trace_event_t;
+
+typedef struct {
+    char name[16];
+    /** number of events recorded so far; only the owner thread writes it */
+    uint64_t head;
+    trace_event_t events[TRACE_RING_SIZE];
+} trace_ring_t;
+
+/**
+ * Layout of a dump (traceDump(), the SIGUSR1 file and MSG_TRACE_DATA),
+ * in host byte order: a trace_file_header_t, then for each thread a
+ * trace_thread_header_t followed by its events, oldest first.
+ */
+#define TRACE_MAGIC "ALSTRACE"
+#define TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t eventSize;
+    uint32_t threads;
+    uint32_t reserved;
+} trace_file_header_t;
+
+typedef struct {
+    char name[16];
+    uint32_t count;
+    uint32_t reserved;
+    /** events overwritten before the dump */
+    uint64_t lost;
+} trace_thread_header_t;
+
+extern __thread trace_ring_t *t_traceRing;
+
+/** Gives a ring to the calling thread, named \a name (may be NULL) */
+trace_ring_t *traceThread(const char *name);
+
+/** Records an event in the ring of the calling thread */
+inline void trace(int type, int32_t a = 0, int32_t b = 0, int32_t c = 0)
+{
+#ifndef ALS_NO_TRACE
+    trace_ring_t *r = t_traceRing;
+    if(r == NULL)
+        r = traceThread(NULL);
+    uint64_t h = r->head;
+    trace_event_t *e = &r->events[h & (TRACE_RING_SIZE - 1)];
+    e->ns = metricsClockNs();
+    e->type = type;
+    e->a = a;
+    e->b = b;
+    e->c = c;
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+#endif
+}
+
+/** Copies the rings of all the threads */
+string traceDump();
+/** Largest possible traceDump() */
+unsigned int traceDumpMaxSize();
+/**
+ * Writes traceDump() to \a path, replacing it atomically.
+ * \retval 0 if ok, -1 on error (sets errno)
+ */
+int traceDumpToFile(const string &path);
+/**
+ * Prints the events of a dump to \a out, merged in time order.
+ * \retval 0 if ok, -1 if the dump is invalid (sets errno)
+ */
+int decodeTrace(const char *data, size_t length, FILE *out);
+
+#endif // TRACE_H